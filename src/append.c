@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "append.h"
+
+int appender_open(struct appender *a, const char *path) {
+    a->end = VAAR_ARCHIVE_MAGIC_LEN;
+    a->max_anchor = 0;
+    struct reader *r = &a->r;
+    if (reader_open(r, path))
+        return 1;
+    if (r->framed) {
+        fprintf(stderr, "only uncompressed archive files can be appended to\n");
+        return 1;
+    }
+
+    if (r->toc) {
+        /* The table is only written after all the entries, which are complete then. */
+        a->end = r->len;
+        for (uint64_t i = 0; i < r->toc_cnt; i++) {
+            uint32_t anchor = le32toh(r->toc[i].link_anchor);
+            if (anchor > a->max_anchor)
+                a->max_anchor = anchor;
+        }
+        return 0;
+    }
+    int ret;
+    while ((ret = reader_next(r)) > 0) {
+        a->end = r->off;
+        if (r->hdr->link_anchor > a->max_anchor)
+            a->max_anchor = r->hdr->link_anchor;
+    }
+    if (ret < 0)
+        fprintf(stderr, "cutting off %lu bytes after the last complete entry\n", r->map_len - a->end);
+    return 0;
+}
+
+int appender_restore(struct appender *a, struct writer *w) {
+    struct reader *r = &a->r;
+    if (w->toc && r->toc) {
+        for (uint64_t i = 0; i < r->toc_cnt; i++) {
+            struct toc_entry e = {
+                    .off = le64toh(r->toc[i].off),
+                    .size = le64toh(r->toc[i].size),
+                    .link_anchor = le32toh(r->toc[i].link_anchor),
+                    .type = r->toc[i].type,
+            };
+            size_t len;
+            const char *name = toc_entry_name(r, r->toc + i, &len);
+            e.name_len = (uint16_t) len;
+            if (writer_add_toc(w, &e, name))
+                return 1;
+        }
+    } else if (w->toc) {
+        /* Asked for a table that the archive doesn't have yet. The headers have to be read again. */
+        r->off = VAAR_ARCHIVE_MAGIC_LEN;
+        while (r->off < a->end && reader_next(r) > 0) {
+            int len;
+            const char *name = file_header_name(r->hdr, &len);
+            struct toc_entry e = {
+                    .off = r->hdr_off,
+                    .size = r->hdr->size,
+                    .link_anchor = r->hdr->link_anchor,
+                    .name_len = (uint16_t) len,
+                    .type = r->hdr->type,
+            };
+            if (writer_add_toc(w, &e, name))
+                return 1;
+        }
+    }
+    if (ftruncate(w->fd, (off_t) a->end)) {
+        perror("ftruncate");
+        return 1;
+    }
+    return 0;
+}
+
+void appender_close(struct appender *a) {
+    reader_close(&a->r);
+}
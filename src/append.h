@@ -0,0 +1,34 @@
+#ifndef VAAR_APPEND_H
+#define VAAR_APPEND_H
+
+#include <stdint.h>
+
+#include "reader.h"
+#include "writer.h"
+
+/*
+ * An uncompressed archive being appended to.
+ * Where it ends is told by its table of contents if it has one, which is then overwritten by the one written
+ * after the new entries. Otherwise the headers are read up to the last complete entry, and whatever broken
+ * follows it, e.g. left by an interrupted run, is cut off.
+ */
+struct appender {
+    struct reader r;
+    uint64_t end; /* where the new entries go */
+    uint32_t max_anchor; /* the largest hard link anchor in the archive, for new ones to follow */
+};
+
+/*
+ * Find where the archive at path ends. The appender must be closed even if it fails.
+ */
+int appender_open(struct appender *a, const char *path);
+
+/*
+ * Get the writer of the archive ready to go on at the end: the entries so far are added to its table of contents
+ * if it's turned on, and what's after the end is cut off.
+ */
+int appender_restore(struct appender *a, struct writer *w);
+
+void appender_close(struct appender *a);
+
+#endif //VAAR_APPEND_H
@@ -1,230 +1,1003 @@
 #include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <liburing.h>
 #include <malloc.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sysmacros.h>
 
 #include "archive.h"
 #include "buf_pool.h"
 #include "dir_entry.h"
+#include "extent.h"
+#include "futex.h"
+#include "link_table.h"
+#include "manifest.h"
 #include "path.h"
+#include "sequencer.h"
+#include "work_deque.h"
 #include "writer.h"
 
-const int DIR_BUF_SIZE = 1 << 20; // 1 MiB
-const int MAX_DIR_DEPTH = 256;
+const int DIR_QUEUE_SIZE = 4096;
 
 const int RING_DEPTH = 8192;
 const int SUBMIT_THRESHOLD = 4096;
 
+/* Buffers for inlining files larger than the one in items, sharing half of the memory budget evenly. */
+#define INLINE_CLASS_CNT 3
+const uint32_t INLINE_CLASS_SIZES[INLINE_CLASS_CNT] = {16 << 10, 64 << 10, 256 << 10};
+/* Keep enough items in flight to hide the latency, whatever the budget. */
+const uint32_t MIN_ITEM_COUNT = 256;
+const int MIN_OPEN_DIRS = 16;
+/* Smaller files take less room than the name of an earlier file to refer to. */
+const uint64_t DEDUP_MIN_SIZE = 512;
+
+struct walker;
+struct shard;
+
 /*
  * The context of writing the archive. Shared among threads.
  */
 struct archive_context {
-    pthread_mutex_t *lock;
-    struct io_uring *ring;
+    struct sequencer *seq;
     struct buf_pool *item_pool;
-    int emitted, done;
+    struct class_pool *inline_pool;
+    uint64_t inline_max; /* files up to this size are read into memory and written inline */
+    struct link_table *links; /* files with several names written so far, or NULL to write them all in full */
+    int dedup; /* whether regular files are matched against earlier contents by the writer */
+    int root_len; /* of the path given to be archived, which all the others are beneath */
+    struct manifest *manifest; /* files of the previous run, or NULL to write everything */
+    int read_window; /* reads are sorted by physical offset in windows of this many items, or 0 */
+    struct walker *walkers;
+    int walker_cnt;
+    struct shard *shards;
+    int shard_cnt;
+    uint64_t dir_ids; /* the last id given to a dir_ref */
+    int done;
+    int pending; /* directories queued or being walked, and entries in flight */
+    int idle; /* walkers asleep, waiting for directories */
+    int wakeups; /* bumped to wake them up */
+    int open_dirs; /* directories opened by walkers and not closed yet */
+    int max_open_dirs; /* so that a wide tree can't use up the fds */
+    int dir_waiters; /* walkers waiting for one to be closed */
+    int dir_closes; /* bumped to wake them up */
+    int failed;
+};
+
+/*
+ * An io_uring with its own completion handler thread.
+ */
+struct shard {
+    struct archive_context *ctx;
+    struct io_uring ring;
+    pthread_mutex_t submit_lock; /* guards the submission queue of ring */
+    int direct; /* whether regular files are opened as fixed files, linked with their reads */
+    /* handlers need separated writers too */
+    struct writer w;
+    struct path_buf path; /* the path of the item being advanced */
+    uint64_t path_dir; /* the id of the directory in path */
+    struct item **window; /* opened files waiting for their first read */
+    int window_cnt;
+    int emitted;
+    int cpu; /* the CPU to pin the handler to, or -1 */
+    pthread_t tid;
+};
+
+/*
+ * A directory to be walked. It's queued with its parent, and only opened relative to it when a walker takes it,
+ * so the queue costs no fds however wide the tree is. Then it's kept open as long as any entry in it is in flight.
+ * The path is built once for the directory, and shared by all its entries.
+ */
+struct dir_ref {
+    struct dir_ref *next; /* in an inbox */
+    struct archive_context *ctx;
+    struct dir_ref *parent; /* NULL for the root, which is opened by its path */
+    uint64_t id;
+    int fd; /* -1 until it's walked */
+    int refs; /* on fd: the walker walking it, and its entries in flight */
+    int holds; /* on the memory: its own until fd is closed, and one for each subdirectory */
+    int path_len;
+    char path[];
 };
 
 /*
- * A file being processed. Used in user data of io_uring.
+ * Operations on items, tagged in the low bits of the user data.
+ */
+enum {
+    OP_STATX,
+    OP_OPEN, /* to a plain fd */
+    OP_OPEN_DIRECT, /* to the fixed file slot of the item */
+    OP_READ,
+    OP_CLOSE_DIRECT,
+};
+
+const uintptr_t OP_MASK = 7;
+
+/*
+ * A directory entry being processed. Used in user data of io_uring.
  */
 struct item {
-    char name[256];
-    char buf[4096];
+    char name[256]; /* the basename */
+    int name_len;
+    char buf[4096]; /* the first read goes here, speculating that the file is small */
+    char *data; /* the content read so far: buf, or a buffer from inline_pool */
+    int data_class; /* the class of data in inline_pool, or -1 for buf */
     struct statx sbuf;
+    struct dir_ref *dir;
+    struct walker *walker; /* who found it */
+    unsigned char type; /* d_type, which may be DT_UNKNOWN */
+    int slot; /* fixed file slot, unique among all items */
+    uint64_t phys; /* where the content starts on the device, with read windows */
     int fd;
-    int bytes;
-    int cnt;
-};
+    uint64_t bytes;
+    int stat_done, read_done;
+    int checked; /* against the manifest */
+    int cnt; /* operations in flight */
+    struct archive_context *ctx;
+    struct record rec;
+    struct file_header *long_hdr; /* a header too long for hdr, if any */
+    char *dedup_path; /* the full path, if the content is to be matched against earlier ones */
+    struct file_header hdr;
+} __attribute__((aligned(8)));
 
 const int ITEM_BUF_SIZE = sizeof(struct item);
 const int MAX_ITEM_COUNT = (RING_DEPTH * 2);
 
-int walk_path(struct archive_context *ctx, struct writer *w, const char *path, int dir_fd, struct buf_pool *pool) {
-    void *buf = buf_pool_get(pool);
-    ssize_t n;
-    while ((n = get_dir_entries(dir_fd, buf, DIR_BUF_SIZE)) > 0) {
-        struct dir_reader r;
-        dir_reader_init(&r, buf, n);
-        struct dir_entry *e;
-        while ((e = dir_reader_next(&r))) {
-            if (e->type == DT_REG) {
-                int file_fd = openat(dir_fd, e->name, O_RDONLY);
-                if (file_fd < 0) {
-                    perror("openat");
-                    dir_reader_free(&r);
-                    buf_pool_put(pool, buf);
-                    return 1;
-                }
+/*
+ * A directory walker thread. Each one walks the directories in its own deque and steals from others when idle.
+ */
+struct walker {
+    struct archive_context *ctx;
+    struct shard *shard; /* where entries are submitted */
+    struct work_deque deque;
+    struct dir_reader reader;
 
-                struct item *res = buf_pool_get(ctx->item_pool);
-                join_path(path, e->name, res->name);
-                res->fd = file_fd;
-                res->cnt = 2;
-
-                struct io_uring_sqe *sqe;
-                while (!(sqe = io_uring_get_sqe(ctx->ring))) {}
-                io_uring_prep_statx(sqe, file_fd, "", AT_EMPTY_PATH, STATX_ALL, &res->sbuf);
-                io_uring_sqe_set_data(sqe, res);
-                while (!(sqe = io_uring_get_sqe(ctx->ring))) {}
-                io_uring_prep_read(sqe, file_fd, res->buf, 4096, 0);
-                io_uring_sqe_set_data(sqe, res);
-
-                __atomic_add_fetch(&ctx->emitted, 1, __ATOMIC_RELEASE);
-                while (io_uring_sq_ready(ctx->ring) >= SUBMIT_THRESHOLD)
-                    if (io_uring_submit(ctx->ring) > 0)
-                        break;
-                continue;
-            }
+    /* directories found by handlers, to be moved into the deque by the walker */
+    pthread_mutex_t inbox_lock;
+    struct dir_ref *inbox;
 
-            /* Synced operation for non-regular files. */
-            char file_path[256];
-            join_path(path, e->name, file_path);
-            struct statx sbuf;
-            size_t ret = statx(dir_fd, e->name, AT_SYMLINK_NOFOLLOW, STATX_ALL, &sbuf);
-            if (ret) {
-                perror("statx");
-                dir_reader_free(&r);
-                buf_pool_put(pool, buf);
-                return 1;
-            }
-            int file_fd = 0;
-            if (!is_symlink(&sbuf)) {
-                file_fd = openat(dir_fd, e->name, O_RDONLY);
-                if (file_fd < 0) {
-                    perror("openat");
-                    dir_reader_free(&r);
-                    buf_pool_put(pool, buf);
-                    return 1;
-                }
-            }
-            if (is_symlink(&sbuf))
-                if (writer_prepare_link(w, dir_fd, e->name)) {
-                    dir_reader_free(&r);
-                    buf_pool_put(pool, buf);
-                    return 1;
+    unsigned int seed;
+    pthread_t tid;
+};
+
+int shard_init(struct shard *sh) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    /* Each item has up to 4 completions pending. Keep them all in the CQ. */
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = MAX_ITEM_COUNT * 4;
+    int ret = io_uring_queue_init_params(RING_DEPTH, &sh->ring, &p);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    /*
+     * Linking a read to the direct open of its fixed file needs the file to be looked up at execution.
+     * Fall back to plain fds without that.
+     */
+    sh->direct = 0;
+    if (p.features & IORING_FEAT_LINKED_FILE) {
+        int *fds = malloc(sizeof(int) * MAX_ITEM_COUNT);
+        if (fds == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        memset(fds, -1, sizeof(int) * MAX_ITEM_COUNT);
+        sh->direct = io_uring_register_files(&sh->ring, fds, MAX_ITEM_COUNT) == 0;
+        free(fds);
+    }
+    return 0;
+}
+
+/*
+ * Make a reference to a directory in parent, opened already or not (fd -1). It's not held by anyone yet.
+ */
+struct dir_ref *dir_ref_new(struct archive_context *ctx, struct dir_ref *parent, int fd, const char *path,
+                            int path_len) {
+    struct dir_ref *d = malloc(sizeof(struct dir_ref) + path_len + 1);
+    if (d == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    d->next = NULL;
+    d->ctx = ctx;
+    d->parent = parent;
+    if (parent)
+        __atomic_add_fetch(&parent->holds, 1, __ATOMIC_RELAXED);
+    d->id = __atomic_add_fetch(&ctx->dir_ids, 1, __ATOMIC_RELAXED);
+    d->fd = fd;
+    d->refs = 0;
+    d->holds = 1;
+    d->path_len = path_len;
+    memcpy(d->path, path, path_len);
+    d->path[path_len] = '\0';
+    return d;
+}
+
+/*
+ * Count a directory as open if fewer than the maximum are. Returns 0 if they're used up.
+ */
+int dir_open_try_take(struct archive_context *ctx) {
+    int n = __atomic_load_n(&ctx->open_dirs, __ATOMIC_RELAXED);
+    while (n < ctx->max_open_dirs)
+        if (__atomic_compare_exchange_n(&ctx->open_dirs, &n, n + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+/*
+ * Drop a hold on the memory of a directory, and free it with the last one, along with the hold on its parent.
+ */
+void dir_ref_release(struct dir_ref *d) {
+    while (d && __atomic_sub_fetch(&d->holds, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct dir_ref *parent = d->parent;
+        free(d);
+        d = parent;
+    }
+}
+
+/*
+ * Take a reference on the fd of a walked directory, if it's still open. Returns 0 if it's been closed.
+ */
+int dir_ref_try_get(struct dir_ref *d) {
+    int n = __atomic_load_n(&d->refs, __ATOMIC_RELAXED);
+    while (n > 0)
+        if (__atomic_compare_exchange_n(&d->refs, &n, n + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return 1;
+    return 0;
+}
+
+/*
+ * Drop a reference on the fd of a directory, and close it with the last one.
+ */
+void dir_ref_put(struct dir_ref *d) {
+    if (__atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (d->fd >= 0) {
+        struct archive_context *ctx = d->ctx;
+        if (close(d->fd))
+            perror("close");
+        __atomic_sub_fetch(&ctx->open_dirs, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctx->dir_waiters, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&ctx->dir_closes, 1, __ATOMIC_RELEASE);
+            futex_wake(&ctx->dir_closes, 1);
+        }
+    }
+    /* Its subdirectories still queued hold the memory, to find an ancestor to be opened relative to. */
+    dir_ref_release(d);
+}
+
+/*
+ * Open a directory relative to the closest ancestor still open, which is its parent as long as any entry of the
+ * parent is in flight. If none is, the root is opened by its path again. The names in between are opened one at
+ * a time, so the path may be longer than PATH_MAX, and none of them is followed if it's a symlink.
+ * Returns the fd, or -1 with errno set.
+ */
+int dir_ref_openat(struct dir_ref *d) {
+    struct dir_ref *a = d->parent, *top = d;
+    while (a && !dir_ref_try_get(a)) {
+        top = a;
+        a = a->parent;
+    }
+    if (a) {
+        int fd = path_openat(a->fd, d->path + a->path_len, O_RDONLY | O_DIRECTORY);
+        int err = errno;
+        dir_ref_put(a);
+        errno = err;
+        return fd;
+    }
+    int root_fd = open(top->path, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0 || top == d)
+        return root_fd;
+    int fd = path_openat(root_fd, d->path + top->path_len, O_RDONLY | O_DIRECTORY);
+    int err = errno;
+    close(root_fd);
+    errno = err;
+    return fd;
+}
+
+/*
+ * Open a directory taken by a walker, first waiting for another one to be closed if too many are open.
+ * They're closed as their entries finish, which the handlers do on their own.
+ */
+int dir_ref_open(struct archive_context *ctx, struct dir_ref *d) {
+    while (!dir_open_try_take(ctx)) {
+        int closes = __atomic_load_n(&ctx->dir_closes, __ATOMIC_ACQUIRE);
+        /* Announce the wait before the last try, so a close in between either shows up or wakes us. */
+        __atomic_add_fetch(&ctx->dir_waiters, 1, __ATOMIC_SEQ_CST);
+        int taken = dir_open_try_take(ctx);
+        if (!taken)
+            futex_wait(&ctx->dir_closes, closes);
+        __atomic_sub_fetch(&ctx->dir_waiters, 1, __ATOMIC_RELAXED);
+        if (taken)
+            break;
+    }
+    if ((d->fd = dir_ref_openat(d)) < 0) {
+        perror(d->path);
+        __atomic_sub_fetch(&ctx->open_dirs, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Give the item back to the pool.
+ */
+void item_release(struct item *res) {
+    buf_pool_put(res->ctx->item_pool, res);
+}
+
+/*
+ * Release the item along with its fd and content.
+ */
+void item_drop(struct item *res) {
+    if (res->fd >= 0)
+        close(res->fd);
+    if (res->data_class >= 0)
+        class_pool_put(res->ctx->inline_pool, res->data_class, res->data);
+    free(res->long_hdr);
+    free(res->dedup_path);
+    item_release(res);
+}
+
+/*
+ * Called by the sequencer when the item has been written.
+ */
+void item_done(struct record *r) {
+    item_drop((void *) r - offsetof(struct item, rec));
+}
+
+/*
+ * A record of a file without content (directory or symlink), with the header allocated along.
+ */
+struct meta_record {
+    struct record rec;
+    char hdr[];
+};
+
+void meta_record_done(struct record *r) {
+    free(r);
+}
+
+/*
+ * Queue the header prepared in w for writing, with no content.
+ */
+int push_meta_record(struct archive_context *ctx, struct writer *w) {
+    int hdr_len = writer_header_length(w);
+    struct meta_record *m = malloc(sizeof(struct meta_record) + hdr_len);
+    if (m == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(m->hdr, w->hdr_buf, hdr_len);
+    m->rec.hdr = (struct file_header *) m->hdr;
+    m->rec.buf = NULL;
+    m->rec.fd = -1;
+    m->rec.path = NULL;
+    m->rec.len = 0;
+    m->rec.done = meta_record_done;
+    sequencer_push(ctx->seq, &m->rec);
+    return 0;
+}
+
+/*
+ * Get an SQE of the shard, submitting queued ones if the SQ is full. The submit lock must be held.
+ */
+struct io_uring_sqe *shard_get_sqe(struct shard *sh, struct item *res, int op) {
+    struct io_uring_sqe *sqe;
+    while (!(sqe = io_uring_get_sqe(&sh->ring))) {
+        /* Submitting frees the whole SQ. The CQ holds every completion of all items, so it can't be busy. */
+        int ret = io_uring_submit(&sh->ring);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            exit(1);
+        }
+    }
+    res->cnt++;
+    io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) res | op));
+    return sqe;
+}
+
+/*
+ * Get the bytes the item can read into data.
+ */
+uint32_t item_capacity(struct item *res) {
+    if (res->data_class < 0)
+        return sizeof(res->buf);
+    return res->ctx->inline_pool->classes[res->data_class].size;
+}
+
+/*
+ * Queue the operations to open the item, and read it into data if it's a regular file.
+ * The submit lock must be held.
+ */
+void submit_open(struct shard *sh, struct item *res) {
+    struct io_uring_sqe *sqe;
+    if (res->type == DT_REG && sh->direct && !sh->ctx->read_window) {
+        /* The fd never reaches userspace: open into the fixed slot, read from it and close it in one chain. */
+        sqe = shard_get_sqe(sh, res, OP_OPEN_DIRECT);
+        io_uring_prep_openat_direct(sqe, res->dir->fd, res->name, O_RDONLY, 0, res->slot);
+        io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+        sqe = shard_get_sqe(sh, res, OP_READ);
+        io_uring_prep_read(sqe, res->slot, res->data + res->bytes, item_capacity(res) - res->bytes, res->bytes);
+        /* A short read breaks a normal link, but the slot has to be closed anyway. */
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+        sqe = shard_get_sqe(sh, res, OP_CLOSE_DIRECT);
+        io_uring_prep_close_direct(sqe, res->slot);
+        return;
+    }
+    sqe = shard_get_sqe(sh, res, OP_OPEN);
+    io_uring_prep_openat(sqe, res->dir->fd, res->name, O_RDONLY, 0);
+}
+
+void submit_read(struct shard *sh, struct item *res) {
+    struct io_uring_sqe *sqe = shard_get_sqe(sh, res, OP_READ);
+    io_uring_prep_read(sqe, res->fd, res->data + res->bytes, item_capacity(res) - res->bytes, res->bytes);
+}
+
+/*
+ * Submit everything queued in the shard.
+ */
+int shard_flush(struct shard *sh) {
+    if (pthread_mutex_lock(&sh->submit_lock)) {
+        perror("pthread_mutex_lock");
+        return 1;
+    }
+    int ret = io_uring_sq_ready(&sh->ring) ? io_uring_submit(&sh->ring) : 0;
+    if (pthread_mutex_unlock(&sh->submit_lock)) {
+        perror("pthread_mutex_unlock");
+        return 1;
+    }
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Wake up the idle walkers, after queuing directories or finishing the last thing pending.
+ */
+void walkers_wake(struct archive_context *ctx) {
+    /* Pairs with the announcement in walker_main, so either the walker sees the change or we see it idle. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->idle, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&ctx->wakeups, 1, __ATOMIC_RELEASE);
+        futex_wake(&ctx->wakeups, INT_MAX);
+    }
+}
+
+/*
+ * Mark something pending as finished, and let the idle walkers see if it was the last.
+ */
+void pending_done(struct archive_context *ctx) {
+    if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_RELEASE) == 0)
+        walkers_wake(ctx);
+}
+
+/*
+ * Hand a directory found by a handler to the walker of its parent.
+ */
+void inbox_push(struct walker *wk, struct dir_ref *t) {
+    pthread_mutex_lock(&wk->inbox_lock);
+    t->next = wk->inbox;
+    wk->inbox = t;
+    pthread_mutex_unlock(&wk->inbox_lock);
+    /* Only the walker itself takes from the inbox, but whoever is woken up might steal what it moves on. */
+    walkers_wake(wk->ctx);
+}
+
+/*
+ * Move directories in the inbox into the deque, as far as it has room.
+ */
+void inbox_drain(struct walker *wk) {
+    if (__atomic_load_n(&wk->inbox, __ATOMIC_RELAXED) == NULL)
+        return;
+    int moved = 0;
+    pthread_mutex_lock(&wk->inbox_lock);
+    while (wk->inbox && !work_deque_push(&wk->deque, wk->inbox)) {
+        wk->inbox = wk->inbox->next;
+        moved++;
+    }
+    pthread_mutex_unlock(&wk->inbox_lock);
+    if (moved > 1)
+        /* More than this walker takes next. Let the idle ones steal the rest. */
+        walkers_wake(wk->ctx);
+}
+
+/*
+ * Submit the metadata operations of all the entries in a directory. The walker takes the reference over.
+ * The walker never blocks on the entries. Everything else is done by the handlers as the operations complete.
+ */
+int walk_path(struct walker *wk, struct dir_ref *dir) {
+    struct archive_context *ctx = wk->ctx;
+    struct shard *sh = wk->shard;
+    struct dir_reader *r = &wk->reader;
+
+    dir->refs = 1;
+    int ret = 0;
+    if (dir->fd < 0 && dir_ref_open(ctx, dir)) {
+        ret = 1;
+        goto exit;
+    }
+    dir_reader_open(r, dir->fd);
+    int n;
+    while ((n = dir_reader_fill(r)) > 0) {
+        struct dir_entry *e;
+        while ((e = dir_reader_next(r))) {
+            struct item *res = buf_pool_try_get(ctx->item_pool);
+            if (res == NULL) {
+                /*
+                 * The budget is used up, and items only come back after being written.
+                 * Submit what's queued so the ones in flight can finish, and sleep until one is back.
+                 */
+                if (shard_flush(sh)) {
+                    ret = 1;
+                    goto exit;
                 }
-            if (writer_prepare_statx(w, path, &sbuf)) {
-                dir_reader_free(&r);
-                buf_pool_put(pool, buf);
-                return 1;
+                res = buf_pool_get(ctx->item_pool);
             }
-            if (pthread_mutex_lock(ctx->lock)) {
+            __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+
+            /* Only the basename is kept. The full path is built from the directory when it's needed. */
+            res->name_len = (int) strlen(e->name);
+            memcpy(res->name, e->name, res->name_len + 1);
+            res->ctx = ctx;
+            res->dir = dir;
+            res->walker = wk;
+            res->type = e->type;
+            res->slot = (int) buf_pool_index(ctx->item_pool, res);
+            res->fd = -1;
+            res->data = res->buf;
+            res->data_class = -1;
+            res->bytes = 0;
+            res->stat_done = res->read_done = 0;
+            res->checked = 0;
+            res->cnt = 0;
+            res->long_hdr = NULL;
+            res->dedup_path = NULL;
+
+            if (pthread_mutex_lock(&sh->submit_lock)) {
                 perror("pthread_mutex_lock");
-                return 1;
-            }
-            if (writer_execute_fd(w, file_fd, sbuf.stx_size)) {
-                dir_reader_free(&r);
-                buf_pool_put(pool, buf);
-                return 1;
+                /* It's not submitted. Give back what it took. */
+                __atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_RELAXED);
+                dir_ref_put(dir);
+                item_release(res);
+                ret = 1;
+                goto exit;
             }
-            if (pthread_mutex_unlock(ctx->lock)) {
+            struct io_uring_sqe *sqe = shard_get_sqe(sh, res, OP_STATX);
+            io_uring_prep_statx(sqe, dir->fd, res->name, AT_SYMLINK_NOFOLLOW, STATX_ALL, &res->sbuf);
+            if (e->type == DT_REG && !ctx->manifest)
+                submit_open(sh, res);
+            /*
+             * Other types wait for statx to tell what they are.
+             * So do regular files with a manifest, which aren't opened at all if they haven't changed.
+             * Directories are opened by the walker that takes them.
+             */
+
+            __atomic_add_fetch(&sh->emitted, 1, __ATOMIC_RELEASE);
+            while (io_uring_sq_ready(&sh->ring) >= SUBMIT_THRESHOLD)
+                if (io_uring_submit(&sh->ring) > 0)
+                    break;
+            if (pthread_mutex_unlock(&sh->submit_lock)) {
                 perror("pthread_mutex_unlock");
-                return 1;
+                ret = 1;
+                goto exit;
             }
-            if (is_dir(&sbuf))
-                walk_path(ctx, w, file_path, file_fd, pool);
-            if (file_fd > 0)
-                if (close(file_fd)) {
-                    perror("close");
-                    dir_reader_free(&r);
-                    buf_pool_put(pool, buf);
-                    return 1;
-                }
         }
-        dir_reader_free(&r);
+        /*
+         * Don't let the entries of this window wait for the threshold.
+         * Their operations run while the next window is read.
+         */
+        if (shard_flush(sh)) {
+            ret = 1;
+            goto exit;
+        }
     }
-    buf_pool_put(pool, buf);
-    return 0;
+    ret = n < 0;
+
+    exit:
+    /* Entries in flight hold their own references. */
+    dir_ref_put(dir);
+    return ret;
 }
 
-struct item_handler_args {
-    struct archive_context *ctx;
-    struct writer *w;
-};
+/*
+ * Try stealing a directory from other walkers, starting from a random one.
+ */
+struct dir_ref *steal_dir(struct walker *wk) {
+    struct archive_context *ctx = wk->ctx;
+    int start = rand_r(&wk->seed) % ctx->walker_cnt;
+    for (int i = 0; i < ctx->walker_cnt; i++) {
+        struct walker *victim = ctx->walkers + (start + i) % ctx->walker_cnt;
+        if (victim == wk)
+            continue;
+        struct dir_ref *t = work_deque_steal(&victim->deque);
+        if (t)
+            return t;
+    }
+    return NULL;
+}
 
-// FIXME: error handling here is a mess
-void item_handler(struct item_handler_args *args) {
-    /* Handler thread need a separated context for temp data. */
-    struct archive_context *ctx = args->ctx;
-    struct writer *w = args->w;
+/*
+ * Take a directory to walk, from the walker's own inbox and deque, or from others.
+ */
+struct dir_ref *find_dir(struct walker *wk) {
+    inbox_drain(wk);
+    struct dir_ref *t = work_deque_take(&wk->deque);
+    return t ? t : steal_dir(wk);
+}
 
-    int read_count = 0;
-    while (1) {
-        struct io_uring_cqe *cqe;
-        int ret = io_uring_wait_cqe(ctx->ring, &cqe);
-        if (ret < 0) {
-            perror("io_uring_wait_cqe");
-            exit(1);
+void *walker_main(struct walker *wk) {
+    struct archive_context *ctx = wk->ctx;
+    while (!__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED)) {
+        struct dir_ref *t = find_dir(wk);
+        if (t == NULL) {
+            int wakeups = __atomic_load_n(&ctx->wakeups, __ATOMIC_ACQUIRE);
+            /* Announce the sleep before the last look, so a directory queued in between either shows up or wakes us. */
+            __atomic_add_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+            t = find_dir(wk);
+            int done = t == NULL && !__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE);
+            if (t == NULL && !done)
+                /* Directories are only found by handlers as entries complete. Sleep until one is queued. */
+                futex_wait(&ctx->wakeups, wakeups);
+            __atomic_sub_fetch(&ctx->idle, 1, __ATOMIC_RELAXED);
+            if (done)
+                /* Nothing queued, nobody is walking, and no entry is in flight. All done. */
+                break;
+            if (t == NULL)
+                continue;
         }
-        struct item *res = io_uring_cqe_get_data(cqe);
-        if (cqe->res < 0) {
-            fprintf(stderr, "async op failed: %d\n", cqe->res);
+        if (walk_path(wk, t))
+            __atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+        pending_done(ctx);
+    }
+    /* Others may be asleep, with nothing left or after a failure. */
+    walkers_wake(ctx);
+    return NULL;
+}
+
+int item_phys_comp(const void *a, const void *b) {
+    const struct item *item_a = *(struct item *const *) a, *item_b = *(struct item *const *) b;
+    if (item_a->phys != item_b->phys)
+        return item_a->phys < item_b->phys ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Submit the first reads of the files in the window, in the order they are laid out on the device.
+ */
+void window_flush(struct shard *sh) {
+    qsort(sh->window, sh->window_cnt, sizeof(struct item *), item_phys_comp);
+    pthread_mutex_lock(&sh->submit_lock);
+    for (int i = 0; i < sh->window_cnt; i++)
+        submit_read(sh, sh->window[i]);
+    io_uring_submit(&sh->ring);
+    pthread_mutex_unlock(&sh->submit_lock);
+    sh->window_cnt = 0;
+}
+
+/*
+ * Hold the first read of an opened file back until the window is full, or nothing else is ready.
+ */
+void window_add(struct shard *sh, struct item *res) {
+    res->phys = res->sbuf.stx_size ? file_first_extent(res->fd) : 0;
+    sh->window[sh->window_cnt++] = res;
+    if (sh->window_cnt == sh->ctx->read_window)
+        window_flush(sh);
+}
+
+/*
+ * Get the full path of the item, built in the path of the shard.
+ * Entries of a directory tend to complete together, and then only the basename is replaced.
+ */
+const char *item_path(struct shard *sh, struct item *res) {
+    struct path_buf *p = &sh->path;
+    if (sh->path_dir != res->dir->id) {
+        path_pop(p, 0);
+        if (path_push(p, res->dir->path, res->dir->path_len) < 0)
             exit(1);
-        }
-        if (cqe->res > 0)
-            /* Returned from read(2). */
-            res->bytes = cqe->res;
-        io_uring_cqe_seen(ctx->ring, cqe);
-        if (--res->cnt > 0)
-            /* Not all operations have been processed. */
-            continue;
+        sh->path_dir = res->dir->id;
+    }
+    /* Pop back to the directory, wherever it ends after the separator. */
+    path_pop(p, res->dir->path_len);
+    if (path_push(p, res->name, res->name_len) < 0)
+        exit(1);
+    return p->buf;
+}
 
-        if (writer_prepare_statx(w, res->name, &res->sbuf)) {
+/*
+ * Write the prepared item as a hard link to anchor, and finish it. The stripe of the file must be locked.
+ */
+void push_hard_link(struct shard *sh, struct item *res, uint32_t anchor) {
+    writer_prepare_hard_link(&sh->w, anchor, 0);
+    if (push_meta_record(sh->ctx, &sh->w))
+        exit(1);
+    dir_ref_put(res->dir);
+    item_drop(res);
+}
+
+/*
+ * Finish the item as a hard link if another name of the file has been written, before reading any more of it.
+ * Returns 1 if the item is finished.
+ */
+int item_linked(struct shard *sh, struct item *res) {
+    struct statx *s = &res->sbuf;
+    uint64_t dev = makedev(s->stx_dev_major, s->stx_dev_minor);
+    struct link_stripe *st = link_table_lock(sh->ctx->links, dev, s->stx_ino);
+    uint32_t anchor = link_table_find(st, dev, s->stx_ino);
+    if (anchor) {
+        if (writer_prepare_statx(&sh->w, item_path(sh, res), s)) {
             fprintf(stderr, "writer_prepare_statx failed\n");
             exit(1);
         }
+        push_hard_link(sh, res, anchor);
+    }
+    link_table_unlock(st);
+    return anchor != 0;
+}
 
-        if (pthread_mutex_lock(ctx->lock)) {
-            perror("pthread_mutex_lock");
-            exit(1);
+/*
+ * Record the item in the manifest, and finish it if it hasn't changed since the previous run.
+ * Directories are always written, so that what's changed under them can be extracted on its own.
+ * Returns 1 if the item is finished.
+ */
+int item_unchanged(struct shard *sh, struct item *res) {
+    const char *path = item_path(sh, res);
+    int off = clean_path(path);
+    if (off < 0)
+        /* Left for writer_prepare_statx to complain about. */
+        return 0;
+    int ret = manifest_check(sh->ctx->manifest, path + off, strlen(path + off), &res->sbuf);
+    if (ret < 0)
+        exit(1);
+    if (ret == 0 || is_dir(&res->sbuf))
+        return 0;
+    dir_ref_put(res->dir);
+    item_drop(res);
+    return 1;
+}
+
+/*
+ * Move an item forward once all its operations have completed.
+ * Returns 1 if the item is finished, or 0 if more operations have been submitted.
+ */
+int item_advance(struct shard *sh, struct item *res) {
+    struct archive_context *ctx = sh->ctx;
+    struct writer *w = &sh->w;
+    struct statx *s = &res->sbuf;
+
+    if (ctx->manifest && !res->checked) {
+        res->checked = 1;
+        if (item_unchanged(sh, res))
+            /* Nothing needs to be opened or read for it. */
+            return 1;
+    }
+    if (is_regular(s) && s->stx_nlink > 1 && ctx->links && item_linked(sh, res))
+        /* Nothing needs to be read for it. */
+        return 1;
+    if (is_regular(s) && res->read_done && res->bytes < s->stx_size && res->data_class < 0 &&
+        s->stx_size <= ctx->inline_max) {
+        /* Larger than the first read, but still worth inlining. Read the rest into a buffer of its size class. */
+        int cls = class_pool_class(ctx->inline_pool, s->stx_size);
+        char *data = cls >= 0 ? class_pool_get(ctx->inline_pool, cls) : NULL;
+        if (data) {
+            memcpy(data, res->buf, res->bytes);
+            res->data = data;
+            res->data_class = cls;
+            res->read_done = 0;
+            pthread_mutex_lock(&sh->submit_lock);
+            if (res->fd < 0)
+                submit_open(sh, res);
+            else
+                submit_read(sh, res);
+            io_uring_submit(&sh->ring);
+            pthread_mutex_unlock(&sh->submit_lock);
+            return 0;
         }
+        /* The class is exhausted. Send it from an fd instead. */
+    }
+    if (is_regular(s) && (!res->read_done || res->bytes < s->stx_size) && res->fd < 0) {
+        /* Either the type was unknown or the file is too large to be inlined. A plain fd is needed. */
+        res->type = DT_REG;
+        pthread_mutex_lock(&sh->submit_lock);
+        struct io_uring_sqe *sqe = shard_get_sqe(sh, res, OP_OPEN);
+        io_uring_prep_openat(sqe, res->dir->fd, res->name, O_RDONLY, 0);
+        io_uring_submit(&sh->ring);
+        pthread_mutex_unlock(&sh->submit_lock);
+        return 0;
+    }
+    if (is_regular(s) && !res->read_done && ctx->read_window && res->data_class < 0) {
+        window_add(sh, res);
+        return 0;
+    }
+    if (is_regular(s) && !res->read_done) {
+        pthread_mutex_lock(&sh->submit_lock);
+        submit_read(sh, res);
+        io_uring_submit(&sh->ring);
+        pthread_mutex_unlock(&sh->submit_lock);
+        return 0;
+    }
+    /* There is no io_uring op for readlink. Do it here so the walker never blocks. */
+    if (is_symlink(s) && writer_prepare_link(w, res->dir->fd, res->name))
+        exit(1);
+    const char *path = item_path(sh, res);
+    if (writer_prepare_statx(w, path, s)) {
+        fprintf(stderr, "writer_prepare_statx failed\n");
+        exit(1);
+    }
 
-        if (res->bytes <= 4096 && res->sbuf.stx_size == res->bytes) {
-            if (writer_execute_buffer(w, res->buf, res->bytes)) {
-                fprintf(stderr, "writer_execute_buffer failed\n");
+    if (is_regular(s)) {
+        struct link_stripe *st = NULL;
+        if (s->stx_nlink > 1 && ctx->links) {
+            /* Keep the stripe locked until the record is queued, so no hard link to it can go first. */
+            uint64_t dev = makedev(s->stx_dev_major, s->stx_dev_minor);
+            st = link_table_lock(ctx->links, dev, s->stx_ino);
+            uint32_t anchor = link_table_find(st, dev, s->stx_ino);
+            if (anchor) {
+                /* Another name got written while this one was being read. */
+                push_hard_link(sh, res, anchor);
+                link_table_unlock(st);
+                return 1;
+            }
+            if ((anchor = link_table_add(ctx->links, st, dev, s->stx_ino)) == 0)
+                exit(1);
+            writer_prepare_hard_link(w, anchor, 1);
+        } else if (ctx->dedup && s->stx_size >= DEDUP_MIN_SIZE) {
+            /* Matched by the sequencer as it's written, so the file it refers to is always written first. */
+            if ((res->dedup_path = strdup(path)) == NULL) {
+                perror("strdup");
                 exit(1);
             }
-        } else {
-            if (writer_execute_fd(w, res->fd, res->sbuf.stx_size)) {
-                fprintf(stderr, "writer_execute_fd failed\n");
+        }
+        int hdr_len = writer_header_length(w);
+        if (hdr_len > (int) sizeof(struct file_header)) {
+            /* Only with a long name. */
+            if ((res->long_hdr = malloc(hdr_len)) == NULL) {
+                perror("malloc");
                 exit(1);
             }
+            memcpy(res->long_hdr, w->hdr_buf, hdr_len);
+            res->rec.hdr = res->long_hdr;
+        } else {
+            memcpy(&res->hdr, w->hdr_buf, hdr_len);
+            res->rec.hdr = &res->hdr;
         }
+        if (res->bytes >= s->stx_size)
+            /* All in memory. */
+            res->rec.buf = res->data;
+        else
+            /* Too large to be inlined. Send it from the fd. */
+            res->rec.buf = NULL;
+        res->rec.fd = res->fd;
+        res->rec.len = s->stx_size;
+        res->rec.path = res->dedup_path;
+        res->rec.root_len = ctx->root_len;
+        res->rec.done = item_done;
+        dir_ref_put(res->dir);
+        sequencer_push(ctx->seq, &res->rec);
+        if (st)
+            link_table_unlock(st);
+        return 1;
+    }
 
-        if (pthread_mutex_unlock(ctx->lock)) {
-            perror("pthread_mutex_unlock");
+    if (push_meta_record(ctx, w))
+        exit(1);
+    if (is_dir(s)) {
+        /* The header of the directory is queued, so its entries can go in any order from now on. */
+        struct dir_ref *t = dir_ref_new(ctx, res->dir, -1, path, sh->path.len);
+        if (t == NULL)
             exit(1);
+        __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_RELAXED);
+        inbox_push(res->walker, t);
+    }
+    dir_ref_put(res->dir);
+    item_release(res);
+    return 1;
+}
+
+// FIXME: error handling here is a mess
+void *item_handler(struct shard *sh) {
+    struct archive_context *ctx = sh->ctx;
+
+    int read_count = 0;
+    while (1) {
+        struct io_uring_cqe *cqe;
+        if (sh->window_cnt && !io_uring_cq_ready(&sh->ring))
+            /* Don't sit on the window while waiting. Its reads may be what's to complete next. */
+            window_flush(sh);
+        int ret = io_uring_wait_cqe(&sh->ring, &cqe);
+        if (ret < 0) {
+            perror("io_uring_wait_cqe");
+            exit(1);
+        }
+        uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+        struct item *res = (struct item *) (data & ~OP_MASK);
+        if (res == NULL) {
+            /* A wakeup after walking is done. */
+            io_uring_cqe_seen(&sh->ring, cqe);
+            goto check_done;
+        }
+        int op = (int) (data & OP_MASK);
+        if (cqe->res < 0 && op != OP_CLOSE_DIRECT) {
+            fprintf(stderr, "async op %d on %s/%s failed: %s\n", op, res->dir->path, res->name, strerror(-cqe->res));
+            exit(1);
+        }
+        switch (op) {
+            case OP_STATX:
+                res->stat_done = 1;
+                break;
+            case OP_OPEN:
+                res->fd = cqe->res;
+                break;
+            case OP_READ:
+                res->bytes += cqe->res;
+                res->read_done = 1;
+                break;
+            default:
+                break;
         }
+        io_uring_cqe_seen(&sh->ring, cqe);
+        if (--res->cnt > 0)
+            /* Not all operations have been processed. */
+            continue;
 
-        close(res->fd);
-        buf_pool_put(ctx->item_pool, res);
+        if (!item_advance(sh, res))
+            continue;
+        pending_done(ctx);
         read_count++;
+
+        check_done:
         if (__atomic_load_n(&ctx->done, __ATOMIC_ACQUIRE) &&
-            read_count == __atomic_load_n(&ctx->emitted, __ATOMIC_ACQUIRE)) {
+            read_count == __atomic_load_n(&sh->emitted, __ATOMIC_ACQUIRE)) {
             break;
         }
     }
+    return NULL;
 }
 
-int archive_path(struct writer *w, const char *path) {
-    int ret = 0;
-
-    pthread_mutex_t lock;
-    if (pthread_mutex_init(&lock, NULL)) {
-        perror("pthread_mutex_init");
-        ret = 1;
-        goto exit;
+/*
+ * Report the peak usage of the buffer pools against their caps.
+ */
+void print_pool_stats(struct buf_pool *item_pool, struct class_pool *inline_pool) {
+    fprintf(stderr, "items: peak %u of %u (%.1f MiB)\n", item_pool->high_water, item_pool->max_cnt,
+            (double) item_pool->cnt * item_pool->item_size / (1 << 20));
+    for (int i = 0; i < inline_pool->class_cnt; i++) {
+        struct size_class *c = inline_pool->classes + i;
+        fprintf(stderr, "inline %u KiB: peak %u of %u (%.1f MiB)\n", c->size >> 10, c->high_water, c->max_cnt,
+                (double) c->cnt * c->size / (1 << 20));
     }
+}
+
+int archive_path(struct writer *w, const char *path, const struct archive_options *opts) {
+    int ret = 0;
 
     struct statx s;
     if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW | AT_EMPTY_PATH, STATX_ALL, &s)) {
         perror("statx");
         ret = 1;
-        goto destroy_and_exit;
+        goto exit;
+    }
+
+    if (!S_ISDIR(s.stx_mode) && opts->manifest) {
+        /* A file given by itself isn't even opened if it hasn't changed. */
+        int off = clean_path(path);
+        ret = off < 0 ? 0 : manifest_check(opts->manifest, path + off, strlen(path + off), &s);
+        if (ret != 0) {
+            ret = ret < 0;
+            goto exit;
+        }
     }
 
     int path_fd = 0;
@@ -244,53 +1017,225 @@ int archive_path(struct writer *w, const char *path) {
                 goto close_and_exit;
         if ((ret = writer_prepare_statx(w, path, &s)))
             goto close_and_exit;
-        if ((ret = writer_execute_fd(w, path_fd, s.stx_size)))
+        if (is_regular(&s) && s.stx_nlink > 1 && opts->links) {
+            uint64_t dev = makedev(s.stx_dev_major, s.stx_dev_minor);
+            struct link_stripe *st = link_table_lock(opts->links, dev, s.stx_ino);
+            uint32_t anchor = link_table_find(st, dev, s.stx_ino);
+            int first = anchor == 0;
+            if (first)
+                anchor = link_table_add(opts->links, st, dev, s.stx_ino);
+            link_table_unlock(st);
+            if (anchor == 0) {
+                ret = 1;
+                goto close_and_exit;
+            }
+            writer_prepare_hard_link(w, anchor, first);
+        }
+        if ((ret = writer_execute_fd(w, path_fd)))
             goto close_and_exit;
         goto close_and_exit;
     }
 
-    struct buf_pool dir_pool, item_pool;
-    buf_pool_init(&dir_pool, DIR_BUF_SIZE, MAX_DIR_DEPTH);
-    buf_pool_init(&item_pool, ITEM_BUF_SIZE, MAX_ITEM_COUNT);
+    int cpu_cnt = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpu_cnt < 1)
+        cpu_cnt = 1;
+    int walker_cnt = opts->walkers > 0 ? opts->walkers : cpu_cnt;
+    /* More rings than walkers submitting to them make no sense. */
+    int shard_cnt = opts->rings > 0 ? opts->rings : cpu_cnt;
+    if (shard_cnt > walker_cnt)
+        shard_cnt = walker_cnt;
 
-    struct io_uring ring;
-    io_uring_queue_init(RING_DEPTH, &ring, 0);
+    /* Half of the budget goes to items, and the other half to the inline classes. */
+    uint64_t item_cnt = opts->mem_budget / 2 / ITEM_BUF_SIZE;
+    if (item_cnt > MAX_ITEM_COUNT)
+        item_cnt = MAX_ITEM_COUNT;
+    if (item_cnt < MIN_ITEM_COUNT)
+        item_cnt = MIN_ITEM_COUNT;
+    uint32_t inline_cnts[INLINE_CLASS_CNT];
+    for (int i = 0; i < INLINE_CLASS_CNT; i++)
+        inline_cnts[i] = opts->mem_budget / 2 / INLINE_CLASS_CNT / INLINE_CLASS_SIZES[i];
 
+    struct buf_pool item_pool;
+    if (buf_pool_init(&item_pool, ITEM_BUF_SIZE, item_cnt)) {
+        ret = 1;
+        goto close_and_exit;
+    }
+    struct class_pool inline_pool;
+    if (class_pool_init(&inline_pool, INLINE_CLASS_SIZES, inline_cnts, INLINE_CLASS_CNT)) {
+        ret = 1;
+        goto close_and_exit;
+    }
+
+    struct walker *walkers = calloc(walker_cnt, sizeof(struct walker));
+    struct shard *shards = calloc(shard_cnt, sizeof(struct shard));
+    if (walkers == NULL || shards == NULL) {
+        perror("calloc");
+        ret = 1;
+        goto close_and_exit;
+    }
+
+    struct sequencer seq;
     struct archive_context ctx = {
-            .lock = &lock,
-            .ring = &ring,
+            .seq = &seq,
             .item_pool = &item_pool,
-            .emitted = 0,
+            .inline_pool = &inline_pool,
+            .inline_max = opts->inline_max,
+            .links = opts->links,
+            .dedup = w->dedup != NULL,
+            .root_len = (int) strlen(path),
+            .manifest = opts->manifest,
+            .read_window = opts->read_window,
+            .walkers = walkers,
+            .walker_cnt = walker_cnt,
+            .shards = shards,
+            .shard_cnt = shard_cnt,
+            .dir_ids = 0,
             .done = 0,
+            .pending = 0,
+            .idle = 0,
+            .wakeups = 0,
+            .failed = 0,
     };
 
-    struct item_handler_args args = {.ctx = &ctx, .w = w};
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, (void *(*)(void *)) item_handler, &args)) {
-        perror("pthread_create");
+    for (int i = 0; i < shard_cnt; i++) {
+        shards[i].ctx = &ctx;
+        path_init(&shards[i].path);
+        if (opts->read_window && (shards[i].window = malloc(sizeof(struct item *) * opts->read_window)) == NULL) {
+            perror("malloc");
+            ret = 1;
+            goto close_and_exit;
+        }
+        shards[i].cpu = opts->pin ? i % cpu_cnt : -1;
+        if (shard_init(shards + i)) {
+            ret = 1;
+            goto close_and_exit;
+        }
+        if (pthread_mutex_init(&shards[i].submit_lock, NULL)) {
+            perror("pthread_mutex_init");
+            ret = 1;
+            goto close_and_exit;
+        }
+        if (writer_init(&shards[i].w, w->fd)) {
+            ret = 1;
+            goto close_and_exit;
+        }
+    }
+
+    for (int i = 0; i < walker_cnt; i++) {
+        walkers[i].ctx = &ctx;
+        walkers[i].shard = shards + i % shard_cnt;
+        walkers[i].seed = i + 1;
+        if (work_deque_init(&walkers[i].deque, DIR_QUEUE_SIZE) ||
+            dir_reader_init(&walkers[i].reader, opts->dir_gather) ||
+            pthread_mutex_init(&walkers[i].inbox_lock, NULL)) {
+            ret = 1;
+            goto close_and_exit;
+        }
+    }
+
+    /* The root directory goes to the first walker, and the others will steal from it. */
+    struct dir_ref *root = dir_ref_new(&ctx, NULL, path_fd, path, (int) strlen(path));
+    if (root == NULL) {
+        ret = 1;
+        goto close_and_exit;
+    }
+    ctx.pending = 1;
+    /* The root is open already. A quarter of the fds may go to directories, and the rest is left to files. */
+    ctx.open_dirs = 1;
+    struct rlimit lmt;
+    getrlimit(RLIMIT_NOFILE, &lmt);
+    ctx.max_open_dirs = lmt.rlim_cur / 4 < MIN_OPEN_DIRS ? MIN_OPEN_DIRS :
+                        lmt.rlim_cur / 4 > INT_MAX ? INT_MAX : (int) (lmt.rlim_cur / 4);
+    work_deque_push(&walkers[0].deque, root);
+    path_fd = 0;
+
+    /* The sequencer owns w from now on, until all the records are written. */
+    if (sequencer_start(&seq, w)) {
+        ret = 1;
         goto close_and_exit;
     }
 
-    /* walk_path needs a separated writer. */
-    struct writer walk_writer;
-    writer_init(&walk_writer, w->fd);
+    for (int i = 0; i < shard_cnt; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (shards[i].cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(shards[i].cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+        }
+        if (pthread_create(&shards[i].tid, &attr, (void *(*)(void *)) item_handler, shards + i)) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
 
-    ret = walk_path(&ctx, &walk_writer, path, path_fd, &dir_pool);
+    for (int i = 0; i < walker_cnt; i++)
+        if (pthread_create(&walkers[i].tid, NULL, (void *(*)(void *)) walker_main, walkers + i)) {
+            perror("pthread_create");
+            exit(1);
+        }
+    for (int i = 0; i < walker_cnt; i++)
+        pthread_join(walkers[i].tid, NULL);
     __atomic_store_n(&ctx.done, 1, __ATOMIC_RELEASE);
 
-    while (io_uring_sq_ready(&ring)) {
-        if (io_uring_submit(&ring) < 0) {
-            perror("io_uring_submit");
-            goto close_and_exit;
+    for (int i = 0; i < shard_cnt; i++) {
+        /* Wake the handler up in case all the items have been handled. It may still be submitting. */
+        struct io_uring *ring = &shards[i].ring;
+        struct io_uring_sqe *sqe;
+        pthread_mutex_lock(&shards[i].submit_lock);
+        while (!(sqe = io_uring_get_sqe(ring)))
+            io_uring_submit(ring);
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        while (io_uring_sq_ready(ring)) {
+            if (io_uring_submit(ring) < 0) {
+                perror("io_uring_submit");
+                exit(1);
+            }
         }
+        pthread_mutex_unlock(&shards[i].submit_lock);
     }
 
-    pthread_join(tid, NULL);
+    for (int i = 0; i < shard_cnt; i++) {
+        pthread_join(shards[i].tid, NULL);
+        writer_free(&shards[i].w);
+        path_free(&shards[i].path);
+        free(shards[i].window);
+        io_uring_queue_exit(&shards[i].ring);
+        pthread_mutex_destroy(&shards[i].submit_lock);
+    }
+    free(shards);
+    if (sequencer_finish(&seq))
+        ret = 1;
+
+    for (int i = 0; i < walker_cnt; i++) {
+        struct dir_ref *t;
+        /* Left only if some walker failed. */
+        while ((t = work_deque_take(&walkers[i].deque))) {
+            if (t->fd >= 0)
+                close(t->fd);
+            dir_ref_release(t);
+        }
+        while ((t = walkers[i].inbox)) {
+            walkers[i].inbox = t->next;
+            if (t->fd >= 0)
+                close(t->fd);
+            dir_ref_release(t);
+        }
+        work_deque_free(&walkers[i].deque);
+        dir_reader_free(&walkers[i].reader);
+        pthread_mutex_destroy(&walkers[i].inbox_lock);
+    }
+    free(walkers);
+    if (ctx.failed)
+        ret = 1;
 
-    writer_free(&walk_writer);
-    buf_pool_free(&dir_pool);
+    if (opts->verbose)
+        print_pool_stats(&item_pool, &inline_pool);
     buf_pool_free(&item_pool);
-    io_uring_queue_exit(&ring);
+    class_pool_free(&inline_pool);
 
     close_and_exit:
     if (path_fd)
@@ -299,12 +1244,6 @@ int archive_path(struct writer *w, const char *path) {
             ret = 1;
         }
 
-    destroy_and_exit:
-    if (pthread_mutex_destroy(&lock)) {
-        perror("pthread_mutex_destroy");
-        ret = 1;
-    }
-
     exit:
     return ret;
 }
@@ -1,12 +1,33 @@
 #ifndef VAAR_ARCHIVE_H
 #define VAAR_ARCHIVE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "format.h"
+#include "link_table.h"
+#include "manifest.h"
 #include "writer.h"
 
+/*
+ * Options for archiving paths.
+ */
+struct archive_options {
+    int walkers; /* number of directory walker threads; one per online CPU if not positive */
+    int rings; /* number of io_uring instances, each with a handler thread; one per online CPU if not positive */
+    int pin; /* pin the handler of each ring to a CPU */
+    uint64_t inline_max; /* regular files up to this size are read through io_uring and written inline */
+    struct link_table *links; /* hard links seen in the whole archive, or NULL to write every name in full */
+    struct manifest *manifest; /* files of the previous run, to skip unchanged ones; NULL to write everything */
+    int read_window; /* sort the first reads of this many opened files by physical offset; 0 to read in inode order */
+    size_t dir_gather; /* bytes of raw entries a walker reads in before sorting them */
+    uint64_t mem_budget; /* bytes of items and inline buffers in flight at most */
+    int verbose; /* report the peak usage of buffers */
+};
+
 /*
  * Add a path to the writer.
  */
-int archive_path(struct writer *w, const char *path);
+int archive_path(struct writer *w, const char *path, const struct archive_options *opts);
 
 #endif //VAAR_ARCHIVE_H
@@ -1,28 +1,188 @@
+#include <limits.h>
 #include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
 
 #include "buf_pool.h"
+#include "futex.h"
 
 int buf_pool_init(struct buf_pool *pool, uint32_t item_size, uint32_t item_cnt) {
-    item_cnt = 1 << (32 - __builtin_clz(item_cnt - 1));
-    uint32_t tot_size = item_size * item_cnt;
+    uint32_t cap = item_cnt > 1 ? 1 << (32 - __builtin_clz(item_cnt - 1)) : 1;
+    pool->item_size = item_size;
+    pool->max_cnt = item_cnt;
+    pool->mask = cap - 1;
     pool->head = pool->tail = 0;
-    pool->mask = item_cnt - 1;
-    pool->buf = malloc(tot_size);
-    if (pool->buf == NULL) {
-        perror("malloc");
+    pool->cnt = pool->in_use = pool->high_water = 0;
+    pool->puts = pool->waiters = 0;
+    /* Pages are only backed once touched, so untouched buffers cost nothing but address space. */
+    pool->map_len = (size_t) item_size * item_cnt;
+    pool->buf = mmap(NULL, pool->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool->buf == MAP_FAILED) {
+        perror("mmap");
         return 1;
     }
-    pool->blocks = malloc(sizeof(size_t) * item_cnt);
-    if (pool->blocks == NULL) {
+    pool->cells = malloc(sizeof(struct buf_pool_cell) * cap);
+    if (pool->cells == NULL) {
         perror("malloc");
+        munmap(pool->buf, pool->map_len);
         return 1;
     }
-    for (int i = 0; i < item_cnt; i++)
-        pool->blocks[i] = pool->buf + (i * item_size);
+    for (uint32_t i = 0; i < cap; i++)
+        pool->cells[i].seq = i;
     return 0;
 }
 
+/*
+ * Pop a buffer put back before, or NULL if there is none.
+ */
+void *free_pop(struct buf_pool *pool) {
+    uint32_t pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    while (1) {
+        struct buf_pool_cell *c = pool->cells + (pos & pool->mask);
+        int32_t dif = (int32_t) (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pool->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                void *item = c->item;
+                /* Ready to be pushed on the next lap. */
+                __atomic_store_n(&c->seq, pos + pool->mask + 1, __ATOMIC_RELEASE);
+                return item;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Push a buffer back. The queue never fills up, as it has room for all the buffers.
+ */
+void free_push(struct buf_pool *pool, void *item) {
+    uint32_t pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+    while (1) {
+        struct buf_pool_cell *c = pool->cells + (pos & pool->mask);
+        int32_t dif = (int32_t) (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&pool->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                c->item = item;
+                __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+                return;
+            }
+        } else {
+            /* Either taken by another putter, or the getter of the last lap is still reading it. */
+            pos = __atomic_load_n(&pool->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void *buf_pool_try_get(struct buf_pool *pool) {
+    void *item = free_pop(pool);
+    if (item == NULL) {
+        /* Nothing to reuse. Hand out a new one if the cap allows. */
+        uint32_t cnt = __atomic_load_n(&pool->cnt, __ATOMIC_RELAXED);
+        do {
+            if (cnt >= pool->max_cnt)
+                return NULL;
+        } while (!__atomic_compare_exchange_n(&pool->cnt, &cnt, cnt + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        item = pool->buf + (size_t) cnt * pool->item_size;
+    }
+    uint32_t in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    uint32_t high = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+    while (in_use > high &&
+           !__atomic_compare_exchange_n(&pool->high_water, &high, in_use, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return item;
+}
+
+void *buf_pool_get(struct buf_pool *pool) {
+    while (1) {
+        void *item = buf_pool_try_get(pool);
+        if (item)
+            return item;
+        int puts = __atomic_load_n(&pool->puts, __ATOMIC_ACQUIRE);
+        /* Announce the wait before the last try, so a put in between either shows up or wakes us. */
+        __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+        item = buf_pool_try_get(pool);
+        if (item == NULL)
+            futex_wait(&pool->puts, puts);
+        __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_RELAXED);
+        if (item)
+            return item;
+    }
+}
+
+void buf_pool_put(struct buf_pool *pool, void *item) {
+    __atomic_sub_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+    free_push(pool, item);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->waiters, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&pool->puts, 1, __ATOMIC_RELEASE);
+        futex_wake(&pool->puts, 1);
+    }
+}
+
 void buf_pool_free(struct buf_pool *pool) {
-    free(pool->buf);
-    free(pool->blocks);
+    munmap(pool->buf, pool->map_len);
+    free(pool->cells);
+}
+
+int class_pool_init(struct class_pool *pool, const uint32_t *sizes, const uint32_t *max_cnts, int class_cnt) {
+    pool->class_cnt = class_cnt;
+    pool->classes = calloc(class_cnt, sizeof(struct size_class));
+    if (pool->classes == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < class_cnt; i++) {
+        struct size_class *c = pool->classes + i;
+        c->size = sizes[i];
+        c->max_cnt = max_cnts[i];
+        c->free = malloc(sizeof(void *) * (max_cnts[i] ? max_cnts[i] : 1));
+        if (c->free == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        if (pthread_mutex_init(&c->lock, NULL)) {
+            perror("pthread_mutex_init");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void *class_pool_get(struct class_pool *pool, int cls) {
+    struct size_class *c = pool->classes + cls;
+    void *buf = NULL;
+    pthread_mutex_lock(&c->lock);
+    if (c->free_cnt > 0) {
+        buf = c->free[--c->free_cnt];
+    } else if (c->cnt < c->max_cnt) {
+        /* Not allocated yet. */
+        if ((buf = malloc(c->size)))
+            c->cnt++;
+    }
+    if (buf && ++c->in_use > c->high_water)
+        c->high_water = c->in_use;
+    pthread_mutex_unlock(&c->lock);
+    return buf;
+}
+
+void class_pool_put(struct class_pool *pool, int cls, void *buf) {
+    struct size_class *c = pool->classes + cls;
+    pthread_mutex_lock(&c->lock);
+    c->free[c->free_cnt++] = buf;
+    c->in_use--;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void class_pool_free(struct class_pool *pool) {
+    for (int i = 0; i < pool->class_cnt; i++) {
+        struct size_class *c = pool->classes + i;
+        for (uint32_t j = 0; j < c->free_cnt; j++)
+            free(c->free[j]);
+        free(c->free);
+        pthread_mutex_destroy(&c->lock);
+    }
+    free(pool->classes);
 }
@@ -1,38 +1,62 @@
 #ifndef VAAR_BUF_POOL_H
 #define VAAR_BUF_POOL_H
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /*
- * Thread-safe lockless buffer pool.
- * However, never get more than allocated items before putting them back (and all the put routines
- * have returned), or the world may be destroyed.
+ * A slot in the free list of a buf_pool. seq tells whether the slot is ready to be pushed or popped.
+ */
+struct buf_pool_cell {
+    uint32_t seq;
+    void *item;
+};
+
+/*
+ * Thread-safe lockless buffer pool with a hard cap on the buffer count.
+ * Address space for all the buffers is reserved at once, but a buffer is only backed by memory once
+ * it's handed out the first time. When all of them are in use, getting one sleeps until one is put back.
  */
 struct buf_pool {
-    void *buf, **blocks;
-    uint32_t head, tail, mask;
+    char *buf;
+    size_t map_len;
+    struct buf_pool_cell *cells; /* bounded MPMC queue of free buffers */
+    uint32_t item_size;
+    uint32_t max_cnt, mask;
+    uint32_t head, tail;
+    uint32_t cnt; /* buffers handed out at least once */
+    uint32_t in_use, high_water;
+    int puts, waiters; /* for sleeping on an exhausted pool */
 };
 
 /*
- * Initialize a buffer pool with the smallest power of 2 greater than or equal to item_cnt items.
- * The space of item count * item size is allocated at instant.
+ * Initialize a buffer pool with at most item_cnt items of item_size.
+ * No memory is used by the items until they are got.
  */
 int buf_pool_init(struct buf_pool *pool, uint32_t item_size, uint32_t item_cnt);
 
+/*
+ * Get a buffer of item_size, sleeping until one is put back if all are in use. Thread-safe.
+ */
+void *buf_pool_get(struct buf_pool *pool);
+
 /*
  * Get a buffer of item_size. Thread-safe.
+ * Returns NULL if all are in use.
  */
-static inline void *buf_pool_get(struct buf_pool *pool) {
-    uint32_t offset = __atomic_fetch_add(&pool->head, 1, __ATOMIC_RELAXED);
-    return pool->blocks[offset & pool->mask];
-}
+void *buf_pool_try_get(struct buf_pool *pool);
+
+/*
+ * Put a buffer back, waking up a getter sleeping for it. Thread-safe.
+ */
+void buf_pool_put(struct buf_pool *pool, void *item);
 
 /*
- * Put a buffer back. Thread-safe.
+ * Get the index of a buffer in the pool, which is unique among its buffers and less than item_cnt.
  */
-static inline void buf_pool_put(struct buf_pool *pool, void *item) {
-    uint32_t offset = __atomic_fetch_add(&pool->tail, 1, __ATOMIC_RELAXED);
-    pool->blocks[offset & pool->mask] = item;
+static inline uint32_t buf_pool_index(struct buf_pool *pool, void *item) {
+    return ((char *) item - pool->buf) / pool->item_size;
 }
 
 /*
@@ -40,4 +64,58 @@ static inline void buf_pool_put(struct buf_pool *pool, void *item) {
  */
 void buf_pool_free(struct buf_pool *pool);
 
+/*
+ * Buffers of one size in a class_pool.
+ */
+struct size_class {
+    uint32_t size;
+    uint32_t max_cnt, cnt; /* buffers allowed and allocated */
+    uint32_t in_use, high_water;
+    void **free;
+    uint32_t free_cnt;
+    pthread_mutex_t lock;
+};
+
+/*
+ * Thread-safe buffer pool with several size classes, sorted by size.
+ * Buffers are allocated on demand up to a count per class. Unlike buf_pool, getting a buffer from
+ * an exhausted class fails instead of waiting, so callers that must not block can fall back.
+ */
+struct class_pool {
+    struct size_class *classes;
+    int class_cnt;
+};
+
+/*
+ * Initialize a class pool with class_cnt classes of ascending sizes, each allowed max_cnts[i] buffers.
+ */
+int class_pool_init(struct class_pool *pool, const uint32_t *sizes, const uint32_t *max_cnts, int class_cnt);
+
+/*
+ * Get the smallest class with buffers of at least size bytes.
+ * Returns -1 if size is larger than all classes.
+ */
+static inline int class_pool_class(struct class_pool *pool, uint64_t size) {
+    for (int i = 0; i < pool->class_cnt; i++)
+        if (size <= pool->classes[i].size)
+            return i;
+    return -1;
+}
+
+/*
+ * Get a buffer of the class. Thread-safe.
+ * Returns NULL if the class is exhausted.
+ */
+void *class_pool_get(struct class_pool *pool, int cls);
+
+/*
+ * Put a buffer back to its class. Thread-safe.
+ */
+void class_pool_put(struct class_pool *pool, int cls, void *buf);
+
+/*
+ * Destroy a class pool and free all the buffers. All of them must have been put back.
+ */
+void class_pool_free(struct class_pool *pool);
+
 #endif //VAAR_BUF_POOL_H
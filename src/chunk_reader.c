@@ -0,0 +1,167 @@
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "chunk_reader.h"
+
+/*
+ * Queue a read for the rest of the chunk.
+ */
+void chunk_read(struct chunk_reader *c, struct chunk *ch) {
+    /* At most chunk_cnt reads are in flight, so there is always room. */
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&c->ring);
+    if (c->fixed_bufs)
+        io_uring_prep_read_fixed(sqe, c->fd, ch->buf + ch->got, ch->len - ch->got, ch->off + ch->got, ch->idx);
+    else
+        io_uring_prep_read(sqe, c->fd, ch->buf + ch->got, ch->len - ch->got, ch->off + ch->got);
+    io_uring_sqe_set_data(sqe, ch);
+    c->inflight++;
+}
+
+/*
+ * Use the chunk for the next part of the file, if anything is left.
+ */
+void chunk_issue(struct chunk_reader *c, struct chunk *ch) {
+    if (c->issued >= c->len)
+        return;
+    ch->off = c->start + c->issued;
+    ch->len = c->len - c->issued < c->chunk_size ? c->len - c->issued : c->chunk_size;
+    ch->got = 0;
+    ch->ready = 0;
+    c->issued += ch->len;
+    chunk_read(c, ch);
+}
+
+/*
+ * Wait for one read to complete.
+ */
+int chunk_reap(struct chunk_reader *c) {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(&c->ring, &cqe);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
+        return 1;
+    }
+    struct chunk *ch = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&c->ring, cqe);
+    c->inflight--;
+    if (res < 0) {
+        fprintf(stderr, "async read failed: %s\n", strerror(-res));
+        return 1;
+    }
+    if (res == 0) {
+        fprintf(stderr, "file shrank while being archived\n");
+        return 1;
+    }
+    ch->got += res;
+    if (ch->got < ch->len) {
+        chunk_read(c, ch);
+        if ((ret = io_uring_submit(&c->ring)) < 0) {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            return 1;
+        }
+        return 0;
+    }
+    ch->ready = 1;
+    return 0;
+}
+
+int chunk_reader_init(struct chunk_reader *c, size_t chunk_size, size_t budget) {
+    memset(c, 0, sizeof(struct chunk_reader));
+    c->chunk_size = chunk_size;
+    c->chunk_cnt = (int) (budget / chunk_size);
+    if (c->chunk_cnt < 2)
+        c->chunk_cnt = 2;
+    c->mem = aligned_alloc(4096, c->chunk_cnt * chunk_size);
+    c->chunks = calloc(c->chunk_cnt, sizeof(struct chunk));
+    if (c->mem == NULL || c->chunks == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int ret = io_uring_queue_init(c->chunk_cnt, &c->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return 1;
+    }
+
+    struct iovec *iov = malloc(sizeof(struct iovec) * c->chunk_cnt);
+    if (iov == NULL) {
+        perror("malloc");
+        io_uring_queue_exit(&c->ring);
+        return 1;
+    }
+    for (int i = 0; i < c->chunk_cnt; i++) {
+        c->chunks[i].buf = c->mem + i * chunk_size;
+        c->chunks[i].idx = i;
+        iov[i].iov_base = c->chunks[i].buf;
+        iov[i].iov_len = chunk_size;
+    }
+    /* Registering may fail over RLIMIT_MEMLOCK. Plain reads still work then. */
+    c->fixed_bufs = io_uring_register_buffers(&c->ring, iov, c->chunk_cnt) == 0;
+    free(iov);
+    return 0;
+}
+
+int chunk_reader_start(struct chunk_reader *c, int fd, uint64_t off, uint64_t len) {
+    /* Left only if the last file failed. */
+    while (c->inflight)
+        if (chunk_reap(c))
+            return 1;
+
+    c->fd = fd;
+    c->start = off;
+    c->len = len;
+    c->issued = c->handed = 0;
+    c->head = 0;
+    c->last = NULL;
+    posix_fadvise(fd, (off_t) off, (off_t) len, POSIX_FADV_SEQUENTIAL);
+    for (int i = 0; i < c->chunk_cnt; i++)
+        chunk_issue(c, c->chunks + i);
+    int ret = io_uring_submit(&c->ring);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+        return 1;
+    }
+    return 0;
+}
+
+int chunk_reader_next(struct chunk_reader *c, const void **buf, size_t *len) {
+    if (c->last) {
+        /* The consumer is done with it. Read further ahead into it. */
+        chunk_issue(c, c->last);
+        c->last = NULL;
+        int ret = io_uring_submit(&c->ring);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+            return 1;
+        }
+    }
+    if (c->handed >= c->len) {
+        *len = 0;
+        return 0;
+    }
+
+    struct chunk *ch = c->chunks + c->head;
+    while (!ch->ready)
+        if (chunk_reap(c))
+            return 1;
+    *buf = ch->buf;
+    *len = ch->len;
+    c->handed += ch->len;
+    c->head = (c->head + 1) % c->chunk_cnt;
+    c->last = ch;
+    return 0;
+}
+
+void chunk_reader_free(struct chunk_reader *c) {
+    while (c->inflight)
+        if (chunk_reap(c))
+            break;
+    io_uring_queue_exit(&c->ring);
+    free(c->chunks);
+    free(c->mem);
+}
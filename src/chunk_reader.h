@@ -0,0 +1,63 @@
+#ifndef VAAR_CHUNK_READER_H
+#define VAAR_CHUNK_READER_H
+
+#include <liburing.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A piece of a large file, read into one of the chunk buffers.
+ */
+struct chunk {
+    char *buf;
+    uint64_t off; /* offset in the file */
+    size_t len; /* bytes wanted */
+    size_t got; /* bytes read so far */
+    int idx;
+    int ready;
+};
+
+/*
+ * Reads a large file through io_uring in fixed-size chunks, handed out in order.
+ * Reads run ahead of the consumer over all the chunk buffers, so the memory used is bounded by
+ * the chunk count times the chunk size, no matter how large the file is.
+ */
+struct chunk_reader {
+    struct io_uring ring;
+    int fixed_bufs; /* whether the buffers were registered */
+    char *mem;
+    struct chunk *chunks;
+    int chunk_cnt;
+    size_t chunk_size;
+    int inflight;
+
+    /* the file being read */
+    int fd;
+    uint64_t start, len;
+    uint64_t issued, handed; /* bytes requested and handed out */
+    int head; /* the chunk to be handed out next */
+    struct chunk *last; /* the chunk handed out last, reused on the next call */
+};
+
+/*
+ * Initialize a chunk reader with as many chunk_size buffers as fit in budget bytes (at least 2).
+ */
+int chunk_reader_init(struct chunk_reader *c, size_t chunk_size, size_t budget);
+
+/*
+ * Start reading len bytes of fd from off.
+ */
+int chunk_reader_start(struct chunk_reader *c, int fd, uint64_t off, uint64_t len);
+
+/*
+ * Get the next chunk of the file in order, waiting for it to be read.
+ * The buffer stays valid until the next call. *len is set to 0 after the whole file is handed out.
+ */
+int chunk_reader_next(struct chunk_reader *c, const void **buf, size_t *len);
+
+/*
+ * Destroy a chunk reader. Reads in flight, if any, are waited for first.
+ */
+void chunk_reader_free(struct chunk_reader *c);
+
+#endif //VAAR_CHUNK_READER_H
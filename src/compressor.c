@@ -0,0 +1,164 @@
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compressor.h"
+#include "format.h"
+#include "writer.h"
+
+/*
+ * The life of a frame.
+ */
+enum {
+    FRAME_FREE,
+    FRAME_QUEUED,
+    FRAME_COMPRESSED,
+};
+
+/*
+ * Compress a frame, or store it as is if it doesn't get smaller.
+ */
+void frame_compress(struct frame *f, size_t out_cap, int level) {
+    uLongf out_len = out_cap;
+    if (compress2((Bytef *) f->out, &out_len, (const Bytef *) f->in, f->in_len, level) == Z_OK &&
+        out_len < f->in_len) {
+        f->codec = VAAR_FRAME_ZLIB;
+        f->out_len = out_len;
+    } else {
+        f->codec = VAAR_FRAME_STORED;
+        f->out_len = f->in_len;
+    }
+}
+
+void *compressor_worker(struct compressor *c) {
+    size_t out_cap = compressBound(c->frame_size);
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        struct frame *f = c->frames + c->next_job;
+        if (f->state != FRAME_QUEUED) {
+            if (c->stopping)
+                break;
+            pthread_cond_wait(&c->queued, &c->lock);
+            continue;
+        }
+        c->next_job = (c->next_job + 1) % c->frame_cnt;
+        pthread_mutex_unlock(&c->lock);
+        frame_compress(f, out_cap, c->level);
+        pthread_mutex_lock(&c->lock);
+        f->state = FRAME_COMPRESSED;
+        pthread_cond_broadcast(&c->compressed);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+int compressor_init(struct compressor *c, int fd, size_t frame_size, int worker_cnt, int level) {
+    memset(c, 0, sizeof(struct compressor));
+    c->fd = fd;
+    c->level = level;
+    c->frame_size = frame_size;
+    c->worker_cnt = worker_cnt;
+    /* Enough for every worker to have one, with the producer filling another and the oldest being written. */
+    c->frame_cnt = worker_cnt + 2;
+    c->frames = calloc(c->frame_cnt, sizeof(struct frame));
+    c->workers = calloc(worker_cnt, sizeof(pthread_t));
+    if (c->frames == NULL || c->workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < c->frame_cnt; i++) {
+        c->frames[i].in = malloc(frame_size);
+        c->frames[i].out = malloc(compressBound(frame_size));
+        if (c->frames[i].in == NULL || c->frames[i].out == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    if (pthread_mutex_init(&c->lock, NULL) || pthread_cond_init(&c->queued, NULL) ||
+        pthread_cond_init(&c->compressed, NULL)) {
+        perror("pthread_mutex_init");
+        return 1;
+    }
+    for (int i = 0; i < worker_cnt; i++)
+        if (pthread_create(c->workers + i, NULL, (void *(*)(void *)) compressor_worker, c)) {
+            perror("pthread_create");
+            return 1;
+        }
+    return write_all(fd, VAAR_FRAMED_MAGIC, VAAR_FRAMED_MAGIC_LEN);
+}
+
+/*
+ * Wait for the oldest frame to be compressed and write it out. The lock must be held.
+ */
+int write_oldest(struct compressor *c) {
+    struct frame *f = c->frames + c->oldest;
+    while (f->state != FRAME_COMPRESSED)
+        pthread_cond_wait(&c->compressed, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+
+    struct frame_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.codec = f->codec;
+    hdr.comp_len = htole32(f->out_len);
+    hdr.raw_len = htole32(f->in_len);
+    hdr.raw_off = htole64(f->raw_off);
+    int ret = write_all(c->fd, &hdr, sizeof(hdr)) ||
+              write_all(c->fd, f->codec == VAAR_FRAME_STORED ? f->in : f->out, f->out_len);
+
+    pthread_mutex_lock(&c->lock);
+    f->state = FRAME_FREE;
+    c->oldest = (c->oldest + 1) % c->frame_cnt;
+    return ret;
+}
+
+char *compressor_buffer(struct compressor *c) {
+    struct frame *f = c->frames + c->cur;
+    int ret = 0;
+    pthread_mutex_lock(&c->lock);
+    /* Frames go round in order, so a frame still in use is always the oldest one. */
+    if (f->state != FRAME_FREE)
+        ret = write_oldest(c);
+    pthread_mutex_unlock(&c->lock);
+    return ret ? NULL : f->in;
+}
+
+void compressor_submit(struct compressor *c, size_t len) {
+    struct frame *f = c->frames + c->cur;
+    f->in_len = len;
+    f->raw_off = c->raw_off;
+    c->raw_off += len;
+    pthread_mutex_lock(&c->lock);
+    f->state = FRAME_QUEUED;
+    pthread_cond_signal(&c->queued);
+    pthread_mutex_unlock(&c->lock);
+    c->cur = (c->cur + 1) % c->frame_cnt;
+}
+
+int compressor_drain(struct compressor *c) {
+    int ret = 0;
+    pthread_mutex_lock(&c->lock);
+    while (!ret && c->frames[c->oldest].state != FRAME_FREE)
+        ret = write_oldest(c);
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+void compressor_free(struct compressor *c) {
+    pthread_mutex_lock(&c->lock);
+    c->stopping = 1;
+    pthread_cond_broadcast(&c->queued);
+    pthread_mutex_unlock(&c->lock);
+    for (int i = 0; i < c->worker_cnt; i++)
+        pthread_join(c->workers[i], NULL);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->queued);
+    pthread_cond_destroy(&c->compressed);
+    for (int i = 0; i < c->frame_cnt; i++) {
+        free(c->frames[i].in);
+        free(c->frames[i].out);
+    }
+    free(c->frames);
+    free(c->workers);
+}
@@ -0,0 +1,68 @@
+#ifndef VAAR_COMPRESSOR_H
+#define VAAR_COMPRESSOR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A frame of the archive, going from being filled to compressed to written.
+ */
+struct frame {
+    char *in, *out;
+    size_t in_len, out_len;
+    uint64_t raw_off;
+    int codec;
+    int state;
+};
+
+/*
+ * Compresses the output in independent frames on a pool of worker threads, and writes them in order.
+ * The producer fills one frame while the workers compress the ones before it. Frames are written by
+ * the producer when it needs them back, so it's never ahead of the output by more than the frame count.
+ */
+struct compressor {
+    int fd;
+    int level;
+    size_t frame_size;
+    struct frame *frames;
+    int frame_cnt;
+    int cur; /* the frame being filled */
+    int oldest; /* the oldest frame not written yet */
+    int next_job; /* the next frame for workers to compress */
+    uint64_t raw_off;
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued, compressed;
+    pthread_t *workers;
+    int worker_cnt;
+    int stopping;
+};
+
+/*
+ * Initialize a compressor writing to fd with worker_cnt threads, at a zlib level, and write the magic.
+ */
+int compressor_init(struct compressor *c, int fd, size_t frame_size, int worker_cnt, int level);
+
+/*
+ * Get the current frame to fill, writing out its previous content first if needed.
+ * Returns NULL on errors.
+ */
+char *compressor_buffer(struct compressor *c);
+
+/*
+ * Queue the first len bytes of the current frame for compression, and move to the next frame.
+ */
+void compressor_submit(struct compressor *c, size_t len);
+
+/*
+ * Wait for all the queued frames to be compressed and written.
+ */
+int compressor_drain(struct compressor *c);
+
+/*
+ * Stop the workers and destroy a compressor. It should be drained first.
+ */
+void compressor_free(struct compressor *c);
+
+#endif //VAAR_COMPRESSOR_H
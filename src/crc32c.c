@@ -0,0 +1,177 @@
+#include <endian.h>
+#include <pthread.h>
+#include <string.h>
+#include <nmmintrin.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82f63b78
+
+/*
+ * The hardware path runs three streams of these sizes in parallel, to hide the latency of the instruction,
+ * and then shifts them together with tables.
+ */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Multiply a vector by a 32x32 matrix over GF(2).
+ */
+uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/*
+ * Build the operator that feeds len zero bytes into a CRC, by squaring the one for a zero bit.
+ */
+void crc32c_zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++)
+        odd[n] = 1u << (n - 1);
+    gf2_matrix_square(even, odd); /* 2 bits */
+    gf2_matrix_square(odd, even); /* 4 bits */
+    /* The first square makes a byte, and each one after doubles it, as len is shifted down. */
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0)
+            return;
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+    memcpy(even, odd, sizeof(odd));
+}
+
+void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+    uint32_t op[32];
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+}
+
+/*
+ * Slicing-by-8 over the tables.
+ */
+uint32_t crc32c_sw(uint32_t crc, const unsigned char *next, size_t len) {
+    uint64_t crc0 = crc ^ 0xffffffff;
+    while (len && ((uintptr_t) next & 7)) {
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, next, 8);
+        crc0 ^= le64toh(v);
+        crc0 = crc32c_table[7][crc0 & 0xff] ^ crc32c_table[6][(crc0 >> 8) & 0xff] ^
+               crc32c_table[5][(crc0 >> 16) & 0xff] ^ crc32c_table[4][(crc0 >> 24) & 0xff] ^
+               crc32c_table[3][(crc0 >> 32) & 0xff] ^ crc32c_table[2][(crc0 >> 40) & 0xff] ^
+               crc32c_table[1][(crc0 >> 48) & 0xff] ^ crc32c_table[0][crc0 >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+    return (uint32_t) crc0 ^ 0xffffffff;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const unsigned char *next, size_t len) {
+    uint64_t crc0 = crc ^ 0xffffffff, crc1, crc2, v0, v1, v2;
+    while (len && ((uintptr_t) next & 7)) {
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *next++);
+        len--;
+    }
+    while (len >= CRC32C_LONG * 3) {
+        crc1 = crc2 = 0;
+        const unsigned char *end = next + CRC32C_LONG;
+        do {
+            memcpy(&v0, next, 8);
+            memcpy(&v1, next + CRC32C_LONG, 8);
+            memcpy(&v2, next + CRC32C_LONG * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, v0);
+            crc1 = _mm_crc32_u64(crc1, v1);
+            crc2 = _mm_crc32_u64(crc2, v2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t) crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t) crc0) ^ crc2;
+        next += CRC32C_LONG * 2;
+        len -= CRC32C_LONG * 3;
+    }
+    while (len >= CRC32C_SHORT * 3) {
+        crc1 = crc2 = 0;
+        const unsigned char *end = next + CRC32C_SHORT;
+        do {
+            memcpy(&v0, next, 8);
+            memcpy(&v1, next + CRC32C_SHORT, 8);
+            memcpy(&v2, next + CRC32C_SHORT * 2, 8);
+            crc0 = _mm_crc32_u64(crc0, v0);
+            crc1 = _mm_crc32_u64(crc1, v1);
+            crc2 = _mm_crc32_u64(crc2, v2);
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t) crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t) crc0) ^ crc2;
+        next += CRC32C_SHORT * 2;
+        len -= CRC32C_SHORT * 3;
+    }
+    while (len >= 8) {
+        memcpy(&v0, next, 8);
+        crc0 = _mm_crc32_u64(crc0, v0);
+        next += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc0 = _mm_crc32_u8((uint32_t) crc0, *next++);
+    return (uint32_t) crc0 ^ 0xffffffff;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    if (crc32c_hw)
+        return crc32c_sse42(crc, buf, len);
+    return crc32c_sw(crc, buf, len);
+}
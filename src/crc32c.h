@@ -0,0 +1,13 @@
+#ifndef VAAR_CRC32C_H
+#define VAAR_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Update a CRC-32C (Castagnoli) with len bytes of buf. Start with 0.
+ * Uses the SSE4.2 crc32 instruction on three streams at once if the CPU has it, or tables otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif //VAAR_CRC32C_H
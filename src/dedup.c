@@ -0,0 +1,286 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "path.h"
+
+const uint32_t DEDUP_INIT_CAP = 1024;
+/* Contents are compared in pieces of this size. */
+const size_t DEDUP_READ_SIZE = 256 << 10;
+
+static inline uint64_t size_hash(uint64_t size) {
+    uint64_t h = size * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static inline uint64_t hash_round(uint64_t h, uint64_t v) {
+    h ^= v * 0x9e3779b97f4a7c15ULL;
+    h = (h << 27) | (h >> 37);
+    return h * 0xff51afd7ed558ccdULL;
+}
+
+/*
+ * Feed a block of 32 bytes, one word to each lane.
+ */
+static inline void hash_block(struct content_hash *h, const unsigned char *p) {
+    uint64_t v[4];
+    memcpy(v, p, 32);
+    /* Four independent lanes keep the multiplier busy. */
+    for (int i = 0; i < 4; i++)
+        h->lanes[i] = hash_round(h->lanes[i], v[i]);
+}
+
+void content_hash_init(struct content_hash *h) {
+    h->lanes[0] = 0x243f6a8885a308d3ULL;
+    h->lanes[1] = 0x13198a2e03707344ULL;
+    h->lanes[2] = 0xa4093822299f31d0ULL;
+    h->lanes[3] = 0x082efa98ec4e6c89ULL;
+    h->len = 0;
+}
+
+void content_hash_update(struct content_hash *h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t held = h->len % 32;
+    h->len += len;
+    if (held) {
+        /* Fill up the block left by the last piece first. */
+        size_t n = len < 32 - held ? len : 32 - held;
+        memcpy(h->tail + held, p, n);
+        p += n;
+        len -= n;
+        if (held + n < 32)
+            return;
+        hash_block(h, h->tail);
+    }
+    for (; len >= 32; p += 32, len -= 32)
+        hash_block(h, p);
+    memcpy(h->tail, p, len);
+}
+
+uint64_t content_hash_final(struct content_hash *h) {
+    const unsigned char *p = h->tail;
+    for (size_t i = 0, left = h->len % 32; left > 0; i++) {
+        uint64_t w = 0;
+        size_t n = left < 8 ? left : 8;
+        memcpy(&w, p, n);
+        h->lanes[i] = hash_round(h->lanes[i], w);
+        p += n;
+        left -= n;
+    }
+    uint64_t r = h->len;
+    for (int i = 0; i < 4; i++)
+        r = hash_round(r, h->lanes[i]);
+    return r ^ (r >> 31);
+}
+
+/*
+ * Read up to len bytes of fd at off, stopping short only at the end of the file.
+ * Returns the bytes read, or -1 on errors.
+ */
+ssize_t read_full(int fd, char *buf, size_t len, uint64_t off) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, (off_t) (off + got));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return (ssize_t) got;
+}
+
+int content_hash_fd(struct dedup_table *t, struct content_hash *h, int fd, uint64_t off, uint64_t len) {
+    for (uint64_t end = off + len; off < end; off += DEDUP_READ_SIZE) {
+        size_t want = end - off < DEDUP_READ_SIZE ? end - off : DEDUP_READ_SIZE;
+        ssize_t n = read_full(fd, t->buf, want, off);
+        if (n < 0)
+            return 1;
+        if ((size_t) n < want) {
+            fprintf(stderr, "file shrank while being archived\n");
+            return 1;
+        }
+        content_hash_update(h, t->buf, n);
+    }
+    return 0;
+}
+
+/*
+ * Compare len bytes at off of the content, from data or read from fd, with the file at orig_fd.
+ * Returns 1 if they are the same, 0 if not, or -1 on errors.
+ */
+int same_range(struct dedup_table *t, const void *data, int fd, int orig_fd, uint64_t off, uint64_t len) {
+    char *buf = t->buf, *orig_buf = t->buf + DEDUP_READ_SIZE;
+    for (uint64_t end = off + len; off < end; off += DEDUP_READ_SIZE) {
+        size_t want = end - off < DEDUP_READ_SIZE ? end - off : DEDUP_READ_SIZE;
+        ssize_t n = read_full(orig_fd, orig_buf, want, off);
+        if (n < 0)
+            return -1;
+        if ((size_t) n < want)
+            return 0;
+        const char *p = (const char *) data + off;
+        if (data == NULL) {
+            if ((n = read_full(fd, buf, want, off)) < 0)
+                return -1;
+            if ((size_t) n < want)
+                return 0;
+            p = buf;
+        }
+        if (memcmp(p, orig_buf, want))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Open the earlier file of a content again. The path given to be archived is opened as it was then, and the names
+ * beneath it one at a time, so that none is followed if it's become a symlink, and the path may exceed PATH_MAX.
+ * Returns the fd, or -1 with errno set.
+ */
+int open_content(const struct dedup_content *c) {
+    /* It's been opened by this path already, so it's shorter than PATH_MAX. */
+    char root[PATH_MAX];
+    memcpy(root, c->path, c->root_len);
+    root[c->root_len] = '\0';
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0)
+        return -1;
+    int fd = path_openat(root_fd, c->path + c->root_len, O_RDONLY);
+    int err = errno;
+    close(root_fd);
+    errno = err;
+    return fd;
+}
+
+/*
+ * Compare the content with the earlier file c was written with, where it has data.
+ * Returns 1 if they are the same, 0 if not, or -1 on errors.
+ */
+int same_content(struct dedup_table *t, struct dedup_entry *e, const struct dedup_content *c, const void *data,
+                 int fd, const struct sparse_extent *extents, size_t extent_cnt) {
+    int orig_fd = open_content(c);
+    if (orig_fd < 0)
+        /* Gone since. It still is in the archive, but can't be told to be the same as anything. */
+        return 0;
+    int ret = 1;
+    if (extents == NULL)
+        ret = same_range(t, data, fd, orig_fd, 0, e->size);
+    for (size_t i = 0; i < extent_cnt && ret == 1; i++)
+        /* The extent maps were hashed along, so the holes are in the same places. */
+        ret = same_range(t, NULL, fd, orig_fd, extents[i].off, extents[i].len);
+    close(orig_fd);
+    return ret;
+}
+
+int dedup_table_init(struct dedup_table *t) {
+    memset(t, 0, sizeof(struct dedup_table));
+    if ((t->buf = malloc(DEDUP_READ_SIZE * 2)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Get the slot of the size in the entries, or the empty slot where it should go.
+ */
+struct dedup_entry *dedup_slot(struct dedup_entry *entries, uint32_t cap, uint64_t size) {
+    uint32_t i = (uint32_t) size_hash(size) & (cap - 1);
+    while (entries[i].contents && entries[i].size != size)
+        i = (i + 1) & (cap - 1);
+    return entries + i;
+}
+
+/*
+ * Double the capacity of the table, or allocate it in the first place.
+ */
+int dedup_table_grow(struct dedup_table *t) {
+    uint32_t cap = t->cap ? t->cap * 2 : DEDUP_INIT_CAP;
+    struct dedup_entry *entries = calloc(cap, sizeof(struct dedup_entry));
+    if (entries == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (uint32_t i = 0; i < t->cap; i++)
+        if (t->entries[i].contents)
+            *dedup_slot(entries, cap, t->entries[i].size) = t->entries[i];
+    free(t->entries);
+    t->entries = entries;
+    t->cap = cap;
+    return 0;
+}
+
+struct dedup_entry *dedup_table_get(struct dedup_table *t, uint64_t size) {
+    if (t->cnt) {
+        struct dedup_entry *e = dedup_slot(t->entries, t->cap, size);
+        if (e->contents)
+            return e;
+    }
+    /* Keep the load under a half. The entry is only counted once a content is added to it. */
+    if ((t->cnt + 1) * 2 > t->cap && dedup_table_grow(t))
+        return NULL;
+    struct dedup_entry *e = dedup_slot(t->entries, t->cap, size);
+    e->size = size;
+    return e;
+}
+
+int dedup_table_add(struct dedup_table *t, struct dedup_entry *e, const char *path, int root_len, int name_off,
+                    uint64_t hash, int sparse) {
+    size_t path_len = strlen(path);
+    struct dedup_content *c = malloc(sizeof(struct dedup_content) + path_len + 1);
+    if (c == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    c->hash = hash;
+    c->sparse = sparse;
+    c->root_len = root_len;
+    c->name_off = name_off;
+    memcpy(c->path, path, path_len + 1);
+    if (e->contents == NULL)
+        t->cnt++;
+    c->next = e->contents;
+    e->contents = c;
+    return 0;
+}
+
+int dedup_table_find(struct dedup_table *t, struct dedup_entry *e, uint64_t hash, const void *data, int fd,
+                     const struct sparse_extent *extents, size_t extent_cnt, const char **orig) {
+    for (struct dedup_content *c = e->contents; c; c = c->next) {
+        if (c->hash != hash || c->sparse != (extents != NULL))
+            continue;
+        /* The hash only tells they may be the same. Make sure. */
+        int ret = same_content(t, e, c, data, fd, extents, extent_cnt);
+        if (ret < 0)
+            return -1;
+        if (ret) {
+            *orig = c->path + c->name_off;
+            t->dup_cnt++;
+            t->dup_bytes += e->size;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void dedup_table_free(struct dedup_table *t) {
+    for (uint32_t i = 0; i < t->cap; i++) {
+        struct dedup_content *c = t->entries[i].contents;
+        while (c) {
+            struct dedup_content *next = c->next;
+            free(c);
+            c = next;
+        }
+    }
+    free(t->entries);
+    free(t->buf);
+}
@@ -0,0 +1,89 @@
+#ifndef VAAR_DEDUP_H
+#define VAAR_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+
+/*
+ * A hash of file contents, fed in pieces of any length. The result doesn't depend on how the content is split.
+ */
+struct content_hash {
+    uint64_t lanes[4];
+    uint64_t len;
+    unsigned char tail[32]; /* what's left of the last piece short of a block */
+};
+
+void content_hash_init(struct content_hash *h);
+
+void content_hash_update(struct content_hash *h, const void *data, size_t len);
+
+uint64_t content_hash_final(struct content_hash *h);
+
+struct dedup_table;
+
+/*
+ * Feed len bytes at off of fd to the hash, read with the buffer of the table.
+ */
+int content_hash_fd(struct dedup_table *t, struct content_hash *h, int fd, uint64_t off, uint64_t len);
+
+/*
+ * A distinct content among the files of a size, and the file it was first written with.
+ */
+struct dedup_content {
+    struct dedup_content *next;
+    uint64_t hash; /* of the content as written: the bytes, or the extent map and the data of a sparse file */
+    int sparse;
+    int root_len; /* of the path given to be archived, which is opened as it is, and the rest beneath it */
+    int name_off; /* where the archived name starts in path */
+    char path[];
+};
+
+/*
+ * The files written with a size.
+ */
+struct dedup_entry {
+    uint64_t size;
+    struct dedup_content *contents; /* NULL if the entry is empty */
+};
+
+/*
+ * Map from sizes to the contents of regular files written with them, as an open addressing hash table.
+ * It's owned by the writer, which hashes each content as it's written, so nothing has to be read again to be
+ * matched later. A file has to be hashed before it's written only if another file of its size has been, so
+ * files with unique sizes are read once, as usual.
+ */
+struct dedup_table {
+    struct dedup_entry *entries;
+    uint32_t cap, cnt;
+    char *buf; /* for comparing contents in pieces */
+    uint64_t hashed; /* files hashed before being written */
+    uint64_t dup_cnt, dup_bytes; /* duplicates found, and the bytes they didn't take */
+};
+
+int dedup_table_init(struct dedup_table *t);
+
+/*
+ * Get the entry of a size, adding an empty one if it's not there. Returns NULL on errors.
+ */
+struct dedup_entry *dedup_table_get(struct dedup_table *t, uint64_t size);
+
+/*
+ * Record a content that has been written with the file at path, beneath the path of root_len given to be archived.
+ */
+int dedup_table_add(struct dedup_table *t, struct dedup_entry *e, const char *path, int root_len, int name_off,
+                    uint64_t hash, int sparse);
+
+/*
+ * Look for an earlier file with the same content as the one about to be written, among the files of its size.
+ * The content is taken from data if it's not NULL, or read from fd otherwise. A sparse file only has its
+ * extents compared, and only with files that had the same extent map and data when they were written.
+ * Returns 1 with *orig set to the archived name of the earlier file, 0 if there's none, or -1 on errors.
+ */
+int dedup_table_find(struct dedup_table *t, struct dedup_entry *e, uint64_t hash, const void *data, int fd,
+                     const struct sparse_extent *extents, size_t extent_cnt, const char **orig);
+
+void dedup_table_free(struct dedup_table *t);
+
+#endif //VAAR_DEDUP_H
@@ -1,41 +1,137 @@
 #include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "dir_entry.h"
 
+/* Stop gathering when less than this is left, so getdents64 is never called with a tiny buffer. */
+const size_t DIR_BATCH_MIN = 64 << 10; // 64 KiB
+
+int dir_reader_init(struct dir_reader *r, size_t gather) {
+    memset(r, 0, sizeof(struct dir_reader));
+    if (gather < DIR_BATCH_MIN)
+        gather = DIR_BATCH_MIN;
+    /* Large enough to be mapped on demand. Only the part a directory fills is ever backed. */
+    r->data = malloc(gather);
+    if (r->data == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    r->data_cap = gather;
+    return 0;
+}
+
+void dir_reader_open(struct dir_reader *r, int fd) {
+    r->fd = fd;
+    r->eof = 0;
+    r->count = r->cur = 0;
+}
+
 /*
- * Sort the entries in descending inode number order, and dirs before files.
- * This should give a performance boost.
+ * Make room for at least cnt entries in the arena.
  */
-int dir_entry_comp(const void *a, const void *b) {
-    const struct dir_entry *ent_a = a, *ent_b = b;
-    if ((ent_a->type == DT_DIR) != (ent_b->type == DT_DIR))
-        return ent_b->type == DT_DIR;
-    return ent_a->inode > ent_b->inode;
+int reserve_entries(struct dir_reader *r, int cnt) {
+    if (cnt <= r->entry_cap)
+        return 0;
+    int cap = r->entry_cap ? r->entry_cap : 1024;
+    while (cap < cnt)
+        cap *= 2;
+    struct dir_entry *entries = realloc(r->entries, sizeof(struct dir_entry) * cap);
+    if (entries == NULL) {
+        perror("realloc");
+        return 1;
+    }
+    r->entries = entries;
+    struct dir_entry *tmp = realloc(r->tmp, sizeof(struct dir_entry) * cap);
+    if (tmp == NULL) {
+        perror("realloc");
+        return 1;
+    }
+    r->tmp = tmp;
+    r->entry_cap = cap;
+    return 0;
 }
 
-void dir_reader_init(struct dir_reader *r, void *data, ssize_t data_len) {
-    struct dir_entry *entries = malloc(data_len);
-    off64_t off = 0;
+/*
+ * Sort the entries by inode number with an LSD radix sort, then move dirs to the front stably.
+ * Inodes in a directory tend to share their high bytes, and the passes over those are skipped.
+ */
+void sort_entries(struct dir_reader *r) {
+    struct dir_entry *src = r->entries, *dst = r->tmp;
+    int cnt = r->count;
+    for (int shift = 0; shift < (int) sizeof(unsigned long) * 8; shift += 8) {
+        int pos[256] = {0};
+        for (int i = 0; i < cnt; i++)
+            pos[(src[i].inode >> shift) & 0xff]++;
+        if (pos[(src[0].inode >> shift) & 0xff] == cnt)
+            /* Every entry has the same byte here. */
+            continue;
+        for (int i = 0, sum = 0; i < 256; i++) {
+            int n = pos[i];
+            pos[i] = sum;
+            sum += n;
+        }
+        for (int i = 0; i < cnt; i++)
+            dst[pos[(src[i].inode >> shift) & 0xff]++] = src[i];
+        struct dir_entry *t = src;
+        src = dst;
+        dst = t;
+    }
+
+    int dirs = 0;
+    for (int i = 0; i < cnt; i++)
+        dirs += src[i].type == DT_DIR;
+    for (int i = 0, d = 0, f = dirs; i < cnt; i++)
+        dst[src[i].type == DT_DIR ? d++ : f++] = src[i];
+    r->entries = dst;
+    r->tmp = src;
+}
+
+int dir_reader_fill(struct dir_reader *r) {
+    r->count = r->cur = 0;
+    size_t len = 0;
+    while (!r->eof && r->data_cap - len >= DIR_BATCH_MIN) {
+        size_t want = r->data_cap - len;
+        ssize_t n = get_dir_entries(r->fd, r->data + len, want > INT_MAX ? INT_MAX : (int) want);
+        if (n < 0) {
+            perror("getdents64");
+            return -1;
+        }
+        if (n == 0)
+            r->eof = 1;
+        len += n;
+    }
+
+    /* A dirent takes at least 24 bytes. */
+    if (reserve_entries(r, (int) (len / 24) + 1))
+        return -1;
+    size_t off = 0;
     int cnt = 0;
-    while (off < data_len) {
-        struct dirent *entry = data + off;
+    while (off < len) {
+        struct dirent *entry = (struct dirent *) (r->data + off);
         off += entry->d_reclen;
         if (entry->d_name[0] == '.' &&
-                     (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+            (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
             /* Ignore "." and "..". */
             continue;
-        entries[cnt].name = entry->d_name;
-        entries[cnt].inode = entry->d_ino;
-        entries[cnt].type = entry->d_type;
+        r->entries[cnt].name = entry->d_name;
+        r->entries[cnt].inode = entry->d_ino;
+        r->entries[cnt].type = entry->d_type;
         cnt++;
     }
-    qsort(entries, cnt, sizeof(struct dir_entry), dir_entry_comp);
-    r->cur = 0;
-    r->entries = entries;
     r->count = cnt;
+    if (cnt > 1)
+        sort_entries(r);
+    if (cnt == 0 && !r->eof)
+        /* Only "." and ".." so far. */
+        return dir_reader_fill(r);
+    return cnt;
 }
 
 void dir_reader_free(struct dir_reader *r) {
+    free(r->data);
     free(r->entries);
+    free(r->tmp);
 }
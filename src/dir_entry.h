@@ -2,6 +2,8 @@
 #define VAAR_DIR_ENTRY_H
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/syscall.h>
 
@@ -15,12 +17,19 @@ struct dir_entry {
 };
 
 /*
- * The reader to parse data returned by get_dir_entries.
+ * The reader to get the entries of a directory in windows, each sorted for locality.
+ * A window gathers as many entries as the data buffer holds, so a directory smaller than the buffer
+ * is sorted as a whole and a larger one is streamed. All the memory is kept for the next directory.
  */
 struct dir_reader {
+    int fd;
+    int eof;
+    char *data; /* raw entries returned by getdents64 */
+    size_t data_cap;
+    struct dir_entry *entries, *tmp; /* the entry arena, and scratch space for sorting */
+    int entry_cap;
     int count;
     int cur;
-    struct dir_entry *entries;
 };
 
 /*
@@ -31,13 +40,28 @@ static inline ssize_t get_dir_entries(int fd, void *buf, int buf_len) {
     return syscall(SYS_getdents64, fd, buf, buf_len);
 }
 
+/* The least bytes a dir reader gathers, whatever it's given. */
+extern const size_t DIR_BATCH_MIN;
+
+/*
+ * Initialize a dir reader gathering up to gather bytes of raw entries per window.
+ */
+int dir_reader_init(struct dir_reader *r, size_t gather);
+
+/*
+ * Start reading the opened directory fd.
+ */
+void dir_reader_open(struct dir_reader *r, int fd);
+
 /*
- * Initialize a dir reader with the data and data length.
+ * Read the next window of entries and sort it, dirs first and in ascending inode order otherwise.
+ * Entries of the last window are invalidated.
+ * Returns the number of entries, 0 after the whole directory has been read, or -1 on errors.
  */
-void dir_reader_init(struct dir_reader *r, void *data, ssize_t data_len);
+int dir_reader_fill(struct dir_reader *r);
 
 /*
- * Get the next entry in the data.
+ * Get the next entry in the window.
  * Returns NULL when drained.
  */
 static inline struct dir_entry *dir_reader_next(struct dir_reader *r) {
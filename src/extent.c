@@ -0,0 +1,25 @@
+#include <string.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+#include "extent.h"
+
+uint64_t file_first_extent(int fd) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_start = 0;
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0)
+        return fm.map.fm_mapped_extents ? fm.extent.fe_physical : 0;
+
+    /* Old filesystems may only have FIBMAP, which needs CAP_SYS_RAWIO. */
+    int block = 0, block_size = 0;
+    if (ioctl(fd, FIBMAP, &block) == 0 && ioctl(fd, FIGETBSZ, &block_size) == 0)
+        return (uint64_t) block * block_size;
+    return 0;
+}
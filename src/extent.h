@@ -0,0 +1,12 @@
+#ifndef VAAR_EXTENT_H
+#define VAAR_EXTENT_H
+
+#include <stdint.h>
+
+/*
+ * Get where the content of a file starts on its device, in bytes.
+ * FIEMAP is tried first, then FIBMAP. Returns 0 if neither works or the file has no extents.
+ */
+uint64_t file_first_extent(int fd);
+
+#endif //VAAR_EXTENT_H
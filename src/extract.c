@@ -0,0 +1,1194 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/openat2.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "extract.h"
+#include "path.h"
+
+/* Files in flight in each worker. */
+#define EXTRACT_DEPTH 256
+/* Operations in flight for directories and links, from the main thread. */
+const int EXTRACT_RING_DEPTH = 1024;
+/* Entries taken by a worker at once. */
+const size_t EXTRACT_BATCH = 32;
+/* The most written by one operation. The rest of a larger file is written synchronously. */
+const uint32_t EXTRACT_MAX_WRITE = 1 << 30;
+
+/* Entries that failed to be parsed, and are left alone. */
+#define X_SKIP 0xff
+
+/*
+ * Operations on files in workers, tagged in the low bits of the user data.
+ */
+enum {
+    X_OP_OPEN,
+    X_OP_WRITE,
+    X_OP_CLOSE,
+};
+
+const uintptr_t X_OP_MASK = 3;
+
+/*
+ * A file being written by a worker.
+ */
+struct x_file {
+    struct x_entry *e;
+    int slot; /* the fixed file slot */
+    int fixed; /* whether it's opened in the slot, or as a plain fd */
+    int fd; /* with plain fds, once opened */
+    int cnt; /* operations in flight */
+    int open_res;
+    uint64_t written; /* so far */
+    int err; /* of the writes */
+    int closed;
+    int retried; /* whether the parents have been made after the first open failed */
+} __attribute__((aligned(4)));
+
+/*
+ * A thread writing files, with its own io_uring.
+ */
+struct x_worker {
+    struct extractor *x;
+    struct io_uring ring;
+    int direct; /* whether files are opened as fixed files, linked with their writes */
+    struct x_file files[EXTRACT_DEPTH];
+    struct x_file *free[EXTRACT_DEPTH];
+    int free_cnt;
+    pthread_t tid;
+};
+
+static inline const char *entry_name(struct extractor *x, struct x_entry *e) {
+    return x->names + e->name;
+}
+
+void report(struct extractor *x, struct x_entry *e, const char *what, int err) {
+    fprintf(stderr, "%s %s: %s\n", what, entry_name(x, e), strerror(err));
+    __atomic_add_fetch(&x->failed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy len bytes of s into the name arena, terminated, and get where it's put.
+ */
+int arena_add(struct extractor *x, const char *s, size_t len, uint64_t *off) {
+    if (x->names_len + len + 1 > x->names_cap) {
+        size_t cap = x->names_cap ? x->names_cap * 2 : 1 << 20;
+        while (cap < x->names_len + len + 1)
+            cap *= 2;
+        char *names = realloc(x->names, cap);
+        if (names == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        x->names = names;
+        x->names_cap = cap;
+    }
+    memcpy(x->names + x->names_len, s, len);
+    x->names[x->names_len + len] = '\0';
+    *off = x->names_len;
+    x->names_len += len + 1;
+    return 0;
+}
+
+/*
+ * Remember the entry written with a hard link anchor.
+ */
+int add_anchor(struct extractor *x, uint32_t anchor, size_t idx) {
+    if (anchor >= x->anchor_cap) {
+        uint32_t cap = x->anchor_cap ? x->anchor_cap : 1024;
+        while (cap <= anchor)
+            cap *= 2;
+        uint64_t *anchors = realloc(x->anchors, cap * sizeof(uint64_t));
+        if (anchors == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        memset(anchors + x->anchor_cap, 0, (cap - x->anchor_cap) * sizeof(uint64_t));
+        x->anchors = anchors;
+        x->anchor_cap = cap;
+    }
+    x->anchors[anchor] = idx + 1;
+    return 0;
+}
+
+/*
+ * Add the entry of a decoded header, whose content is size bytes at content_off.
+ */
+int add_entry(struct extractor *x, const struct file_header *hdr, uint64_t content_off, uint64_t size) {
+    if (x->cnt == x->cap) {
+        size_t cap = x->cap ? x->cap * 2 : 1024;
+        struct x_entry *entries = realloc(x->entries, cap * sizeof(struct x_entry));
+        if (entries == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        x->entries = entries;
+        x->cap = cap;
+    }
+    struct x_entry *e = x->entries + x->cnt;
+    memset(e, 0, sizeof(struct x_entry));
+
+    int name_len;
+    const char *name = file_header_name(hdr, &name_len);
+    if (arena_add(x, name, name_len, &e->name))
+        return 1;
+    /* Never write outside of the directory. */
+    int off = clean_path(x->names + e->name);
+    if (off < 0 || x->names[e->name + off] == '\0') {
+        fprintf(stderr, "unsafe name %s, skipped\n", x->names + e->name);
+        x->failed++;
+        e->type = X_SKIP;
+        x->cnt++;
+        return 0;
+    }
+    e->name += off;
+
+    e->type = hdr->type;
+    e->mode = hdr->mode;
+    e->mtime = hdr->mtime;
+    if (x->set_owner) {
+        e->uid = owner_user_id(&x->users, hdr->uid, hdr->uname);
+        e->gid = owner_group_id(&x->groups, hdr->gid, hdr->gname);
+    }
+    switch (hdr->type) {
+        case VAAR_DIR:
+            for (const char *p = x->names + e->name; *p; p++)
+                e->depth += *p == '/';
+            x->dir_cnt++;
+            break;
+        case VAAR_REG:
+            e->content = content_off;
+            e->size = size;
+            e->sparse_size = hdr->flags & VAAR_FLAG_SPARSE ? hdr->size : 0;
+            if (hdr->link_anchor && add_anchor(x, hdr->link_anchor, x->cnt))
+                return 1;
+            break;
+        case VAAR_SYM:
+            if (arena_add(x, hdr->linkname, hdr->link_len, &e->link))
+                return 1;
+            x->link_cnt++;
+            break;
+        case VAAR_LNK:
+            e->anchor = hdr->link_anchor;
+            x->link_cnt++;
+            break;
+        case VAAR_DUP:
+            if (arena_add(x, hdr->linkname, hdr->link_len, &e->link))
+                return 1;
+            /* Where the original is looked up before, until it's resolved. */
+            e->content = content_off;
+            x->dup_cnt++;
+            break;
+        case VAAR_DEL:
+            x->del_cnt++;
+            break;
+        default:
+            fprintf(stderr, "unknown type %d of %s, skipped\n", hdr->type, x->names + e->name);
+            x->failed++;
+            e->type = X_SKIP;
+    }
+    x->cnt++;
+    return 0;
+}
+
+/*
+ * Tell if a name is a path asked for, or under it.
+ */
+static inline int path_matches(const struct x_path *p, const char *name, size_t len) {
+    return len >= p->len && memcmp(name, p->name, p->len) == 0 && (len == p->len || name[p->len] == '/');
+}
+
+/*
+ * Tell if a name is one of the first cnt paths asked for, or under one of them.
+ */
+int is_selected(struct extractor *x, const char *name, size_t len, int cnt) {
+    for (int i = 0; i < cnt; i++)
+        if (path_matches(x->paths + i, name, len))
+            return 1;
+    return 0;
+}
+
+/*
+ * Find the header and content of an entry in the table of contents, decoded into the header of the reader.
+ * Returns 0 if it's broken.
+ */
+int decode_toc_entry(struct extractor *x, const struct toc_entry *te, uint64_t *content_off, uint64_t *size) {
+    struct reader *r = &x->r;
+    uint64_t off = le64toh(te->off);
+    int n = off >= VAAR_ARCHIVE_MAGIC_LEN && off < r->len ? reader_decode(r, off, r->hdr, r->hdr_cap) : 0;
+    if (n == 0 || reader_content_size(r, r->hdr, off + n, size) || r->len - off - n < *size) {
+        fprintf(stderr, "broken table of contents entry for offset %lu\n", off);
+        return 0;
+    }
+    *content_off = off + n;
+    return n;
+}
+
+/*
+ * Make an entry a regular file with the content of another one.
+ */
+static inline void copy_content(struct x_entry *e, const struct x_entry *o) {
+    e->type = VAAR_REG;
+    e->content = o->content;
+    e->size = o->size;
+    e->sparse_size = o->sparse_size;
+}
+
+/*
+ * Make an entry a regular file with the content of the header decoded into the reader.
+ */
+static inline void set_content(struct extractor *x, struct x_entry *e, uint64_t content_off, uint64_t size) {
+    e->type = VAAR_REG;
+    e->content = content_off;
+    e->size = size;
+    e->sparse_size = x->r.hdr->flags & VAAR_FLAG_SPARSE ? x->r.hdr->size : 0;
+}
+
+/*
+ * Add the entries from the table of contents from i on, while their names are name (if exact) or start with it,
+ * taking only the latest of each name. Those of the paths before path_idx have been added already.
+ */
+int add_toc_range(struct extractor *x, uint64_t i, const char *name, size_t len, int exact, int path_idx) {
+    struct reader *r = &x->r;
+    for (; i < r->toc_cnt; i++) {
+        size_t e_len;
+        const char *e_name = toc_entry_name(r, r->toc + i, &e_len);
+        if (e_len < len || memcmp(e_name, name, len) != 0 || (exact && e_len != len))
+            break;
+        size_t next_len;
+        const char *next = i + 1 < r->toc_cnt ? toc_entry_name(r, r->toc + i + 1, &next_len) : NULL;
+        if (next && next_len == e_len && memcmp(next, e_name, e_len) == 0)
+            continue;
+        /* Already added for an earlier path. */
+        if (is_selected(x, e_name, e_len, path_idx))
+            continue;
+        uint64_t content_off, size;
+        if (!decode_toc_entry(x, r->toc + i, &content_off, &size)) {
+            x->failed++;
+            continue;
+        }
+        if (add_entry(x, r->hdr, content_off, size))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Add the entries of the paths asked for from the table of contents, without reading the other headers.
+ * A path and what's under it are two ranges in the table, as the names between them like "path-1" are
+ * sorted before "path/".
+ */
+int parse_toc(struct extractor *x) {
+    struct reader *r = &x->r;
+    char *under = NULL;
+    int ret = 0;
+    for (int k = 0; k < x->path_cnt && !ret; k++) {
+        const struct x_path *p = x->paths + k;
+        char *buf = realloc(under, p->len + 1);
+        if (buf == NULL) {
+            perror("realloc");
+            ret = 1;
+            break;
+        }
+        under = buf;
+        memcpy(under, p->name, p->len);
+        under[p->len] = '/';
+        size_t cnt = x->cnt;
+        ret = add_toc_range(x, reader_toc_seek(r, p->name, p->len), p->name, p->len, 1, k) ||
+              add_toc_range(x, reader_toc_seek(r, under, p->len + 1), under, p->len + 1, 0, k);
+        if (!ret && x->cnt == cnt && !is_selected(x, p->name, p->len, k)) {
+            fprintf(stderr, "%.*s not found in the archive\n", (int) p->len, p->name);
+            x->failed++;
+        }
+    }
+    free(under);
+    return ret;
+}
+
+/*
+ * Read all the headers of the archive into entries.
+ */
+int parse_archive(struct extractor *x) {
+    struct reader *r = &x->r;
+    if (x->path_cnt && r->toc) {
+        /* Only a few pages of the archive are touched. */
+        reader_advise(r, 0, r->map_len, MADV_RANDOM);
+        return parse_toc(x);
+    }
+    int ret;
+    while ((ret = reader_next(r)) > 0)
+        if (add_entry(x, r->hdr, r->content_off, r->size))
+            return 1;
+    return ret < 0;
+}
+
+/*
+ * Leave out the entries not asked for, after reading all of them from an archive without a table of contents.
+ */
+int select_entries(struct extractor *x) {
+    char *found = calloc(x->path_cnt, 1);
+    if (found == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type == X_SKIP)
+            continue;
+        const char *name = entry_name(x, e);
+        size_t len = strlen(name);
+        int selected = 0;
+        for (int k = 0; k < x->path_cnt; k++)
+            if (path_matches(x->paths + k, name, len))
+                selected = found[k] = 1;
+        if (!selected) {
+            /* Kept as they are, for links to them. */
+            e->type = X_SKIP;
+            x->unselected++;
+        }
+    }
+    for (int k = 0; k < x->path_cnt; k++)
+        if (!found[k]) {
+            fprintf(stderr, "%.*s not found in the archive\n", (int) x->paths[k].len, x->paths[k].name);
+            x->failed++;
+        }
+    free(found);
+    return 0;
+}
+
+static inline uint64_t name_hash(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+    return h;
+}
+
+/*
+ * Point duplicates to the contents of their originals, found by name, and make them regular files.
+ */
+int resolve_dups(struct extractor *x) {
+    if (x->dup_cnt == 0)
+        return 0;
+    size_t cap = 16;
+    while (cap < x->cnt * 2)
+        cap *= 2;
+    uint64_t *table = calloc(cap, sizeof(uint64_t));
+    if (table == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (size_t i = 0; i < x->cnt; i++) {
+        if (x->entries[i].type != VAAR_REG)
+            continue;
+        /* Only the latest of each name, as later ones replace earlier ones in appended archives. */
+        const char *name = entry_name(x, x->entries + i);
+        size_t j = name_hash(name) & (cap - 1);
+        while (table[j] && strcmp(entry_name(x, x->entries + table[j] - 1), name) != 0)
+            j = (j + 1) & (cap - 1);
+        table[j] = i + 1;
+    }
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type != VAAR_DUP)
+            continue;
+        const char *orig = x->names + e->link;
+        struct x_entry *o = NULL;
+        for (size_t j = name_hash(orig) & (cap - 1); table[j]; j = (j + 1) & (cap - 1))
+            if (strcmp(entry_name(x, x->entries + table[j] - 1), orig) == 0) {
+                o = x->entries + table[j] - 1;
+                break;
+            }
+        if (o > e) {
+            /* Replaced after the duplicate was written. Look for the one before it. */
+            o = NULL;
+            for (size_t k = i; k-- > 0;)
+                if (x->entries[k].type == VAAR_REG && strcmp(entry_name(x, x->entries + k), orig) == 0) {
+                    o = x->entries + k;
+                    break;
+                }
+        }
+        const struct toc_entry *te;
+        uint64_t content_off, size;
+        if (o == NULL && x->r.toc && (te = reader_toc_find(&x->r, orig, strlen(orig), e->content)) &&
+            te->type == VAAR_REG && decode_toc_entry(x, te, &content_off, &size)) {
+            /* The original isn't extracted along with it. */
+            set_content(x, e, content_off, size);
+            continue;
+        }
+        if (o == NULL) {
+            fprintf(stderr, "original %s of %s not found, skipped\n", orig, entry_name(x, e));
+            x->failed++;
+            e->type = X_SKIP;
+            continue;
+        }
+        copy_content(e, o);
+    }
+    free(table);
+    return 0;
+}
+
+/*
+ * Leave out the entries followed by later ones of the same name, which replace them, after reading all of them.
+ * Otherwise both would be written at once.
+ */
+int drop_superseded(struct extractor *x) {
+    size_t cap = 16;
+    while (cap < x->cnt * 2)
+        cap *= 2;
+    uint64_t *table = calloc(cap, sizeof(uint64_t));
+    if (table == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    /* From the last one, so the first of each name found is the one to keep. */
+    for (size_t i = x->cnt; i-- > 0;) {
+        struct x_entry *e = x->entries + i;
+        if (e->type == X_SKIP)
+            continue;
+        const char *name = entry_name(x, e);
+        size_t j = name_hash(name) & (cap - 1);
+        while (table[j] && strcmp(entry_name(x, x->entries + table[j] - 1), name) != 0)
+            j = (j + 1) & (cap - 1);
+        if (table[j] == 0) {
+            table[j] = i + 1;
+            continue;
+        }
+        /* Kept as they are, for links to them. */
+        e->type = X_SKIP;
+        x->superseded++;
+    }
+    free(table);
+    return 0;
+}
+
+/*
+ * Make hard links whose targets aren't extracted into copies of them.
+ */
+int resolve_links(struct extractor *x) {
+    uint64_t *found = NULL;
+    uint32_t found_cap = 0;
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type != VAAR_LNK)
+            continue;
+        if (e->anchor < x->anchor_cap && x->anchors[e->anchor]) {
+            struct x_entry *t = x->entries + x->anchors[e->anchor] - 1;
+            if (t->type == X_SKIP)
+                copy_content(e, t);
+            continue;
+        }
+        if (x->r.toc == NULL)
+            continue;
+        if (e->anchor >= found_cap) {
+            /* Targets are only in the table of contents. Find all of them at once. */
+            found_cap = e->anchor + 1;
+            for (size_t j = i + 1; j < x->cnt; j++)
+                if (x->entries[j].type == VAAR_LNK && x->entries[j].anchor >= found_cap)
+                    found_cap = x->entries[j].anchor + 1;
+            free(found);
+            if ((found = calloc(found_cap, sizeof(uint64_t))) == NULL) {
+                perror("calloc");
+                return 1;
+            }
+            for (uint64_t j = 0; j < x->r.toc_cnt; j++) {
+                const struct toc_entry *te = x->r.toc + j;
+                uint32_t anchor = le32toh(te->link_anchor);
+                if (te->type == VAAR_REG && anchor && anchor < found_cap)
+                    found[anchor] = j + 1;
+            }
+        }
+        uint64_t content_off, size;
+        if (found[e->anchor] && decode_toc_entry(x, x->r.toc + found[e->anchor] - 1, &content_off, &size))
+            set_content(x, e, content_off, size);
+    }
+    free(found);
+    return 0;
+}
+
+/*
+ * Look for a symlink entry of the name in the table of them, by index plus one.
+ */
+static inline int is_sym_entry(struct extractor *x, const uint64_t *syms, size_t cap, const char *name) {
+    for (size_t j = name_hash(name) & (cap - 1); syms[j]; j = (j + 1) & (cap - 1))
+        if (strcmp(entry_name(x, x->entries + syms[j] - 1), name) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * Check that the path is made of real directories beneath the root as far as it exists, and of no symlink
+ * from the archive. Returns 0 or an errno.
+ */
+int check_dir_path(struct extractor *x, const uint64_t *syms, size_t cap, char *path) {
+    struct open_how how = {
+            .flags = O_PATH | O_DIRECTORY | O_CLOEXEC,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = (int) syscall(SYS_openat2, x->root, path, &how, sizeof(how));
+    if (fd >= 0)
+        close(fd);
+    else if (errno != ENOENT)
+        return errno;
+    if (x->link_cnt == 0)
+        return 0;
+    /* Symlinks are only made at last, but what's made under them then would go wherever they point. */
+    for (char *p = path;; p++) {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        int sym = is_sym_entry(x, syms, cap, path);
+        *p = c;
+        if (sym)
+            return ELOOP;
+        if (c == '\0')
+            return 0;
+    }
+}
+
+/*
+ * Skip the entries that would be written through a symlink, be it one in the tree extracted over or one from the
+ * archive, so that nothing ends up outside the root. The parents of each entry are checked, and so are
+ * directories themselves, as their modes and mtimes are set through their names.
+ */
+int check_parents(struct extractor *x) {
+    size_t cap = 16;
+    while (cap < x->link_cnt * 2)
+        cap *= 2;
+    uint64_t *syms = calloc(cap, sizeof(uint64_t));
+    /* The last path checked, as entries in the same directory mostly come together. */
+    char *path = malloc(VAAR_LONG_NAME_MAX + 1);
+    char *last = malloc(VAAR_LONG_NAME_MAX + 1);
+    if (syms == NULL || path == NULL || last == NULL) {
+        perror("malloc");
+        free(syms);
+        free(path);
+        free(last);
+        return 1;
+    }
+    for (size_t i = 0; i < x->cnt; i++) {
+        if (x->entries[i].type != VAAR_SYM)
+            continue;
+        size_t j = name_hash(entry_name(x, x->entries + i)) & (cap - 1);
+        while (syms[j])
+            j = (j + 1) & (cap - 1);
+        syms[j] = i + 1;
+    }
+
+    int last_err = 0;
+    last[0] = '\0';
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type == X_SKIP)
+            continue;
+        const char *name = entry_name(x, e);
+        size_t len = strlen(name);
+        if (e->type != VAAR_DIR) {
+            const char *slash = strrchr(name, '/');
+            if (slash == NULL)
+                /* Right in the root. */
+                continue;
+            len = slash - name;
+        }
+        memcpy(path, name, len);
+        path[len] = '\0';
+        if (strcmp(path, last) != 0) {
+            last_err = check_dir_path(x, syms, cap, path);
+            memcpy(last, name, len);
+            last[len] = '\0';
+        }
+        if (last_err) {
+            report(x, e, "unsafe path", last_err);
+            e->type = X_SKIP;
+        }
+    }
+    free(syms);
+    free(path);
+    free(last);
+    return 0;
+}
+
+/*
+ * Make the missing parent directories of an entry, for archives without them.
+ */
+int make_parents(struct extractor *x, struct x_entry *e) {
+    char *path = strdup(entry_name(x, e));
+    if (path == NULL) {
+        perror("strdup");
+        return 1;
+    }
+    int ret = 0;
+    for (char *p = strchr(path, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdirat(x->root, path, 0755) && errno != EEXIST) {
+            ret = 1;
+            break;
+        }
+        *p = '/';
+    }
+    free(path);
+    return ret;
+}
+
+/*
+ * Restore the owner and mtime of an entry. With AT_SYMLINK_NOFOLLOW in flags for symlinks.
+ */
+void set_meta(struct extractor *x, struct x_entry *e, int flags) {
+    if (x->set_owner && fchownat(x->root, entry_name(x, e), e->uid, e->gid, flags))
+        report(x, e, "chown", errno);
+    struct timespec ts[2] = {
+            {.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+            {.tv_sec = e->mtime.sec, .tv_nsec = e->mtime.nsec},
+    };
+    if (utimensat(x->root, entry_name(x, e), ts, flags))
+        report(x, e, "utimensat", errno);
+}
+
+/*
+ * Run an operation for each of the entries through the ring, with as many in flight as it holds.
+ * prep queues the operation of an entry, and done handles its result.
+ */
+int run_ops(struct extractor *x, struct io_uring *ring, struct x_entry **list, size_t n,
+            void (*prep)(struct extractor *, struct io_uring_sqe *, struct x_entry *),
+            void (*done)(struct extractor *, struct x_entry *, int)) {
+    size_t queued = 0, inflight = 0;
+    while (queued < n || inflight) {
+        struct io_uring_sqe *sqe;
+        while (queued < n && inflight < (size_t) EXTRACT_RING_DEPTH && (sqe = io_uring_get_sqe(ring))) {
+            prep(x, sqe, list[queued]);
+            io_uring_sqe_set_data(sqe, list[queued]);
+            queued++;
+            inflight++;
+        }
+        int ret = io_uring_submit_and_wait(ring, 1);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            return 1;
+        }
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(ring, &cqe) == 0) {
+            struct x_entry *e = io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(ring, cqe);
+            done(x, e, res);
+            inflight--;
+        }
+    }
+    return 0;
+}
+
+void prep_mkdir(struct extractor *x, struct io_uring_sqe *sqe, struct x_entry *e) {
+    /* Writable until the real mode is set at last. */
+    io_uring_prep_mkdirat(sqe, x->root, entry_name(x, e), 0700);
+}
+
+void mkdir_done(struct extractor *x, struct x_entry *e, int res) {
+    if (res == -ENOENT && make_parents(x, e) == 0)
+        res = mkdirat(x->root, entry_name(x, e), 0700) ? -errno : 0;
+    if (res < 0 && res != -EEXIST)
+        report(x, e, "mkdir", -res);
+}
+
+/*
+ * Create all the directories, a level at a time so that parents always go first.
+ */
+int create_dirs(struct extractor *x, struct io_uring *ring) {
+    if (x->dir_cnt == 0)
+        return 0;
+    struct x_entry **list = malloc(x->dir_cnt * sizeof(struct x_entry *));
+    if (list == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    /* Sort by depth, counting. */
+    size_t max_depth = 0;
+    for (size_t i = 0; i < x->cnt; i++)
+        if (x->entries[i].type == VAAR_DIR && x->entries[i].depth > max_depth)
+            max_depth = x->entries[i].depth;
+    size_t *starts = calloc(max_depth + 2, sizeof(size_t));
+    if (starts == NULL) {
+        perror("calloc");
+        free(list);
+        return 1;
+    }
+    for (size_t i = 0; i < x->cnt; i++)
+        if (x->entries[i].type == VAAR_DIR)
+            starts[x->entries[i].depth + 1]++;
+    for (size_t d = 1; d <= max_depth + 1; d++)
+        starts[d] += starts[d - 1];
+    size_t *pos = calloc(max_depth + 1, sizeof(size_t));
+    if (pos == NULL) {
+        perror("calloc");
+        free(starts);
+        free(list);
+        return 1;
+    }
+    memcpy(pos, starts, (max_depth + 1) * sizeof(size_t));
+    for (size_t i = 0; i < x->cnt; i++)
+        if (x->entries[i].type == VAAR_DIR)
+            list[pos[x->entries[i].depth]++] = x->entries + i;
+
+    int ret = 0;
+    for (size_t d = 0; d <= max_depth && !ret; d++)
+        ret = run_ops(x, ring, list + starts[d], starts[d + 1] - starts[d], prep_mkdir, mkdir_done);
+    free(pos);
+    free(starts);
+    free(list);
+    return ret;
+}
+
+/*
+ * Write the data of a sparse file around its holes, through the fd it's just been created empty with.
+ */
+void write_sparse(struct extractor *x, struct x_entry *e, int fd) {
+    /* Checked by the reader already. */
+    uint64_t cnt;
+    memcpy(&cnt, x->r.data + e->content, sizeof(uint64_t));
+    cnt = le64toh(cnt);
+    const char *map = x->r.data + e->content + sizeof(uint64_t);
+    const char *data = map + cnt * sizeof(struct sparse_extent);
+    for (uint64_t i = 0; i < cnt; i++) {
+        struct sparse_extent ext;
+        memcpy(&ext, map + i * sizeof(ext), sizeof(ext));
+        uint64_t off = le64toh(ext.off), len = le64toh(ext.len), done = 0;
+        while (done < len) {
+            ssize_t n = pwrite(fd, data + done, len - done, (off_t) (off + done));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                report(x, e, "write", errno);
+                return;
+            }
+            done += n;
+        }
+        data += len;
+    }
+    /* The file may end with a hole. */
+    if (ftruncate(fd, (off_t) e->sparse_size))
+        report(x, e, "ftruncate", errno);
+}
+
+struct io_uring_sqe *worker_get_sqe(struct x_worker *wk, struct x_file *f, int op) {
+    struct io_uring_sqe *sqe;
+    /* Each file has 3 operations at most, and the ring is sized for all of them. */
+    while (!(sqe = io_uring_get_sqe(&wk->ring)))
+        io_uring_submit(&wk->ring);
+    f->cnt++;
+    io_uring_sqe_set_data(sqe, (void *) ((uintptr_t) f | op));
+    return sqe;
+}
+
+/*
+ * Queue the close of a file.
+ */
+void queue_close(struct x_worker *wk, struct x_file *f) {
+    struct io_uring_sqe *sqe = worker_get_sqe(wk, f, X_OP_CLOSE);
+    if (f->fixed)
+        io_uring_prep_close_direct(sqe, f->slot);
+    else
+        io_uring_prep_close(sqe, f->fd);
+}
+
+/*
+ * Queue the write of the rest of the content, if any, and the close after it if it's the last write.
+ * All of it is written through the file it's been created as, never reopened by its name.
+ */
+void queue_write(struct x_worker *wk, struct x_file *f) {
+    struct x_entry *e = f->e;
+    if (f->written < e->size) {
+        uint64_t left = e->size - f->written;
+        uint32_t len = left < EXTRACT_MAX_WRITE ? (uint32_t) left : EXTRACT_MAX_WRITE;
+        struct io_uring_sqe *sqe = worker_get_sqe(wk, f, X_OP_WRITE);
+        /* Written right from the mapped archive. */
+        io_uring_prep_write(sqe, f->fixed ? f->slot : f->fd, wk->x->r.data + e->content + f->written, len,
+                            f->written);
+        if (len < left) {
+            /* The next one is queued once it completes. */
+            io_uring_sqe_set_flags(sqe, f->fixed ? IOSQE_FIXED_FILE : 0);
+            return;
+        }
+        /* A short or failed write cancels the close, and the file is still open for the rest. */
+        io_uring_sqe_set_flags(sqe, (f->fixed ? IOSQE_FIXED_FILE : 0) | IOSQE_IO_LINK);
+    }
+    queue_close(wk, f);
+}
+
+/*
+ * Queue the operations to create and write a file.
+ */
+void queue_file(struct x_worker *wk, struct x_file *f) {
+    struct extractor *x = wk->x;
+    struct x_entry *e = f->e;
+    /* Sparse files are written around their holes synchronously, which needs a plain fd. */
+    f->fixed = wk->direct && !e->sparse_size;
+    f->fd = -1;
+    f->open_res = 0;
+    f->written = 0;
+    f->err = 0;
+    f->closed = 0;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW;
+    struct io_uring_sqe *sqe = worker_get_sqe(wk, f, X_OP_OPEN);
+    if (!f->fixed) {
+        /* The fd is needed for the write. It's queued after the open completes. */
+        io_uring_prep_openat(sqe, x->root, entry_name(x, e), flags, e->mode);
+        return;
+    }
+    io_uring_prep_openat_direct(sqe, x->root, entry_name(x, e), flags, e->mode, f->slot);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    queue_write(wk, f);
+}
+
+/*
+ * Move a file forward once all its operations have completed.
+ * Returns 1 if the file is finished, or 0 if more operations have been queued.
+ */
+int file_advance(struct x_worker *wk, struct x_file *f) {
+    struct extractor *x = wk->x;
+    struct x_entry *e = f->e;
+    if (f->open_res == -ENOENT && !f->retried) {
+        /* The archive has no header for some parent. */
+        f->retried = 1;
+        if (make_parents(x, e) == 0) {
+            queue_file(wk, f);
+            return 0;
+        }
+    }
+    if (f->open_res < 0) {
+        report(x, e, "open", -f->open_res);
+        return 1;
+    }
+    if (!f->fixed && f->fd < 0) {
+        f->fd = f->open_res;
+        if (e->sparse_size) {
+            write_sparse(x, e, f->fd);
+            queue_close(wk, f);
+        } else {
+            queue_write(wk, f);
+        }
+        return 0;
+    }
+    if (!f->closed) {
+        /* The last write came out short, or there are more of them. */
+        if (f->err || f->written == e->size)
+            queue_close(wk, f);
+        else
+            queue_write(wk, f);
+        return 0;
+    }
+    if (f->err) {
+        report(x, e, "write", f->err);
+        return 1;
+    }
+    set_meta(x, e, 0);
+    return 1;
+}
+
+void *worker_main(struct x_worker *wk) {
+    struct extractor *x = wk->x;
+    size_t next = 0, end = 0;
+    int inflight = 0;
+    while (1) {
+        /* Keep the ring full of files. */
+        while (wk->free_cnt) {
+            if (next == end) {
+                next = __atomic_fetch_add(&x->next, EXTRACT_BATCH, __ATOMIC_RELAXED);
+                if (next >= x->cnt) {
+                    next = end;
+                    break;
+                }
+                end = next + EXTRACT_BATCH < x->cnt ? next + EXTRACT_BATCH : x->cnt;
+            }
+            struct x_entry *e = x->entries + next++;
+            if (e->type != VAAR_REG)
+                continue;
+            struct x_file *f = wk->free[--wk->free_cnt];
+            f->e = e;
+            f->cnt = 0;
+            f->retried = 0;
+            queue_file(wk, f);
+            inflight++;
+        }
+        if (inflight == 0)
+            break;
+
+        int ret = io_uring_submit_and_wait(&wk->ring, 1);
+        if (ret < 0) {
+            fprintf(stderr, "io_uring_submit_and_wait: %s\n", strerror(-ret));
+            exit(1);
+        }
+        struct io_uring_cqe *cqe;
+        while (io_uring_peek_cqe(&wk->ring, &cqe) == 0) {
+            uintptr_t data = (uintptr_t) io_uring_cqe_get_data(cqe);
+            struct x_file *f = (struct x_file *) (data & ~X_OP_MASK);
+            int res = cqe->res;
+            io_uring_cqe_seen(&wk->ring, cqe);
+            switch (data & X_OP_MASK) {
+                case X_OP_OPEN:
+                    f->open_res = res;
+                    break;
+                case X_OP_WRITE:
+                    if (res < 0)
+                        f->err = -res;
+                    else
+                        f->written += res;
+                    break;
+                default:
+                    f->closed = res != -ECANCELED;
+                    break;
+            }
+            if (--f->cnt > 0 || !file_advance(wk, f))
+                continue;
+            wk->free[wk->free_cnt++] = f;
+            inflight--;
+        }
+    }
+    return NULL;
+}
+
+int worker_init(struct x_worker *wk, struct extractor *x) {
+    wk->x = x;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ret = io_uring_queue_init_params(EXTRACT_DEPTH * 4, &wk->ring, &p);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return 1;
+    }
+    /* Like the creator, link writes to direct opens only if the kernel looks up linked files late. */
+    wk->direct = 0;
+    if (p.features & IORING_FEAT_LINKED_FILE) {
+        int fds[EXTRACT_DEPTH];
+        memset(fds, -1, sizeof(fds));
+        wk->direct = io_uring_register_files(&wk->ring, fds, EXTRACT_DEPTH) == 0;
+    }
+    for (int i = 0; i < EXTRACT_DEPTH; i++) {
+        wk->files[i].slot = i;
+        wk->free[i] = wk->files + i;
+    }
+    wk->free_cnt = EXTRACT_DEPTH;
+    return 0;
+}
+
+/*
+ * Write all the regular files with thread_cnt workers.
+ */
+int write_files(struct extractor *x, int thread_cnt) {
+    struct x_worker *workers = calloc(thread_cnt, sizeof(struct x_worker));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    int ret = 0, started = 0;
+    for (; started < thread_cnt; started++) {
+        if (worker_init(workers + started, x)) {
+            ret = 1;
+            break;
+        }
+        if (pthread_create(&workers[started].tid, NULL, (void *(*)(void *)) worker_main, workers + started)) {
+            perror("pthread_create");
+            io_uring_queue_exit(&workers[started].ring);
+            ret = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].tid, NULL);
+        io_uring_queue_exit(&workers[i].ring);
+    }
+    free(workers);
+    return ret;
+}
+
+void prep_link(struct extractor *x, struct io_uring_sqe *sqe, struct x_entry *e) {
+    if (e->type == VAAR_SYM)
+        io_uring_prep_symlinkat(sqe, x->names + e->link, x->root, entry_name(x, e));
+    else
+        io_uring_prep_linkat(sqe, x->root, entry_name(x, x->entries + x->anchors[e->anchor] - 1),
+                             x->root, entry_name(x, e), 0);
+}
+
+/*
+ * Make a link synchronously, after the async one failed.
+ */
+int make_link(struct extractor *x, struct x_entry *e) {
+    if (e->type == VAAR_SYM)
+        return symlinkat(x->names + e->link, x->root, entry_name(x, e)) ? -errno : 0;
+    return linkat(x->root, entry_name(x, x->entries + x->anchors[e->anchor] - 1), x->root, entry_name(x, e), 0)
+           ? -errno : 0;
+}
+
+void link_done(struct extractor *x, struct x_entry *e, int res) {
+    if (res == -ENOENT && make_parents(x, e) == 0)
+        res = make_link(x, e);
+    if (res == -EEXIST && unlinkat(x->root, entry_name(x, e), 0) == 0)
+        /* Extracting over an older copy. */
+        res = make_link(x, e);
+    if (res < 0) {
+        report(x, e, e->type == VAAR_SYM ? "symlink" : "link", -res);
+        return;
+    }
+    if (e->type == VAAR_SYM)
+        set_meta(x, e, AT_SYMLINK_NOFOLLOW);
+}
+
+/*
+ * Make all the symlinks and hard links. Symlinks go after the files, so none of them is written through one.
+ */
+int create_links(struct extractor *x, struct io_uring *ring) {
+    if (x->link_cnt == 0)
+        return 0;
+    struct x_entry **list = malloc(x->link_cnt * sizeof(struct x_entry *));
+    if (list == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type == VAAR_LNK && (e->anchor >= x->anchor_cap || x->anchors[e->anchor] == 0)) {
+            fprintf(stderr, "target of hard link %s not found, skipped\n", entry_name(x, e));
+            x->failed++;
+            continue;
+        }
+        if (e->type == VAAR_SYM || e->type == VAAR_LNK)
+            list[n++] = e;
+    }
+    int ret = run_ops(x, ring, list, n, prep_link, link_done);
+    free(list);
+    return ret;
+}
+
+/*
+ * Remove the files marked deleted, which come before the directories they were in.
+ */
+void remove_deleted(struct extractor *x) {
+    if (x->del_cnt == 0)
+        return;
+    for (size_t i = 0; i < x->cnt; i++) {
+        struct x_entry *e = x->entries + i;
+        if (e->type != VAAR_DEL)
+            continue;
+        int ret = unlinkat(x->root, entry_name(x, e), 0);
+        if (ret && (errno == EISDIR || errno == EPERM))
+            ret = unlinkat(x->root, entry_name(x, e), AT_REMOVEDIR);
+        /* It may have never been extracted. */
+        if (ret && errno != ENOENT)
+            report(x, e, "unlink", errno);
+    }
+}
+
+/*
+ * Restore the modes, owners and mtimes of directories, deepest first, now that nothing else is written into them.
+ */
+void finish_dirs(struct extractor *x) {
+    for (size_t i = x->cnt; i-- > 0;) {
+        struct x_entry *e = x->entries + i;
+        if (e->type != VAAR_DIR)
+            continue;
+        if (fchmodat(x->root, entry_name(x, e), e->mode, 0))
+            report(x, e, "chmod", errno);
+        set_meta(x, e, 0);
+    }
+}
+
+/*
+ * Clean up the paths asked for to match names in the archive.
+ */
+int set_paths(struct extractor *x, char *paths[], int path_cnt) {
+    if (path_cnt == 0)
+        return 0;
+    if ((x->paths = malloc(path_cnt * sizeof(struct x_path))) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (int i = 0; i < path_cnt; i++) {
+        int off = clean_path(paths[i]);
+        size_t len = off < 0 ? 0 : strlen(paths[i] + off);
+        while (len > 0 && paths[i][off + len - 1] == '/')
+            len--;
+        if (len == 0) {
+            fprintf(stderr, "path %s failed validation\n", paths[i]);
+            return 1;
+        }
+        x->paths[i].name = paths[i] + off;
+        x->paths[i].len = len;
+    }
+    x->path_cnt = path_cnt;
+    return 0;
+}
+
+int extract_archive(const char *path, const char *dir, int thread_cnt, char *paths[], int path_cnt) {
+    int ret = 0;
+    struct extractor x;
+    memset(&x, 0, sizeof(struct extractor));
+    x.root = -1;
+    x.set_owner = geteuid() == 0;
+    owner_map_init(&x.users);
+    owner_map_init(&x.groups);
+    /* Modes are restored as they are in the archive. */
+    umask(0);
+
+    struct io_uring ring;
+    int ring_ready = 0;
+    /* Entries looked up in the table of contents are the latest of their names already. */
+    if (set_paths(&x, paths, path_cnt) || reader_open(&x.r, path) || parse_archive(&x) || resolve_dups(&x) ||
+        (!(x.path_cnt && x.r.toc) && drop_superseded(&x)) ||
+        (x.path_cnt && x.r.toc == NULL && select_entries(&x)) || resolve_links(&x)) {
+        ret = 1;
+        goto exit;
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        perror("mkdir");
+        ret = 1;
+        goto exit;
+    }
+    if ((x.root = open(dir, O_RDONLY | O_DIRECTORY)) < 0) {
+        perror("open");
+        ret = 1;
+        goto exit;
+    }
+    int err = io_uring_queue_init(EXTRACT_RING_DEPTH, &ring, 0);
+    if (err < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-err));
+        ret = 1;
+        goto exit;
+    }
+    ring_ready = 1;
+
+    if (check_parents(&x)) {
+        ret = 1;
+        goto exit;
+    }
+    remove_deleted(&x);
+    if (create_dirs(&x, &ring) || write_files(&x, thread_cnt) || create_links(&x, &ring)) {
+        ret = 1;
+        goto exit;
+    }
+    finish_dirs(&x);
+    size_t done = x.cnt - x.unselected - x.superseded;
+    printf("%zu entries extracted, %zu failed\n", done > x.failed ? done - x.failed : 0, x.failed);
+    if (x.failed)
+        ret = 1;
+
+    exit:
+    if (ring_ready)
+        io_uring_queue_exit(&ring);
+    if (x.root >= 0)
+        close(x.root);
+    reader_close(&x.r);
+    owner_map_free(&x.users);
+    owner_map_free(&x.groups);
+    free(x.entries);
+    free(x.names);
+    free(x.anchors);
+    free(x.paths);
+    return ret;
+}
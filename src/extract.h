@@ -0,0 +1,74 @@
+#ifndef VAAR_EXTRACT_H
+#define VAAR_EXTRACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+#include "owner.h"
+#include "reader.h"
+
+/*
+ * An entry to be extracted, as parsed out of the archive.
+ */
+struct x_entry {
+    uint64_t content; /* where the content starts in the archive; for duplicates, the one of the original */
+    uint64_t size; /* of the content in the archive */
+    uint64_t sparse_size; /* the size of a sparse file, whose content is its extent map and data; 0 otherwise */
+    uint64_t name; /* offsets in the name arena */
+    uint64_t link; /* the symlink target, or the name of the original of a duplicate */
+    struct file_ts mtime;
+    uint32_t uid, gid; /* on this system */
+    uint32_t anchor;
+    uint16_t mode;
+    uint16_t depth; /* of directories, to create parents first */
+    uint8_t type;
+};
+
+/*
+ * A path asked to be extracted, cleaned up like names in the archive.
+ */
+struct x_path {
+    const char *name;
+    size_t len;
+};
+
+/*
+ * The state of extracting an archive.
+ * The archive is parsed first. Then the directories are created level by level, the files are written by a pool
+ * of threads, each with its own io_uring, and the links are made once their targets exist. The metadata of
+ * directories is restored at last, so nothing written into them changes their mtime afterwards.
+ * If only some paths are asked for, they are looked up in the table of contents if the archive has one.
+ * Files marked deleted in an incremental archive are removed first, so it can be extracted over the one before.
+ */
+struct extractor {
+    struct reader r;
+    int root; /* the directory extracted into */
+    int set_owner; /* owners are restored only by root */
+    struct x_path *paths; /* what to extract, along with everything under it; all if there are none */
+    int path_cnt;
+    struct owner_map users, groups;
+
+    struct x_entry *entries;
+    size_t cnt, cap;
+    char *names; /* all the names, terminated */
+    size_t names_len, names_cap;
+    uint64_t *anchors; /* the entry of each hard link anchor, plus 1 */
+    uint32_t anchor_cap;
+    size_t dir_cnt, link_cnt, dup_cnt, del_cnt;
+    size_t unselected; /* entries read but not asked for */
+    size_t superseded; /* entries followed by later ones of the same name, as in appended archives */
+
+    size_t next; /* the next entry to be taken by file workers */
+    size_t failed;
+};
+
+/*
+ * Extract the archive at path into dir with thread_cnt file workers.
+ * If path_cnt is not 0, only the paths and what's under them are extracted. Hard links and duplicates whose
+ * originals are left out become copies.
+ * Returns 0 if everything has been extracted.
+ */
+int extract_archive(const char *path, const char *dir, int thread_cnt, char *paths[], int path_cnt);
+
+#endif //VAAR_EXTRACT_H
@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "format.h"
+
+/*
+ * Zigzag a signed number so that small negative ones stay short as varints.
+ */
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+int file_header_encode_v2(const struct file_header *hdr, char *out) {
+    int link_len = le16toh(hdr->link_len);
+    const char *name = hdr->name;
+    uint64_t name_len;
+    if (hdr->flags & VAAR_FLAG_LONG_NAME) {
+        uint16_t len;
+        const char *ext = file_header_ext(hdr, link_len);
+        memcpy(&len, ext, sizeof(uint16_t));
+        name_len = le16toh(len);
+        name = ext + sizeof(uint16_t);
+    } else {
+        name_len = strnlen(hdr->name, sizeof(hdr->name));
+    }
+
+    int n = 0;
+    out[n++] = (char) hdr->type;
+    out[n++] = (char) (hdr->flags & ~VAAR_FLAG_LONG_NAME);
+    n += varint_put(out + n, name_len);
+    memcpy(out + n, name, name_len);
+    n += (int) name_len;
+    n += varint_put(out + n, le64toh(hdr->size));
+    n += varint_put(out + n, le16toh(hdr->mode));
+    n += varint_put(out + n, zigzag((int64_t) le64toh(hdr->mtime.sec)));
+    n += varint_put(out + n, le64toh(hdr->mtime.nsec));
+    n += varint_put(out + n, le32toh(hdr->uid));
+    n += varint_put(out + n, le32toh(hdr->gid));
+    n += varint_put(out + n, le32toh(hdr->link_anchor));
+    n += varint_put(out + n, link_len);
+    memcpy(out + n, hdr->linkname, link_len);
+    n += link_len;
+    return n;
+}
+
+int owner_record_encode_v2(uint8_t type, uint32_t id, const char *name, char *out) {
+    size_t name_len = strlen(name);
+    int n = 0;
+    out[n++] = (char) type;
+    n += varint_put(out + n, id);
+    n += varint_put(out + n, name_len);
+    memcpy(out + n, name, name_len);
+    return n + (int) name_len;
+}
+
+/*
+ * Read the next varint of a record, bailing out of the parsing function if it's not all there.
+ */
+#define GET_VARINT(v) do { \
+    int _n = varint_get(buf + off, len - off, &(v)); \
+    if (_n == 0) \
+        return len - off >= 10 ? -1 : 0; \
+    off += _n; \
+} while (0)
+
+int file_header_decode_v2(const char *buf, size_t len, struct file_header *hdr, int hdr_cap) {
+    size_t off = 0;
+    uint64_t v, name_len;
+    if (len < 1)
+        return 0;
+    uint8_t type = buf[off++];
+
+    if (type == VAAR_USER || type == VAAR_GROUP) {
+        uint64_t id;
+        GET_VARINT(id);
+        GET_VARINT(name_len);
+        if (len - off < name_len)
+            return 0;
+        memset(hdr, 0, sizeof(struct file_header));
+        hdr->type = type;
+        char *dst = type == VAAR_USER ? hdr->uname : hdr->gname;
+        memcpy(dst, buf + off, name_len < 32 ? name_len : 32);
+        if (type == VAAR_USER)
+            hdr->uid = id;
+        else
+            hdr->gid = id;
+        return (int) (off + name_len);
+    }
+    if (type > VAAR_DEL)
+        return -1;
+
+    if (len - off < 1)
+        return 0;
+    uint8_t flags = buf[off++];
+    GET_VARINT(name_len);
+    if (name_len > VAAR_LONG_NAME_MAX)
+        return -1;
+    if (len - off < name_len)
+        return 0;
+    const char *name = buf + off;
+    off += name_len;
+
+    struct file_header h;
+    memset(&h, 0, sizeof(struct file_header));
+    h.type = type;
+    h.flags = flags;
+    GET_VARINT(v);
+    h.size = v;
+    GET_VARINT(v);
+    h.mode = v;
+    GET_VARINT(v);
+    h.mtime.sec = unzigzag(v);
+    GET_VARINT(v);
+    h.mtime.nsec = (int64_t) v;
+    GET_VARINT(v);
+    h.uid = v;
+    GET_VARINT(v);
+    h.gid = v;
+    GET_VARINT(v);
+    h.link_anchor = v;
+    GET_VARINT(v);
+    if (v > UINT16_MAX)
+        return -1;
+    h.link_len = v;
+    if (len - off < h.link_len)
+        return 0;
+
+    int long_name_len = name_len > VAAR_NAME_MAX ? (int) name_len : 0;
+    if (file_header_length(h.link_len, long_name_len) > hdr_cap)
+        return -1;
+    memcpy(hdr, &h, sizeof(struct file_header));
+    memcpy(hdr->name, name, long_name_len ? VAAR_NAME_MAX : name_len);
+    if (h.link_len) {
+        memcpy(hdr->linkname, buf + off, h.link_len);
+        hdr->linkname[h.link_len] = '\0';
+        off += h.link_len;
+    }
+    if (long_name_len) {
+        hdr->flags |= VAAR_FLAG_LONG_NAME;
+        char *ext = file_header_ext(hdr, h.link_len);
+        uint16_t l = htole16(long_name_len);
+        memcpy(ext, &l, sizeof(uint16_t));
+        memcpy(ext + sizeof(uint16_t), name, long_name_len);
+    }
+    return (int) off;
+}
@@ -4,10 +4,13 @@
 #include <endian.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/stat.h>
 
 #define VAAR_ARCHIVE_MAGIC "\xf0\x9f\x90\xb3\xf0\x9f\x93\xa6\x00\x00"
+#define VAAR_ARCHIVE_MAGIC_V2 "\xf0\x9f\x90\xb3\xf0\x9f\x93\xa6\x02\x00"
 #define VAAR_ARCHIVE_MAGIC_LEN 10
+#define VAAR_ARCHIVE_VERSION_OFF 8 /* the byte telling the version in the magic; 0 for v1 */
 
 /*
  * File types used in Vaar file headers.
@@ -17,8 +20,46 @@ enum {
     VAAR_REG, /* regular file */
     VAAR_SYM, /* symlink */
     VAAR_LNK, /* hard link */
+    VAAR_DUP, /* regular file with the same content as an earlier one, whose name is in linkname */
+    VAAR_DEL, /* a file deleted since the archive an incremental one is based on, with nothing but the name */
+
+    /* v2 only: the name of a user or group id, written once before the first header with the id */
+    VAAR_USER = 16,
+    VAAR_GROUP,
+};
+
+/*
+ * Flags in Vaar file headers.
+ */
+enum {
+    VAAR_FLAG_LONG_NAME = 1 << 0, /* the name doesn't fit; the full one follows the link fields */
+    VAAR_FLAG_CHECKSUM = 1 << 1, /* a CRC-32C of the content follows it, in a uint32_t */
+    VAAR_FLAG_SPARSE = 1 << 2, /* the file has holes, and only the data around them is in the content */
+    VAAR_FLAG_PADDED = 1 << 3, /* the content is aligned in the archive, after a uint32_t length and padding */
 };
 
+/*
+ * With VAAR_FLAG_PADDED, the header is followed by a uint32_t in little endian, and that many bytes of zeros,
+ * so that the content starts on a block of the archive and can be cloned into it.
+ */
+#define VAAR_PAD_MAX (1 << 20)
+
+/*
+ * With VAAR_FLAG_SPARSE, the content is a uint64_t count of extents, the extents, and then the data of each
+ * in order, all in little endian. The size in the header is the size of the file, holes included.
+ * Whatever is not in an extent is a hole, even up to the end of the file.
+ */
+struct sparse_extent {
+    uint64_t off;
+    uint64_t len;
+} __attribute__((packed));
+
+/*
+ * Names longer than this are stored in the long name extension.
+ */
+#define VAAR_NAME_MAX 255
+#define VAAR_LONG_NAME_MAX UINT16_MAX
+
 /*
  * The timestamp struct used in Vaar file headers.
  * It has the same meaning of timespec.
@@ -32,12 +73,15 @@ struct file_ts {
  * The Vaar file header struct.
  * The total length can be calculated with file_header_length().
  * The numbers are stored and transferred in little endian.
+ *
+ * With VAAR_FLAG_LONG_NAME, name holds the first VAAR_NAME_MAX bytes of the name, and the long name
+ * extension follows linkname: the full length in a uint16_t, then the full name without a terminator.
  */
 struct file_header {
     char name[256];
     uint64_t size;
     uint8_t type;
-    uint8_t _reserved;
+    uint8_t flags;
     uint16_t mode;
     struct file_ts mtime;
 
@@ -59,13 +103,36 @@ struct file_header {
 } __attribute__((packed));
 
 /*
- * Get the size of a file_header for a file with its symlink target length being link_len.
+ * Get the size of a file_header for a file with its symlink target length being link_len,
+ * and its name length being long_name_len if it needs the long name extension, or 0 otherwise.
+ */
+static inline int file_header_length(int link_len, int long_name_len) {
+    int len = (int) sizeof(struct file_header);
+    if (link_len > 0)
+        len += link_len + 1;
+    if (long_name_len > 0)
+        len += (int) sizeof(uint16_t) + long_name_len;
+    return len;
+}
+
+/*
+ * Get the long name extension of a file_header, right after linkname.
+ */
+static inline char *file_header_ext(const struct file_header *hdr, int link_len) {
+    return (char *) hdr->linkname + (link_len > 0 ? link_len + 1 : 0);
+}
+
+/*
+ * Get the size of an encoded file_header.
  */
-static inline int file_header_length(int link_len) {
-    if (link_len > 0) {
-        return (int) sizeof(struct file_header) + link_len + 1;
+static inline int file_header_size(const struct file_header *hdr) {
+    int link_len = le16toh(hdr->link_len);
+    uint16_t long_name_len = 0;
+    if (hdr->flags & VAAR_FLAG_LONG_NAME) {
+        memcpy(&long_name_len, file_header_ext(hdr, link_len), sizeof(uint16_t));
+        long_name_len = le16toh(long_name_len);
     }
-    return (int) sizeof(struct file_header);
+    return file_header_length(link_len, long_name_len);
 }
 
 /*
@@ -96,4 +163,131 @@ static inline void file_header_decode(struct file_header *hdr) {
     hdr->mtime.nsec = le64toh(hdr->mtime.nsec);
 }
 
+/*
+ * In v2 archives, a file header is a compact record of varints (LEB128, zigzag for signed ones):
+ *
+ *     type (1 byte), flags (1 byte), name length, name, size, mode, mtime.sec, mtime.nsec, uid, gid,
+ *     link_anchor, link_len, linkname
+ *
+ * Names aren't terminated, and the long name extension is never needed. uname and gname aren't in headers.
+ * Instead, a VAAR_USER or VAAR_GROUP record of type (1 byte), id, name length and name comes once before
+ * the first header with the id, if it has a name.
+ */
+
+/*
+ * Get the most bytes the v2 form of an encoded file_header may take.
+ */
+static inline int file_header_v2_bound(const struct file_header *hdr) {
+    return file_header_size(hdr) + 64;
+}
+
+/*
+ * Write an unsigned varint. Returns its length.
+ */
+static inline int varint_put(char *out, uint64_t v) {
+    int n = 0;
+    while (v >= 0x80) {
+        out[n++] = (char) (v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (char) v;
+    return n;
+}
+
+/*
+ * Read an unsigned varint from buf of len bytes.
+ * Returns its length, or 0 if it's truncated or malformed.
+ */
+static inline int varint_get(const char *buf, size_t len, uint64_t *v) {
+    *v = 0;
+    for (int i = 0; i < 10 && (size_t) i < len; i++) {
+        *v |= (uint64_t) (buf[i] & 0x7f) << (7 * i);
+        if (!(buf[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+/*
+ * Convert an encoded file_header to its v2 form in out, which must have file_header_v2_bound() bytes.
+ * Returns the length written.
+ */
+int file_header_encode_v2(const struct file_header *hdr, char *out);
+
+/*
+ * Write the v2 record naming an owner id, with type being VAAR_USER or VAAR_GROUP.
+ * out must have 24 bytes more than the name. Returns the length written.
+ */
+int owner_record_encode_v2(uint8_t type, uint32_t id, const char *name, char *out);
+
+/*
+ * Parse a v2 record in buf of len bytes into hdr of hdr_cap bytes, in host endian like file_header_decode.
+ * Long names come back with the long name extension, whose length stays little endian as in v1.
+ * An owner record has its type, the id in uid or gid, and the name in uname or gname.
+ * Returns the length parsed, 0 if buf doesn't hold the whole record, or -1 if it's malformed or hdr is too small.
+ */
+int file_header_decode_v2(const char *buf, size_t len, struct file_header *hdr, int hdr_cap);
+
+/*
+ * A compressed archive starts with this magic instead, followed by frames. Each frame is a frame_header,
+ * then comp_len bytes that decompress to the next raw_len bytes of the plain archive, at raw_off in it.
+ * Frames are independent of each other, so they can be decompressed in parallel, or from the middle.
+ */
+#define VAAR_FRAMED_MAGIC "\xf0\x9f\x90\xb3\xf0\x9f\x97\x9c\x00\x00"
+#define VAAR_FRAMED_MAGIC_LEN 10
+
+/*
+ * Codecs of frames.
+ */
+enum {
+    VAAR_FRAME_STORED, /* not compressed, as it didn't get smaller */
+    VAAR_FRAME_ZLIB,
+};
+
+/*
+ * The header of a frame in a compressed archive, in little endian.
+ */
+struct frame_header {
+    uint8_t codec;
+    uint8_t _reserved[3];
+    uint32_t comp_len;
+    uint32_t raw_len;
+    uint64_t raw_off;
+} __attribute__((packed));
+
+/*
+ * An archive may end with a table of contents, to find entries without reading all the headers before them:
+ * a toc_entry for each header, sorted by name, then their names, and a toc_footer at the very end.
+ * Entries with the same name are sorted by offset, so the last one is the latest.
+ * In compressed archives, the table is compressed along with everything else, and its offsets are in the
+ * plain archive.
+ */
+#define VAAR_TOC_MAGIC "\xf0\x9f\x94\x96\xf0\x9f\x93\xa6"
+#define VAAR_TOC_MAGIC_LEN 8
+
+/*
+ * An entry in the table of contents, in little endian.
+ */
+struct toc_entry {
+    uint64_t off; /* where the header starts */
+    uint64_t size; /* of the file, as in its header */
+    uint64_t name_off; /* in the names after the entries */
+    uint32_t link_anchor;
+    uint16_t name_len;
+    uint8_t type;
+    uint8_t _reserved;
+} __attribute__((packed));
+
+/*
+ * The end of an archive with a table of contents, in little endian.
+ */
+struct toc_footer {
+    uint64_t toc_off; /* where the first toc_entry starts */
+    uint64_t entry_cnt;
+    uint64_t names_len;
+    uint32_t crc; /* CRC-32C of the entries and the names */
+    uint32_t _reserved;
+    char magic[VAAR_TOC_MAGIC_LEN];
+} __attribute__((packed));
+
 #endif //VAAR_FORMAT_H
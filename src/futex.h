@@ -0,0 +1,22 @@
+#ifndef VAAR_FUTEX_H
+#define VAAR_FUTEX_H
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Sleep as long as *addr equals val. Spurious wakeups are possible.
+ */
+static inline void futex_wait(int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/*
+ * Wake up to n threads sleeping on addr.
+ */
+static inline void futex_wake(int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#endif //VAAR_FUTEX_H
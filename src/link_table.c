@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_table.h"
+
+const uint32_t LINK_STRIPE_INIT_CAP = 64;
+
+static inline uint64_t link_hash(uint64_t dev, uint64_t ino) {
+    uint64_t h = (ino ^ (dev << 32 | dev >> 32)) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+int link_table_init(struct link_table *t) {
+    memset(t, 0, sizeof(struct link_table));
+    for (int i = 0; i < LINK_STRIPES; i++)
+        if (pthread_mutex_init(&t->stripes[i].lock, NULL)) {
+            perror("pthread_mutex_init");
+            return 1;
+        }
+    return 0;
+}
+
+struct link_stripe *link_table_lock(struct link_table *t, uint64_t dev, uint64_t ino) {
+    struct link_stripe *st = t->stripes + link_hash(dev, ino) % LINK_STRIPES;
+    pthread_mutex_lock(&st->lock);
+    return st;
+}
+
+/*
+ * Get the slot of the file in the stripe, or the empty slot where it should go.
+ */
+struct link_entry *link_slot(struct link_entry *entries, uint32_t cap, uint64_t dev, uint64_t ino) {
+    /* The low bits picked the stripe. Use the high bits here. */
+    uint32_t i = (uint32_t) (link_hash(dev, ino) >> 32) & (cap - 1);
+    while (entries[i].anchor && (entries[i].dev != dev || entries[i].ino != ino))
+        i = (i + 1) & (cap - 1);
+    return entries + i;
+}
+
+uint32_t link_table_find(struct link_stripe *st, uint64_t dev, uint64_t ino) {
+    if (st->cnt == 0)
+        return 0;
+    return link_slot(st->entries, st->cap, dev, ino)->anchor;
+}
+
+/*
+ * Double the capacity of a stripe, or allocate it in the first place.
+ */
+int link_stripe_grow(struct link_stripe *st) {
+    uint32_t cap = st->cap ? st->cap * 2 : LINK_STRIPE_INIT_CAP;
+    struct link_entry *entries = calloc(cap, sizeof(struct link_entry));
+    if (entries == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    for (uint32_t i = 0; i < st->cap; i++)
+        if (st->entries[i].anchor)
+            *link_slot(entries, cap, st->entries[i].dev, st->entries[i].ino) = st->entries[i];
+    free(st->entries);
+    st->entries = entries;
+    st->cap = cap;
+    return 0;
+}
+
+uint32_t link_table_add(struct link_table *t, struct link_stripe *st, uint64_t dev, uint64_t ino) {
+    /* Keep the load under a half. */
+    if ((st->cnt + 1) * 2 > st->cap && link_stripe_grow(st))
+        return 0;
+    struct link_entry *e = link_slot(st->entries, st->cap, dev, ino);
+    e->dev = dev;
+    e->ino = ino;
+    e->anchor = __atomic_add_fetch(&t->anchors, 1, __ATOMIC_RELAXED);
+    st->cnt++;
+    return e->anchor;
+}
+
+void link_table_free(struct link_table *t) {
+    for (int i = 0; i < LINK_STRIPES; i++) {
+        free(t->stripes[i].entries);
+        pthread_mutex_destroy(&t->stripes[i].lock);
+    }
+}
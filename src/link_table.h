@@ -0,0 +1,59 @@
+#ifndef VAAR_LINK_TABLE_H
+#define VAAR_LINK_TABLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define LINK_STRIPES 64
+
+/*
+ * A file with several names, and the anchor its first name was written with.
+ */
+struct link_entry {
+    uint64_t dev, ino;
+    uint32_t anchor; /* 0 if the entry is empty */
+};
+
+/*
+ * A part of a link_table with its own lock, as an open addressing hash table.
+ */
+struct link_stripe {
+    pthread_mutex_t lock;
+    struct link_entry *entries;
+    uint32_t cap, cnt;
+};
+
+/*
+ * Thread-safe map from (dev, ino) to the anchor of hard links, striped by hash.
+ * A stripe is locked while a file is looked up and its record is queued, so the first name of a file
+ * is always queued before any hard link to it.
+ */
+struct link_table {
+    struct link_stripe stripes[LINK_STRIPES];
+    uint32_t anchors; /* the last anchor given */
+};
+
+int link_table_init(struct link_table *t);
+
+/*
+ * Lock and get the stripe where the file lives.
+ */
+struct link_stripe *link_table_lock(struct link_table *t, uint64_t dev, uint64_t ino);
+
+static inline void link_table_unlock(struct link_stripe *st) {
+    pthread_mutex_unlock(&st->lock);
+}
+
+/*
+ * Get the anchor of the file in a locked stripe, or 0 if it hasn't been added.
+ */
+uint32_t link_table_find(struct link_stripe *st, uint64_t dev, uint64_t ino);
+
+/*
+ * Give the file a new anchor in a locked stripe, and return it. Returns 0 on errors.
+ */
+uint32_t link_table_add(struct link_table *t, struct link_stripe *st, uint64_t dev, uint64_t ino);
+
+void link_table_free(struct link_table *t);
+
+#endif //VAAR_LINK_TABLE_H
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "reader.h"
+
+/* Output buffered at once, as names are printed in a tight loop. */
+#define LIST_BUF_SIZE (1 << 20)
+
+/*
+ * Print the details of the current entry before its name.
+ */
+void print_details(const struct reader *r) {
+    const struct file_header *hdr = r->hdr;
+    static const char types[] = {'d', '-', 'l', 'h', '-', 'x'};
+    char mode[11];
+    mode[0] = hdr->type < sizeof(types) ? types[hdr->type] : '?';
+    for (int i = 0; i < 9; i++)
+        mode[1 + i] = hdr->mode & (0400 >> i) ? "rwxrwxrwx"[i] : '-';
+    mode[10] = '\0';
+
+    char owner[80];
+    int n = hdr->uname[0] ? snprintf(owner, sizeof(owner), "%.32s/", hdr->uname)
+                          : snprintf(owner, sizeof(owner), "%u/", hdr->uid);
+    if (hdr->gname[0])
+        snprintf(owner + n, sizeof(owner) - n, "%.32s", hdr->gname);
+    else
+        snprintf(owner + n, sizeof(owner) - n, "%u", hdr->gid);
+
+    char mtime[32];
+    struct tm tm;
+    time_t sec = (time_t) hdr->mtime.sec;
+    if (localtime_r(&sec, &tm) == NULL || strftime(mtime, sizeof(mtime), "%Y-%m-%d %H:%M", &tm) == 0)
+        snprintf(mtime, sizeof(mtime), "%ld", (long) hdr->mtime.sec);
+
+    printf("%s %-17s %12lu %s ", mode, owner, hdr->size, mtime);
+}
+
+/*
+ * Remember where the file carrying a hard link anchor is, to name it for the later links.
+ */
+int add_anchor_off(uint64_t **anchors, uint32_t *cap, uint32_t anchor, uint64_t off) {
+    if (anchor >= *cap) {
+        uint32_t new_cap = *cap ? *cap : 1024;
+        while (new_cap <= anchor)
+            new_cap *= 2;
+        uint64_t *new_anchors = realloc(*anchors, new_cap * sizeof(uint64_t));
+        if (new_anchors == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        memset(new_anchors + *cap, 0, (new_cap - *cap) * sizeof(uint64_t));
+        *anchors = new_anchors;
+        *cap = new_cap;
+    }
+    (*anchors)[anchor] = off;
+    return 0;
+}
+
+/*
+ * Print the name of the file a hard link refers to.
+ */
+void print_target(const struct reader *r, uint64_t off, struct file_header *hdr) {
+    if (off == 0 || reader_decode(r, off, hdr, r->hdr_cap) == 0) {
+        printf(" link to a missing file");
+        return;
+    }
+    int len;
+    const char *name = file_header_name(hdr, &len);
+    printf(" link to %.*s", len, name);
+}
+
+int list_archive(const char *path, int verbose) {
+    static char buf[LIST_BUF_SIZE];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+
+    int ret = 0;
+    uint64_t *anchors = NULL;
+    uint32_t anchor_cap = 0;
+    struct file_header *target = NULL;
+    struct reader r;
+    if (reader_open(&r, path)) {
+        ret = 1;
+        goto exit;
+    }
+    if ((target = malloc(r.hdr_cap)) == NULL) {
+        perror("malloc");
+        ret = 1;
+        goto exit;
+    }
+    int n;
+    while ((n = reader_next(&r)) > 0) {
+        const struct file_header *hdr = r.hdr;
+        if (verbose)
+            print_details(&r);
+        int len;
+        const char *name = file_header_name(hdr, &len);
+        fwrite(name, 1, len, stdout);
+        if (verbose && hdr->type == VAAR_SYM) {
+            printf(" -> %s", hdr->linkname);
+        } else if (verbose && hdr->type == VAAR_DUP) {
+            printf(" same as %s", hdr->linkname);
+        } else if (verbose && hdr->type == VAAR_DEL) {
+            printf(" deleted");
+        } else if (verbose && hdr->type == VAAR_LNK) {
+            print_target(&r, hdr->link_anchor < anchor_cap ? anchors[hdr->link_anchor] : 0, target);
+        } else if (verbose && hdr->type == VAAR_REG && hdr->link_anchor &&
+                   add_anchor_off(&anchors, &anchor_cap, hdr->link_anchor, r.hdr_off)) {
+            ret = 1;
+            break;
+        }
+        putchar('\n');
+    }
+    if (n < 0)
+        ret = 1;
+
+    exit:
+    fflush(stdout);
+    reader_close(&r);
+    free(target);
+    free(anchors);
+    return ret;
+}
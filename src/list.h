@@ -0,0 +1,11 @@
+#ifndef VAAR_LIST_H
+#define VAAR_LIST_H
+
+/*
+ * Print the names of the entries in the archive at path, in the order they were written.
+ * With verbose, their types, modes, owners, sizes, mtimes and link targets are printed too, like ls -l.
+ * Returns 0 if the whole archive has been read.
+ */
+int list_archive(const char *path, int verbose);
+
+#endif //VAAR_LIST_H
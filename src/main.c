@@ -1,52 +1,418 @@
 #include <fcntl.h>
+#include <getopt.h>
 #include <liburing.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/resource.h>
 
 #include "dir_entry.h"
+#include "append.h"
 #include "archive.h"
+#include "dedup.h"
+#include "link_table.h"
+#include "extract.h"
+#include "list.h"
+#include "manifest.h"
+#include "verify.h"
 #include "writer.h"
 
+const size_t OUTPUT_BUF_SIZE = 8 << 20; // 8 MiB
+const int OUTPUT_RING_BUF_CNT = 8;
+const size_t OUTPUT_RING_BUF_SIZE = 2 << 20; // 2 MiB
+const size_t CHUNK_SIZE = 1 << 20; // 1 MiB
+const size_t CHUNK_BUDGET = 64 << 20; // 64 MiB, or half of the memory budget if less
+const size_t DIR_GATHER = 4 << 20; // 4 MiB per walker, or a quarter of the memory budget between them if less
+const size_t COMPRESS_FRAME_SIZE = 2 << 20; // 2 MiB
+
+/*
+ * vaar verify [-j threads] <archive>
+ */
+int verify_main(int argc, char *argv[]) {
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+        usage:
+        fprintf(stderr, "Usage: vaar verify [-j threads] <archive>\n");
+        return 1;
+    }
+    return verify_archive(argv[optind], threads > 0 ? threads : 1);
+}
+
+/*
+ * vaar extract [-j threads] [-C dir] <archive> [path 1] [path 2] ...
+ */
+int extract_main(int argc, char *argv[]) {
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char *dir = ".";
+    int opt;
+    while ((opt = getopt(argc, argv, "j:C:")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'C':
+                dir = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind >= argc) {
+        usage:
+        fprintf(stderr, "Usage: vaar extract [-j threads] [-C dir] <archive> [path 1] [path 2] ...\n");
+        return 1;
+    }
+    return extract_archive(argv[optind], dir, threads > 0 ? threads : 1, argv + optind + 1, argc - optind - 1);
+}
+
+/*
+ * vaar list [-l] <archive>
+ */
+int list_main(int argc, char *argv[]) {
+    int verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l")) != -1) {
+        switch (opt) {
+            case 'l':
+                verbose = 1;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    if (optind != argc - 1) {
+        usage:
+        fprintf(stderr, "Usage: vaar list [-l] <archive>\n");
+        return 1;
+    }
+    return list_archive(argv[optind], verbose);
+}
+
 int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "list") == 0)
+        return list_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "verify") == 0)
+        return verify_main(argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "extract") == 0)
+        return extract_main(argc - 1, argv + 1);
+
     struct rlimit lmt;
     getrlimit(RLIMIT_NOFILE, &lmt);
     lmt.rlim_cur = lmt.rlim_max;
     setrlimit(RLIMIT_NOFILE, &lmt);
 
+    const char *prog = argv[0];
+    struct archive_options opts = {
+            .walkers = 0,
+            .rings = 1,
+            .pin = 0,
+            .inline_max = 64 << 10,
+            .read_window = 0,
+            .dir_gather = 0, /* to fit in the memory budget */
+            .mem_budget = 128 << 20,
+            .links = NULL,
+            .manifest = NULL,
+            .verbose = 0,
+    };
+    int uring_output = 0;
+    int hard_links = 1;
+    int dedup = 0;
+    int checksum = 0;
+    int toc = 0;
+    int sparse = 0;
+    int reflink = 0;
+    int format = 0; /* 1 if not given, or the one of the archive appended to */
+    int append = 0;
+    int compress_level = 0;
+    long chunk_budget = -1; /* MiB, or -1 to fit in the memory budget */
+    const char *incremental = NULL; /* the manifest of the previous run */
+    static const struct option long_opts[] = {
+            {"append", no_argument, NULL, 'a'},
+            {"incremental", required_argument, NULL, 'I'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "af:j:r:puz:c:i:I:P:g:m:AHDCSTv", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'a':
+                append = 1;
+                break;
+            case 'f':
+                format = atoi(optarg);
+                break;
+            case 'j':
+                opts.walkers = atoi(optarg);
+                break;
+            case 'r':
+                opts.rings = atoi(optarg);
+                break;
+            case 'p':
+                opts.pin = 1;
+                break;
+            case 'u':
+                uring_output = 1;
+                break;
+            case 'z':
+                compress_level = atoi(optarg);
+                break;
+            case 'c':
+                chunk_budget = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                opts.inline_max = strtoull(optarg, NULL, 10) << 10;
+                break;
+            case 'I':
+                incremental = optarg;
+                break;
+            case 'P':
+                opts.read_window = atoi(optarg);
+                break;
+            case 'g':
+                opts.dir_gather = strtoull(optarg, NULL, 10) << 10;
+                break;
+            case 'm':
+                opts.mem_budget = strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'A':
+                reflink = 1;
+                break;
+            case 'H':
+                hard_links = 0;
+                break;
+            case 'D':
+                dedup = 1;
+                break;
+            case 'C':
+                checksum = 1;
+                break;
+            case 'S':
+                sparse = 1;
+                break;
+            case 'T':
+                toc = 1;
+                break;
+            case 'v':
+                opts.verbose = 1;
+                break;
+            default:
+                goto usage;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <archive> <path 1> [path 2] ...\n", argv[0]);
+        usage:
+        fprintf(stderr, "Usage: %s [-a] [-f format] [-j walkers] [-r rings] [-p] [-u] [-z level] [-c chunk MiB] [-i inline KiB] [--incremental manifest] [-P read window] [-g dir gather KiB] [-m memory MiB] [-A] [-H] [-D] [-C] [-S] [-T] [-v] <archive, or - for stdout> <path 1> [path 2] ...\n", prog);
+        return 1;
+    }
+
+    if (uring_output && compress_level > 0) {
+        fprintf(stderr, "compressed output is written in order, and can't be written with io_uring\n");
         return 1;
     }
 
-    printf("creating archive at [%s]\n", argv[1]);
-    int fd = open(argv[1], O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (reflink && (compress_level > 0 || checksum || dedup)) {
+        fprintf(stderr, "cloned contents are neither compressed nor read, and can't be used with -z, -C or -D\n");
+        return 1;
+    }
+
+    /*
+     * The memory budget covers the gather buffers of the walkers and the chunks read ahead first. The items and
+     * inline buffers of archive_path get what's left.
+     */
+    int walker_cnt = opts.walkers > 0 ? opts.walkers : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (walker_cnt < 1)
+        walker_cnt = 1;
+    if (opts.dir_gather == 0) {
+        opts.dir_gather = opts.mem_budget / 4 / walker_cnt;
+        if (opts.dir_gather > DIR_GATHER)
+            opts.dir_gather = DIR_GATHER;
+    }
+    if (opts.dir_gather < DIR_BATCH_MIN)
+        opts.dir_gather = DIR_BATCH_MIN;
+    size_t chunk_bytes = chunk_budget < 0 ? opts.mem_budget / 2 : (size_t) chunk_budget << 20;
+    if (chunk_budget < 0 && chunk_bytes > CHUNK_BUDGET)
+        chunk_bytes = CHUNK_BUDGET;
+    /* Two chunks are read at least, unless chunking is off. */
+    if (chunk_bytes > 0 && chunk_bytes < 2 * CHUNK_SIZE)
+        chunk_bytes = 2 * CHUNK_SIZE;
+    uint64_t reserved = (uint64_t) walker_cnt * opts.dir_gather + chunk_bytes;
+    if (reserved >= opts.mem_budget) {
+        fprintf(stderr, "the gather buffers of %d walkers (%zu KiB each) and %zu MiB of chunks use up the memory "
+                        "budget of %lu MiB; raise -m, or lower -j, -g or -c\n", walker_cnt, opts.dir_gather >> 10,
+                chunk_bytes >> 20, opts.mem_budget >> 20);
+        return 1;
+    }
+    opts.mem_budget -= reserved;
+
+    /* Only what's changed since the previous run is written, and the manifest is replaced once it's done. */
+    struct manifest manifest;
+    if (incremental) {
+        if (manifest_init(&manifest) || manifest_load(&manifest, incremental)) {
+            return 1;
+        }
+        opts.manifest = &manifest;
+    }
+
+    /* With the archive on stdout, progress goes to stderr. */
+    int stream = strcmp(argv[1], "-") == 0;
+    FILE *info = stream ? stderr : stdout;
+    if (stream && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "refusing to write an archive to a terminal\n");
+        return 1;
+    }
+
+    /* New entries go after the last one in the archive, and its table of contents is kept. */
+    struct appender app;
+    if (append) {
+        if (stream || compress_level > 0) {
+            fprintf(stderr, "only uncompressed archive files can be appended to\n");
+            return 1;
+        }
+        int ret = appender_open(&app, argv[1]);
+        if (ret == 0 && format && format != app.r.format) {
+            fprintf(stderr, "the archive is in format %d\n", app.r.format);
+            ret = 1;
+        }
+        if (ret) {
+            appender_close(&app);
+            return 1;
+        }
+        format = app.r.format;
+        toc |= app.r.toc != NULL;
+    }
+
+    fprintf(info, "%s archive at [%s]\n", append ? "appending to" : "creating", stream ? "stdout" : argv[1]);
+    int fd = stream ? STDOUT_FILENO
+                    : append ? open(argv[1], O_WRONLY) : open(argv[1], O_CREAT | O_WRONLY | O_TRUNC, 0644);
     if (fd < 0) {
         perror("open");
         exit(1);
     }
+    if (append && lseek(fd, (off_t) app.end, SEEK_SET) < 0) {
+        perror("lseek");
+        exit(1);
+    }
 
     struct writer w;
     if (writer_init(&w, fd)) {
         exit(1);
     }
-    if (writer_magic(&w)) {
+    if (writer_set_format(&w, format ? format : 1)) {
+        exit(1);
+    }
+    if (compress_level > 0) {
+        if (writer_set_compression(&w, COMPRESS_FRAME_SIZE, (int) sysconf(_SC_NPROCESSORS_ONLN), compress_level)) {
+            exit(1);
+        }
+    } else if (uring_output) {
+        if (writer_set_uring(&w, OUTPUT_RING_BUF_CNT, OUTPUT_RING_BUF_SIZE)) {
+            exit(1);
+        }
+    } else if (writer_set_buffer(&w, OUTPUT_BUF_SIZE)) {
+        exit(1);
+    }
+    if (writer_set_chunking(&w, CHUNK_SIZE, chunk_bytes)) {
+        exit(1);
+    }
+    writer_set_checksum(&w, checksum);
+    if (writer_set_reflink(&w, reflink)) {
+        exit(1);
+    }
+    writer_set_sparse(&w, sparse);
+    writer_set_toc(&w, toc);
+    if (append) {
+        if (appender_restore(&app, &w)) {
+            exit(1);
+        }
+        appender_close(&app);
+    } else if (writer_magic(&w)) {
         exit(1);
     }
 
+    /* Hard links are found across all the paths. */
+    struct link_table links;
+    if (hard_links) {
+        if (link_table_init(&links)) {
+            exit(1);
+        }
+        /* Anchors already in the archive aren't given again. */
+        if (append) {
+            links.anchors = app.max_anchor;
+        }
+        opts.links = &links;
+    }
+    /* So are identical contents. */
+    struct dedup_table dedup_table;
+    if (dedup) {
+        if (dedup_table_init(&dedup_table)) {
+            exit(1);
+        }
+        writer_set_dedup(&w, &dedup_table);
+    }
+
     for (int i = 2; i < argc; i++) {
-        printf("adding [%s]...\n", argv[i]);
-        if (archive_path(&w, argv[i])) {
+        fprintf(info, "adding [%s]...\n", argv[i]);
+        if (archive_path(&w, argv[i], &opts)) {
             exit(1);
         }
     }
 
+    if (incremental) {
+        const char **deleted;
+        size_t deleted_cnt;
+        if (manifest_deleted(&manifest, &deleted, &deleted_cnt)) {
+            exit(1);
+        }
+        for (size_t i = 0; i < deleted_cnt; i++) {
+            if (writer_prepare_deleted(&w, deleted[i]) || writer_execute_buffer(&w, NULL, 0)) {
+                exit(1);
+            }
+        }
+        free(deleted);
+        fprintf(info, "%lu unchanged, %zu deleted\n", manifest.unchanged, deleted_cnt);
+    }
+
+    if (writer_toc(&w)) {
+        exit(1);
+    }
+    if (writer_flush(&w)) {
+        exit(1);
+    }
     writer_free(&w);
+    if (hard_links) {
+        link_table_free(&links);
+    }
+    if (dedup) {
+        if (opts.verbose) {
+            fprintf(stderr, "dedup: %lu files hashed ahead, %lu duplicates (%.1f MiB)\n", dedup_table.hashed,
+                    dedup_table.dup_cnt, (double) dedup_table.dup_bytes / (1 << 20));
+        }
+        dedup_table_free(&dedup_table);
+    }
 
-    printf("done, closing archive\n");
+    fprintf(info, "done, closing archive\n");
     if (close(fd)) {
         perror("close");
         exit(1);
     }
+    if (incremental) {
+        if (manifest_save(&manifest, incremental)) {
+            exit(1);
+        }
+        manifest_free(&manifest);
+    }
     return 0;
 }
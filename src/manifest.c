@@ -0,0 +1,292 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "manifest.h"
+
+const uint32_t MANIFEST_STRIPE_INIT_CAP = 1024;
+const size_t MANIFEST_SAVE_BUF_SIZE = 1 << 20;
+
+static inline uint64_t name_hash(const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 0x100000001b3ULL;
+    return h ^ (h >> 29);
+}
+
+int manifest_init(struct manifest *m) {
+    memset(m, 0, sizeof(struct manifest));
+    for (int i = 0; i < MANIFEST_STRIPES; i++)
+        if (pthread_mutex_init(&m->stripes[i].lock, NULL)) {
+            perror("pthread_mutex_init");
+            return 1;
+        }
+    return 0;
+}
+
+/*
+ * Get the slot of the name in the stripe, or the empty slot where it should go.
+ */
+struct manifest_entry *manifest_slot(struct manifest_stripe *st, uint64_t hash, const char *name, size_t len) {
+    /* The low bits picked the stripe. Use the high bits here. */
+    uint32_t i = (uint32_t) (hash >> 32) & (st->cap - 1);
+    while (st->entries[i].used && (st->entries[i].hash != hash || st->entries[i].name_len != len ||
+                                   memcmp(st->names + st->entries[i].name_off, name, len) != 0))
+        i = (i + 1) & (st->cap - 1);
+    return st->entries + i;
+}
+
+/*
+ * Double the capacity of a stripe, or allocate it in the first place.
+ */
+int manifest_stripe_grow(struct manifest_stripe *st) {
+    uint32_t cap = st->cap ? st->cap * 2 : MANIFEST_STRIPE_INIT_CAP;
+    struct manifest_entry *entries = calloc(cap, sizeof(struct manifest_entry));
+    if (entries == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    struct manifest_entry *old = st->entries;
+    uint32_t old_cap = st->cap;
+    st->entries = entries;
+    st->cap = cap;
+    for (uint32_t i = 0; i < old_cap; i++)
+        if (old[i].used)
+            *manifest_slot(st, old[i].hash, st->names + old[i].name_off, old[i].name_len) = old[i];
+    free(old);
+    return 0;
+}
+
+/*
+ * Get the entry of a name in a locked stripe, adding an empty one if it's not there.
+ * Returns NULL on errors.
+ */
+struct manifest_entry *manifest_get(struct manifest_stripe *st, uint64_t hash, const char *name, size_t len) {
+    if (st->cnt) {
+        struct manifest_entry *e = manifest_slot(st, hash, name, len);
+        if (e->used)
+            return e;
+    }
+    /* Keep the load under a half. */
+    if ((st->cnt + 1) * 2 > st->cap && manifest_stripe_grow(st))
+        return NULL;
+    if (st->names_len + len + 1 > st->names_cap) {
+        size_t cap = st->names_cap ? st->names_cap * 2 : 64 << 10;
+        while (st->names_len + len + 1 > cap)
+            cap *= 2;
+        char *names = realloc(st->names, cap);
+        if (names == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        st->names = names;
+        st->names_cap = cap;
+    }
+    memcpy(st->names + st->names_len, name, len);
+    st->names[st->names_len + len] = '\0';
+
+    struct manifest_entry *e = manifest_slot(st, hash, name, len);
+    memset(e, 0, sizeof(struct manifest_entry));
+    e->hash = hash;
+    e->name_off = st->names_len;
+    e->name_len = (uint16_t) len;
+    e->used = 1;
+    st->names_len += len + 1;
+    st->cnt++;
+    return e;
+}
+
+int manifest_load(struct manifest *m, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    size_t len = st.st_size;
+    if (len < VAAR_MANIFEST_MAGIC_LEN) {
+        fprintf(stderr, "not a manifest: %s\n", path);
+        close(fd);
+        return 1;
+    }
+    const char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    madvise((void *) data, len, MADV_SEQUENTIAL);
+
+    int ret = 0;
+    if (memcmp(data, VAAR_MANIFEST_MAGIC, VAAR_MANIFEST_MAGIC_LEN) != 0) {
+        fprintf(stderr, "not a manifest: %s\n", path);
+        ret = 1;
+        goto exit;
+    }
+    size_t off = VAAR_MANIFEST_MAGIC_LEN;
+    while (off < len) {
+        struct manifest_record rec;
+        if (len - off < sizeof(rec)) {
+            fprintf(stderr, "truncated manifest: %s\n", path);
+            ret = 1;
+            goto exit;
+        }
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+        size_t name_len = le16toh(rec.name_len);
+        if (len - off < name_len) {
+            fprintf(stderr, "truncated manifest: %s\n", path);
+            ret = 1;
+            goto exit;
+        }
+        const char *name = data + off;
+        off += name_len;
+
+        uint64_t hash = name_hash(name, name_len);
+        struct manifest_stripe *s = m->stripes + hash % MANIFEST_STRIPES;
+        struct manifest_entry *e = manifest_get(s, hash, name, name_len);
+        if (e == NULL) {
+            ret = 1;
+            goto exit;
+        }
+        e->size = le64toh(rec.size);
+        e->ino = le64toh(rec.ino);
+        e->mtime.sec = (int64_t) le64toh(rec.mtime.sec);
+        e->mtime.nsec = (int64_t) le64toh(rec.mtime.nsec);
+        e->ctime.sec = (int64_t) le64toh(rec.ctime.sec);
+        e->ctime.nsec = (int64_t) le64toh(rec.ctime.nsec);
+        e->mode = le32toh(rec.mode);
+    }
+
+    exit:
+    munmap((void *) data, len);
+    return ret;
+}
+
+int manifest_check(struct manifest *m, const char *name, size_t len, const struct statx *s) {
+    if (len > VAAR_LONG_NAME_MAX)
+        /* It can't be archived anyway. */
+        return 0;
+    uint64_t hash = name_hash(name, len);
+    struct manifest_stripe *st = m->stripes + hash % MANIFEST_STRIPES;
+    pthread_mutex_lock(&st->lock);
+    struct manifest_entry *e = manifest_get(st, hash, name, len);
+    if (e == NULL) {
+        pthread_mutex_unlock(&st->lock);
+        return -1;
+    }
+    /* A name seen twice in a run is archived twice, and only the first one may be skipped. */
+    int same = !e->seen && e->size == s->stx_size && e->ino == s->stx_ino && e->mode == s->stx_mode &&
+               e->mtime.sec == s->stx_mtime.tv_sec && e->mtime.nsec == s->stx_mtime.tv_nsec &&
+               e->ctime.sec == s->stx_ctime.tv_sec && e->ctime.nsec == s->stx_ctime.tv_nsec;
+    e->size = s->stx_size;
+    e->ino = s->stx_ino;
+    e->mode = s->stx_mode;
+    e->mtime.sec = s->stx_mtime.tv_sec;
+    e->mtime.nsec = s->stx_mtime.tv_nsec;
+    e->ctime.sec = s->stx_ctime.tv_sec;
+    e->ctime.nsec = s->stx_ctime.tv_nsec;
+    e->seen = 1;
+    pthread_mutex_unlock(&st->lock);
+    if (same)
+        __atomic_add_fetch(&m->unchanged, 1, __ATOMIC_RELAXED);
+    return same;
+}
+
+int name_compare_reverse(const void *a, const void *b) {
+    return strcmp(*(const char *const *) b, *(const char *const *) a);
+}
+
+int manifest_deleted(struct manifest *m, const char ***names, size_t *cnt) {
+    size_t total = 0;
+    for (int i = 0; i < MANIFEST_STRIPES; i++)
+        total += m->stripes[i].cnt;
+    *names = malloc((total ? total : 1) * sizeof(const char *));
+    if (*names == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    *cnt = 0;
+    for (int i = 0; i < MANIFEST_STRIPES; i++) {
+        struct manifest_stripe *st = m->stripes + i;
+        for (uint32_t j = 0; j < st->cap; j++)
+            if (st->entries[j].used && !st->entries[j].seen)
+                (*names)[(*cnt)++] = st->names + st->entries[j].name_off;
+    }
+    qsort(*names, *cnt, sizeof(const char *), name_compare_reverse);
+    return 0;
+}
+
+int manifest_save(struct manifest *m, const char *path) {
+    size_t path_len = strlen(path);
+    char *tmp = malloc(path_len + 5);
+    if (tmp == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+
+    int ret = 0;
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        perror("fopen");
+        ret = 1;
+        goto exit;
+    }
+    setvbuf(f, NULL, _IOFBF, MANIFEST_SAVE_BUF_SIZE);
+    fwrite(VAAR_MANIFEST_MAGIC, 1, VAAR_MANIFEST_MAGIC_LEN, f);
+    for (int i = 0; i < MANIFEST_STRIPES; i++) {
+        struct manifest_stripe *st = m->stripes + i;
+        for (uint32_t j = 0; j < st->cap; j++) {
+            struct manifest_entry *e = st->entries + j;
+            if (!e->used || !e->seen)
+                continue;
+            struct manifest_record rec = {
+                    .size = htole64(e->size),
+                    .ino = htole64(e->ino),
+                    .mtime = {.sec = (int64_t) htole64(e->mtime.sec), .nsec = (int64_t) htole64(e->mtime.nsec)},
+                    .ctime = {.sec = (int64_t) htole64(e->ctime.sec), .nsec = (int64_t) htole64(e->ctime.nsec)},
+                    .mode = htole32(e->mode),
+                    .name_len = htole16(e->name_len),
+                    ._reserved = 0,
+            };
+            fwrite(&rec, sizeof(rec), 1, f);
+            fwrite(st->names + e->name_off, 1, e->name_len, f);
+        }
+    }
+    if (ferror(f) | fclose(f)) {
+        perror("write");
+        unlink(tmp);
+        ret = 1;
+        goto exit;
+    }
+    if (rename(tmp, path)) {
+        perror("rename");
+        unlink(tmp);
+        ret = 1;
+    }
+
+    exit:
+    free(tmp);
+    return ret;
+}
+
+void manifest_free(struct manifest *m) {
+    for (int i = 0; i < MANIFEST_STRIPES; i++) {
+        free(m->stripes[i].entries);
+        free(m->stripes[i].names);
+        pthread_mutex_destroy(&m->stripes[i].lock);
+    }
+}
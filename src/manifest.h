@@ -0,0 +1,92 @@
+#ifndef VAAR_MANIFEST_H
+#define VAAR_MANIFEST_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "format.h"
+
+#define MANIFEST_STRIPES 64
+
+#define VAAR_MANIFEST_MAGIC "\xf0\x9f\x93\x9c\xf0\x9f\x93\xa6"
+#define VAAR_MANIFEST_MAGIC_LEN 8
+
+/*
+ * What a file looked like when it was archived, as stored in a manifest file after the magic, one after another.
+ * The numbers are in little endian, and the name follows without a terminator.
+ */
+struct manifest_record {
+    uint64_t size;
+    uint64_t ino;
+    struct file_ts mtime;
+    struct file_ts ctime;
+    uint32_t mode;
+    uint16_t name_len;
+    uint16_t _reserved;
+} __attribute__((packed));
+
+/*
+ * A file in the manifest, by its archived name.
+ */
+struct manifest_entry {
+    uint64_t hash;
+    uint64_t name_off; /* in the names of the stripe, terminated */
+    uint64_t size, ino;
+    struct file_ts mtime, ctime;
+    uint32_t mode;
+    uint16_t name_len;
+    uint8_t used; /* 0 if the entry is empty */
+    uint8_t seen; /* found in this run */
+};
+
+/*
+ * A part of a manifest with its own lock, as an open addressing hash table.
+ */
+struct manifest_stripe {
+    pthread_mutex_t lock;
+    struct manifest_entry *entries;
+    uint32_t cap, cnt;
+    char *names;
+    size_t names_len, names_cap;
+};
+
+/*
+ * Thread-safe map from archived names to what the files looked like, striped by hash.
+ * It's loaded from the previous run, and each file found in this run is checked against it and recorded.
+ * What's left unseen at the end has been deleted since.
+ */
+struct manifest {
+    struct manifest_stripe stripes[MANIFEST_STRIPES];
+    uint64_t unchanged; /* files found the same as in the previous run */
+};
+
+int manifest_init(struct manifest *m);
+
+/*
+ * Load the manifest written by the previous run at path. A missing file is an empty manifest.
+ */
+int manifest_load(struct manifest *m, const char *path);
+
+/*
+ * Check the file with an archived name against the previous run, and record it as it is now.
+ * Returns 1 if its size, mtime, ctime, inode and mode are all the same, 0 if it's new or changed,
+ * or -1 on errors.
+ */
+int manifest_check(struct manifest *m, const char *name, size_t len, const struct statx *s);
+
+/*
+ * Get the names of the files in the previous run not found in this one, in reverse order, so that what's in
+ * a directory comes before it. The array is to be freed, and the names stay valid until the manifest is freed.
+ */
+int manifest_deleted(struct manifest *m, const char ***names, size_t *cnt);
+
+/*
+ * Write the files found in this run to path, replacing it at once.
+ */
+int manifest_save(struct manifest *m, const char *path);
+
+void manifest_free(struct manifest *m);
+
+#endif //VAAR_MANIFEST_H
@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "out_ring.h"
+
+/*
+ * Wait for one write to complete, and finish it synchronously if it came out short.
+ */
+int out_ring_reap(struct out_ring *r) {
+    struct io_uring_cqe *cqe;
+    int ret = io_uring_wait_cqe(&r->ring, &cqe);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-ret));
+        return 1;
+    }
+    struct out_slot *slot = io_uring_cqe_get_data(cqe);
+    int res = cqe->res;
+    io_uring_cqe_seen(&r->ring, cqe);
+    slot->busy = 0;
+    if (res < 0) {
+        fprintf(stderr, "async write failed: %s\n", strerror(-res));
+        return 1;
+    }
+    size_t done = res;
+    while (done < slot->len) {
+        ssize_t n = pwrite(r->fd, slot->buf + done, slot->len - done, (off_t) (slot->off + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pwrite");
+            return 1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int out_ring_init(struct out_ring *r, int fd, int slot_cnt, size_t slot_size) {
+    memset(r, 0, sizeof(struct out_ring));
+    r->fd = fd;
+    r->slot_cnt = slot_cnt;
+    r->slot_size = slot_size;
+    r->mem = aligned_alloc(4096, slot_cnt * slot_size);
+    r->slots = calloc(slot_cnt, sizeof(struct out_slot));
+    if (r->mem == NULL || r->slots == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int ret = io_uring_queue_init(slot_cnt, &r->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_queue_init: %s\n", strerror(-ret));
+        return 1;
+    }
+    if ((ret = io_uring_register_files(&r->ring, &fd, 1)) < 0) {
+        fprintf(stderr, "io_uring_register_files: %s\n", strerror(-ret));
+        io_uring_queue_exit(&r->ring);
+        return 1;
+    }
+
+    struct iovec *iov = malloc(sizeof(struct iovec) * slot_cnt);
+    if (iov == NULL) {
+        perror("malloc");
+        io_uring_queue_exit(&r->ring);
+        return 1;
+    }
+    for (int i = 0; i < slot_cnt; i++) {
+        r->slots[i].buf = r->mem + i * slot_size;
+        iov[i].iov_base = r->slots[i].buf;
+        iov[i].iov_len = slot_size;
+    }
+    /* Registering may fail over RLIMIT_MEMLOCK. Plain writes still work then. */
+    r->fixed_bufs = io_uring_register_buffers(&r->ring, iov, slot_cnt) == 0;
+    free(iov);
+    return 0;
+}
+
+char *out_ring_buffer(struct out_ring *r) {
+    struct out_slot *slot = r->slots + r->cur;
+    while (slot->busy)
+        if (out_ring_reap(r))
+            return NULL;
+    return slot->buf;
+}
+
+int out_ring_submit(struct out_ring *r, size_t len, uint64_t off) {
+    struct out_slot *slot = r->slots + r->cur;
+    slot->len = len;
+    slot->off = off;
+    slot->busy = 1;
+
+    /* At most slot_cnt writes are in flight, so there is always room. */
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+    if (r->fixed_bufs)
+        io_uring_prep_write_fixed(sqe, 0, slot->buf, len, off, r->cur);
+    else
+        io_uring_prep_write(sqe, 0, slot->buf, len, off);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data(sqe, slot);
+    int ret = io_uring_submit(&r->ring);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_submit: %s\n", strerror(-ret));
+        return 1;
+    }
+    r->cur = (r->cur + 1) % r->slot_cnt;
+    return 0;
+}
+
+int out_ring_drain(struct out_ring *r) {
+    for (int i = 0; i < r->slot_cnt; i++)
+        while (r->slots[i].busy)
+            if (out_ring_reap(r))
+                return 1;
+    return 0;
+}
+
+void out_ring_free(struct out_ring *r) {
+    io_uring_queue_exit(&r->ring);
+    free(r->slots);
+    free(r->mem);
+}
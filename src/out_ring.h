@@ -0,0 +1,59 @@
+#ifndef VAAR_OUT_RING_H
+#define VAAR_OUT_RING_H
+
+#include <liburing.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An output buffer and the write it's in, if any.
+ */
+struct out_slot {
+    char *buf;
+    size_t len;
+    uint64_t off;
+    int busy;
+};
+
+/*
+ * Asynchronous output through io_uring.
+ * The output fd is registered as a fixed file, and a ring of buffers is registered so writes go without page pinning.
+ * Every write has an explicit offset, so several of them can be in flight in any order.
+ */
+struct out_ring {
+    struct io_uring ring;
+    int fd;
+    int fixed_bufs; /* whether the buffers were registered */
+    char *mem;
+    struct out_slot *slots;
+    int slot_cnt, cur;
+    size_t slot_size;
+};
+
+/*
+ * Initialize an output ring writing to a seekable fd, with slot_cnt buffers of slot_size bytes.
+ */
+int out_ring_init(struct out_ring *r, int fd, int slot_cnt, size_t slot_size);
+
+/*
+ * Get the current buffer to fill, waiting for its previous write to complete.
+ * Returns NULL on errors.
+ */
+char *out_ring_buffer(struct out_ring *r);
+
+/*
+ * Submit len bytes in the current buffer to be written at off, and move to the next buffer.
+ */
+int out_ring_submit(struct out_ring *r, size_t len, uint64_t off);
+
+/*
+ * Wait for all the submitted writes to complete.
+ */
+int out_ring_drain(struct out_ring *r);
+
+/*
+ * Destroy an output ring. It should be drained first.
+ */
+void out_ring_free(struct out_ring *r);
+
+#endif //VAAR_OUT_RING_H
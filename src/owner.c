@@ -0,0 +1,117 @@
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "owner.h"
+
+const uint32_t OWNER_MAP_INIT_CAP = 16;
+
+void owner_map_init(struct owner_map *m) {
+    m->entries = NULL;
+    m->cap = m->cnt = 0;
+}
+
+struct owner_entry *owner_slot(struct owner_entry *entries, uint32_t cap, uint32_t id) {
+    uint32_t i = (id * 0x9e3779b1u) & (cap - 1);
+    while (entries[i].used && entries[i].id != id)
+        i = (i + 1) & (cap - 1);
+    return entries + i;
+}
+
+int owner_map_get(struct owner_map *m, uint32_t id, struct owner_entry **entry) {
+    if (m->cnt) {
+        struct owner_entry *e = owner_slot(m->entries, m->cap, id);
+        if (e->used) {
+            *entry = e;
+            return 1;
+        }
+    }
+    if ((m->cnt + 1) * 2 > m->cap) {
+        uint32_t cap = m->cap ? m->cap * 2 : OWNER_MAP_INIT_CAP;
+        struct owner_entry *entries = calloc(cap, sizeof(struct owner_entry));
+        if (entries == NULL) {
+            perror("calloc");
+            return -1;
+        }
+        for (uint32_t i = 0; i < m->cap; i++)
+            if (m->entries[i].used)
+                *owner_slot(entries, cap, m->entries[i].id) = m->entries[i];
+        free(m->entries);
+        m->entries = entries;
+        m->cap = cap;
+    }
+    struct owner_entry *e = owner_slot(m->entries, m->cap, id);
+    e->used = 1;
+    e->id = id;
+    memset(e->name, 0, sizeof(e->name));
+    m->cnt++;
+    *entry = e;
+    return 0;
+}
+
+void owner_map_free(struct owner_map *m) {
+    free(m->entries);
+}
+
+const char *owner_user_name(struct owner_map *users, uint32_t uid) {
+    struct owner_entry *e;
+    int ret = owner_map_get(users, uid, &e);
+    if (ret < 0)
+        return "";
+    if (ret == 0) {
+        char buf[16 << 10]; /* plenty for one entry */
+        struct passwd pw, *result;
+        if (getpwuid_r(uid, &pw, buf, sizeof(buf), &result) == 0 && result)
+            strncpy(e->name, pw.pw_name, sizeof(e->name) - 1);
+    }
+    return e->name;
+}
+
+const char *owner_group_name(struct owner_map *groups, uint32_t gid) {
+    struct owner_entry *e;
+    int ret = owner_map_get(groups, gid, &e);
+    if (ret < 0)
+        return "";
+    if (ret == 0) {
+        char buf[16 << 10]; /* plenty for one entry */
+        struct group gr, *result;
+        if (getgrgid_r(gid, &gr, buf, sizeof(buf), &result) == 0 && result)
+            strncpy(e->name, gr.gr_name, sizeof(e->name) - 1);
+    }
+    return e->name;
+}
+
+uint32_t owner_user_id(struct owner_map *users, uint32_t uid, const char *name) {
+    struct owner_entry *e;
+    int ret = owner_map_get(users, uid, &e);
+    if (ret < 0)
+        return uid;
+    if (ret == 0) {
+        char buf[16 << 10]; /* plenty for one entry */
+        struct passwd pw, *result;
+        /* The name in a header may have no terminator. */
+        strncpy(e->name, name, sizeof(e->name) - 1);
+        e->local = uid;
+        if (e->name[0] && getpwnam_r(e->name, &pw, buf, sizeof(buf), &result) == 0 && result)
+            e->local = pw.pw_uid;
+    }
+    return e->local;
+}
+
+uint32_t owner_group_id(struct owner_map *groups, uint32_t gid, const char *name) {
+    struct owner_entry *e;
+    int ret = owner_map_get(groups, gid, &e);
+    if (ret < 0)
+        return gid;
+    if (ret == 0) {
+        char buf[16 << 10]; /* plenty for one entry */
+        struct group gr, *result;
+        strncpy(e->name, name, sizeof(e->name) - 1);
+        e->local = gid;
+        if (e->name[0] && getgrnam_r(e->name, &gr, buf, sizeof(buf), &result) == 0 && result)
+            e->local = gr.gr_gid;
+    }
+    return e->local;
+}
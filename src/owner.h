@@ -0,0 +1,58 @@
+#ifndef VAAR_OWNER_H
+#define VAAR_OWNER_H
+
+#include <stdint.h>
+
+/*
+ * A user or group id, and its name if known.
+ */
+struct owner_entry {
+    uint32_t id;
+    int used;
+    char name[33]; /* as long as uname and gname in headers, plus the terminator */
+    uint32_t local; /* when extracting, the id on this system */
+};
+
+/*
+ * A map of user or group ids, as an open addressing hash table. Not thread-safe.
+ */
+struct owner_map {
+    struct owner_entry *entries;
+    uint32_t cap, cnt;
+};
+
+void owner_map_init(struct owner_map *m);
+
+/*
+ * Find the entry of id, adding an empty one if it's not there.
+ * Returns 1 if found, 0 if added, or -1 on errors.
+ */
+int owner_map_get(struct owner_map *m, uint32_t id, struct owner_entry **entry);
+
+void owner_map_free(struct owner_map *m);
+
+/*
+ * Get the name of a user, looked up only the first time for each uid.
+ * Returns an empty name if the user doesn't exist.
+ */
+const char *owner_user_name(struct owner_map *users, uint32_t uid);
+
+/*
+ * Get the name of a group, looked up only the first time for each gid.
+ * Returns an empty name if the group doesn't exist.
+ */
+const char *owner_group_name(struct owner_map *groups, uint32_t gid);
+
+/*
+ * Get the local uid of a user in an archive, by its name if there is a user with it, or uid otherwise.
+ * Looked up only the first time for each uid.
+ */
+uint32_t owner_user_id(struct owner_map *users, uint32_t uid, const char *name);
+
+/*
+ * Get the local gid of a group in an archive, by its name if there is a group with it, or gid otherwise.
+ * Looked up only the first time for each gid.
+ */
+uint32_t owner_group_id(struct owner_map *groups, uint32_t gid, const char *name);
+
+#endif //VAAR_OWNER_H
@@ -1,32 +1,119 @@
 #ifndef VAAR_PATH_H
 #define VAAR_PATH_H
 
-static inline int clean_path(const char *path, char *new_path) {
-    int read_cur = 0, write_cur = 0;
-    while (path[read_cur] == '/')
-        read_cur++;
-    if (path[read_cur] == '\0')
-        goto exit;
-    while (path[read_cur] != '\0')
-        new_path[write_cur++] = path[read_cur++];
-
-    if (strstr(new_path, "/../") != NULL || !strcmp(new_path, "..") || !strncmp(new_path, "../", 3))
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Skip the leading slashes of a path to be stored in an archive.
+ * Returns the offset of the rest, or -1 if the path goes up with "..".
+ */
+static inline int clean_path(const char *path) {
+    int off = 0;
+    while (path[off] == '/')
+        off++;
+    const char *rest = path + off;
+    size_t len = strlen(rest);
+    if (strstr(rest, "/../") != NULL || !strcmp(rest, "..") || !strncmp(rest, "../", 3))
         return -1;
-    if (write_cur >= 3 && !strncmp(new_path + write_cur - 3, "/..", 3))
+    if (len >= 3 && !strcmp(rest + len - 3, "/.."))
         return -1;
+    return off;
+}
+
+/*
+ * A growable path, extended and cut back by components like a stack.
+ */
+struct path_buf {
+    char *buf;
+    int len, cap;
+};
+
+static inline void path_init(struct path_buf *p) {
+    p->buf = NULL;
+    p->len = p->cap = 0;
+}
+
+/*
+ * Append a component (or several joined with slashes) to the path, with a slash in between if needed.
+ * Returns the length before, to be popped back to, or -1 on errors.
+ */
+static inline int path_push(struct path_buf *p, const char *name, int name_len) {
+    int old_len = p->len;
+    int sep = p->len > 0 && p->buf[p->len - 1] != '/';
+    if (p->len + sep + name_len + 1 > p->cap) {
+        int cap = p->cap ? p->cap : 256;
+        while (p->len + sep + name_len + 1 > cap)
+            cap *= 2;
+        char *buf = realloc(p->buf, cap);
+        if (buf == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        p->buf = buf;
+        p->cap = cap;
+    }
+    if (sep)
+        p->buf[p->len++] = '/';
+    memcpy(p->buf + p->len, name, name_len);
+    p->len += name_len;
+    p->buf[p->len] = '\0';
+    return old_len;
+}
+
+/*
+ * Cut the path back to len, as returned by path_push.
+ */
+static inline void path_pop(struct path_buf *p, int len) {
+    p->len = len;
+    if (p->buf)
+        p->buf[len] = '\0';
+}
 
-    exit:
-    new_path[write_cur] = '\0';
-    return write_cur;
+static inline void path_free(struct path_buf *p) {
+    free(p->buf);
 }
 
-static inline int join_path(const char *path, char *filename, char *buf) {
-    strcpy(buf, path);
-    int n = (int) strlen(buf);
-    if (n)
-        buf[n] = '/';
-    strcpy(buf + n + 1, filename);
-    return (int) strlen(buf);
+/*
+ * Open a relative path under dir_fd one name at a time, so that it may be longer than PATH_MAX, and no name is
+ * followed if it's a symlink, whichever one was swapped for it. Names before the last are opened as directories.
+ * Returns the fd, or -1 with errno set.
+ */
+static inline int path_openat(int dir_fd, const char *rel, int flags) {
+    while (*rel == '/')
+        rel++;
+    if (*rel == '\0')
+        return openat(dir_fd, ".", flags);
+    int fd = dir_fd;
+    while (1) {
+        const char *end = strchrnul(rel, '/'), *next = end;
+        while (*next == '/')
+            next++;
+        int last = *next == '\0';
+        char name[NAME_MAX + 1];
+        int next_fd = -1;
+        if (end - rel > NAME_MAX) {
+            errno = ENAMETOOLONG;
+        } else {
+            memcpy(name, rel, end - rel);
+            name[end - rel] = '\0';
+            next_fd = openat(fd, name, (last ? flags : O_RDONLY | O_DIRECTORY) | O_NOFOLLOW);
+        }
+        if (fd != dir_fd) {
+            int err = errno;
+            close(fd);
+            errno = err;
+        }
+        if (next_fd < 0 || last)
+            return next_fd;
+        fd = next_fd;
+        rel = next;
+    }
 }
 
 #endif //VAAR_PATH_H
@@ -0,0 +1,448 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "reader.h"
+
+/*
+ * A frame of a compressed archive, as found in it.
+ */
+struct frame_ref {
+    const char *comp;
+    uint32_t comp_len, raw_len;
+    uint64_t raw_off;
+    uint8_t codec;
+};
+
+/*
+ * Frames shared by the threads decompressing them, each taking the next one left.
+ */
+struct inflate_job {
+    const struct frame_ref *frames;
+    size_t cnt;
+    size_t next;
+    char *raw;
+    int failed;
+};
+
+void *inflate_worker(struct inflate_job *j) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) < j->cnt) {
+        const struct frame_ref *f = j->frames + i;
+        if (f->codec == VAAR_FRAME_STORED) {
+            memcpy(j->raw + f->raw_off, f->comp, f->raw_len);
+            continue;
+        }
+        uLongf len = f->raw_len;
+        if (uncompress((Bytef *) j->raw + f->raw_off, &len, (const Bytef *) f->comp, f->comp_len) != Z_OK ||
+            len != f->raw_len)
+            __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * Get the bytes of memory that can be taken without swapping, as the kernel estimates them, or the free memory
+ * if there is no estimate.
+ */
+uint64_t available_memory() {
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (f) {
+        char line[128];
+        unsigned long kib;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "MemAvailable: %lu kB", &kib) == 1) {
+                fclose(f);
+                return (uint64_t) kib << 10;
+            }
+        }
+        fclose(f);
+    }
+    return (uint64_t) sysconf(_SC_AVPHYS_PAGES) * (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Decompress the compressed archive mapped in the reader into anonymous memory, which is read instead.
+ * The frames are indexed first, and the archive is refused before anything is decompressed if its plain size
+ * doesn't fit in the memory available. The frames are independent, so they're decompressed in parallel, each
+ * right where its raw offset says.
+ */
+int inflate_archive(struct reader *r, const char *path) {
+    struct frame_ref *frames = NULL;
+    size_t cnt = 0, cap = 0;
+    uint64_t off = VAAR_FRAMED_MAGIC_LEN, raw_len = 0;
+    while (off < r->map_len) {
+        struct frame_header hdr;
+        if (r->map_len - off < sizeof(hdr))
+            goto broken;
+        memcpy(&hdr, r->data + off, sizeof(hdr));
+        off += sizeof(hdr);
+        struct frame_ref f = {
+                .comp = r->data + off,
+                .comp_len = le32toh(hdr.comp_len),
+                .raw_len = le32toh(hdr.raw_len),
+                .raw_off = le64toh(hdr.raw_off),
+                .codec = hdr.codec,
+        };
+        /* Frames are written in order, one right after another in the plain archive. */
+        if (f.comp_len > r->map_len - off || f.raw_off != raw_len || f.codec > VAAR_FRAME_ZLIB ||
+            (f.codec == VAAR_FRAME_STORED && f.comp_len != f.raw_len))
+            goto broken;
+        if (cnt == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct frame_ref *new_frames = realloc(frames, cap * sizeof(struct frame_ref));
+            if (new_frames == NULL) {
+                perror("realloc");
+                free(frames);
+                return 1;
+            }
+            frames = new_frames;
+        }
+        frames[cnt++] = f;
+        off += f.comp_len;
+        raw_len += f.raw_len;
+    }
+    if (raw_len < VAAR_ARCHIVE_MAGIC_LEN)
+        goto broken;
+    /* All of it is written, so it would only be found not to fit once the kernel runs out of memory. */
+    uint64_t avail = available_memory();
+    if (raw_len > avail) {
+        fprintf(stderr, "compressed archive %s takes %lu MiB decompressed, more than the %lu MiB of memory available\n",
+                path, raw_len >> 20, avail >> 20);
+        free(frames);
+        return 1;
+    }
+
+    char *raw = mmap(NULL, raw_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap");
+        free(frames);
+        return 1;
+    }
+    struct inflate_job job = {.frames = frames, .cnt = cnt, .next = 0, .raw = raw, .failed = 0};
+    long cpu_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_cnt = cpu_cnt < 1 ? 1 : cpu_cnt > (long) cnt ? (int) cnt : (int) cpu_cnt;
+    pthread_t *tids = malloc(thread_cnt * sizeof(pthread_t));
+    int started = 0;
+    /* This thread takes its share too, so it's done even if no other thread can be started. */
+    while (tids && started < thread_cnt - 1 &&
+           pthread_create(tids + started, NULL, (void *(*)(void *)) inflate_worker, &job) == 0)
+        started++;
+    inflate_worker(&job);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    free(frames);
+    if (job.failed) {
+        munmap(raw, raw_len);
+        fprintf(stderr, "broken compressed archive: %s\n", path);
+        return 1;
+    }
+    munmap((void *) r->data, r->map_len);
+    r->data = raw;
+    r->len = r->map_len = raw_len;
+    r->framed = 1;
+    return 0;
+
+    broken:
+    free(frames);
+    fprintf(stderr, "broken compressed archive: %s\n", path);
+    return 1;
+}
+
+/*
+ * Look for a table of contents at the end of the archive, and stop reading entries where it starts.
+ * Archives without one are read to the end.
+ */
+void find_toc(struct reader *r) {
+    if (r->map_len < VAAR_ARCHIVE_MAGIC_LEN + sizeof(struct toc_footer))
+        return;
+    struct toc_footer footer;
+    memcpy(&footer, r->data + r->map_len - sizeof(footer), sizeof(footer));
+    if (memcmp(footer.magic, VAAR_TOC_MAGIC, VAAR_TOC_MAGIC_LEN) != 0)
+        return;
+    uint64_t toc_off = le64toh(footer.toc_off), cnt = le64toh(footer.entry_cnt);
+    uint64_t names_len = le64toh(footer.names_len), end = r->map_len - sizeof(footer);
+    if (toc_off < VAAR_ARCHIVE_MAGIC_LEN || toc_off > end || cnt > (end - toc_off) / sizeof(struct toc_entry) ||
+        names_len != end - toc_off - cnt * sizeof(struct toc_entry))
+        return;
+    r->len = toc_off;
+    r->toc = (const struct toc_entry *) (r->data + toc_off);
+    r->toc_cnt = cnt;
+    r->toc_names = r->data + toc_off + cnt * sizeof(struct toc_entry);
+    r->toc_names_len = names_len;
+    r->toc_crc = le32toh(footer.crc);
+}
+
+int reader_open(struct reader *r, const char *path) {
+    memset(r, 0, sizeof(struct reader));
+    owner_map_init(&r->users);
+    owner_map_init(&r->groups);
+    r->hdr_cap = file_header_length(UINT16_MAX, VAAR_LONG_NAME_MAX);
+    if ((r->hdr = malloc(r->hdr_cap)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        close(fd);
+        return 1;
+    }
+    r->len = r->map_len = st.st_size;
+    if (r->len < VAAR_ARCHIVE_MAGIC_LEN) {
+        fprintf(stderr, "not an archive: %s\n", path);
+        close(fd);
+        return 1;
+    }
+    r->data = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->data == MAP_FAILED) {
+        perror("mmap");
+        r->data = NULL;
+        return 1;
+    }
+    madvise((void *) r->data, r->map_len, MADV_SEQUENTIAL);
+
+    if (r->len >= VAAR_FRAMED_MAGIC_LEN && memcmp(r->data, VAAR_FRAMED_MAGIC, VAAR_FRAMED_MAGIC_LEN) == 0 &&
+        inflate_archive(r, path))
+        return 1;
+    if (memcmp(r->data, VAAR_ARCHIVE_MAGIC, VAAR_ARCHIVE_MAGIC_LEN) == 0) {
+        r->format = 1;
+    } else if (memcmp(r->data, VAAR_ARCHIVE_MAGIC_V2, VAAR_ARCHIVE_MAGIC_LEN) == 0) {
+        r->format = 2;
+    } else {
+        fprintf(stderr, "not an archive: %s\n", path);
+        return 1;
+    }
+    r->off = VAAR_ARCHIVE_MAGIC_LEN;
+    find_toc(r);
+    return 0;
+}
+
+/*
+ * Skip the padding after a header of len bytes at off, if it has any.
+ * Returns the length with the padding, or 0 if it's broken.
+ */
+int skip_padding(const struct reader *r, uint64_t off, const struct file_header *hdr, int len) {
+    if (len <= 0 || !(hdr->flags & VAAR_FLAG_PADDED))
+        return len > 0 ? len : 0;
+    uint64_t left = r->len - off - len;
+    uint32_t pad;
+    if (left < sizeof(uint32_t))
+        return 0;
+    memcpy(&pad, r->data + off + len, sizeof(uint32_t));
+    pad = le32toh(pad);
+    if (pad > VAAR_PAD_MAX || pad > left - sizeof(uint32_t))
+        return 0;
+    return len + (int) sizeof(uint32_t) + (int) pad;
+}
+
+int reader_decode(const struct reader *r, uint64_t off, struct file_header *hdr, int hdr_cap) {
+    uint64_t left = r->len - off;
+    if (r->format == 2)
+        return skip_padding(r, off, hdr, file_header_decode_v2(r->data + off, left, hdr, hdr_cap));
+    if (left < sizeof(struct file_header))
+        return 0;
+    const struct file_header *raw = (const struct file_header *) (r->data + off);
+    int len = file_header_length(le16toh(raw->link_len), 0);
+    if (raw->flags & VAAR_FLAG_LONG_NAME) {
+        if (left < (uint64_t) len + sizeof(uint16_t))
+            return 0;
+        len = file_header_size(raw);
+    }
+    if ((uint64_t) len > left || len > hdr_cap)
+        return 0;
+    memcpy(hdr, raw, len);
+    file_header_decode(hdr);
+    return skip_padding(r, off, hdr, len);
+}
+
+/*
+ * Remember the name in a v2 owner record.
+ */
+int read_owner(struct reader *r) {
+    int user = r->hdr->type == VAAR_USER;
+    struct owner_entry *e;
+    if (owner_map_get(user ? &r->users : &r->groups, user ? r->hdr->uid : r->hdr->gid, &e) < 0)
+        return 1;
+    memcpy(e->name, user ? r->hdr->uname : r->hdr->gname, 32);
+    e->name[32] = '\0';
+    return 0;
+}
+
+/*
+ * Fill the owner names of a v2 header from the records before it.
+ */
+int fill_owners(struct reader *r) {
+    struct owner_entry *e;
+    if (owner_map_get(&r->users, r->hdr->uid, &e) < 0)
+        return 1;
+    strncpy(r->hdr->uname, e->name, sizeof(r->hdr->uname));
+    if (owner_map_get(&r->groups, r->hdr->gid, &e) < 0)
+        return 1;
+    strncpy(r->hdr->gname, e->name, sizeof(r->hdr->gname));
+    return 0;
+}
+
+int reader_content_size(const struct reader *r, const struct file_header *hdr, uint64_t content_off,
+                        uint64_t *size) {
+    *size = 0;
+    if (hdr->type != VAAR_REG)
+        return 0;
+    if (!(hdr->flags & VAAR_FLAG_SPARSE)) {
+        *size = hdr->size;
+        return 0;
+    }
+    uint64_t left = content_off < r->len ? r->len - content_off : 0, cnt;
+    if (left < sizeof(uint64_t))
+        return 1;
+    memcpy(&cnt, r->data + content_off, sizeof(uint64_t));
+    cnt = le64toh(cnt);
+    if (cnt > (left - sizeof(uint64_t)) / sizeof(struct sparse_extent))
+        return 1;
+    const char *p = r->data + content_off + sizeof(uint64_t);
+    uint64_t end = 0, data = 0;
+    for (uint64_t i = 0; i < cnt; i++) {
+        struct sparse_extent e;
+        memcpy(&e, p + i * sizeof(e), sizeof(e));
+        e.off = le64toh(e.off);
+        e.len = le64toh(e.len);
+        /* In order, and within the file. */
+        if (e.off < end || e.len > hdr->size || e.off > hdr->size - e.len)
+            return 1;
+        end = e.off + e.len;
+        data += e.len;
+    }
+    *size = sizeof(uint64_t) + cnt * sizeof(struct sparse_extent) + data;
+    return 0;
+}
+
+/*
+ * Make the record at off the current entry, and move past it.
+ * Returns 1 for an entry, 0 for an owner record, which is consumed, or -1 if the archive is broken.
+ */
+int load_entry(struct reader *r, uint64_t off) {
+    int n = off < r->len ? reader_decode(r, off, r->hdr, r->hdr_cap) : 0;
+    if (n == 0) {
+        fprintf(stderr, "broken header at offset %lu\n", off);
+        return -1;
+    }
+    r->hdr_off = off;
+    r->content_off = off + n;
+    if (r->hdr->type == VAAR_USER || r->hdr->type == VAAR_GROUP) {
+        if (read_owner(r))
+            return -1;
+        r->off = r->content_off;
+        return 0;
+    }
+    if (r->format == 2 && fill_owners(r))
+        return -1;
+
+    if (reader_content_size(r, r->hdr, r->content_off, &r->size)) {
+        fprintf(stderr, "broken extent map at offset %lu\n", r->content_off);
+        return -1;
+    }
+    uint64_t end = r->content_off + r->size + (r->hdr->flags & VAAR_FLAG_CHECKSUM ? sizeof(uint32_t) : 0);
+    if (end > r->len || end < r->content_off) {
+        fprintf(stderr, "truncated content at offset %lu\n", r->content_off);
+        return -1;
+    }
+    r->off = end;
+    return 1;
+}
+
+int reader_next(struct reader *r) {
+    while (r->off < r->len) {
+        int ret = load_entry(r, r->off);
+        if (ret != 0)
+            return ret;
+    }
+    return 0;
+}
+
+int reader_find(struct reader *r, const char *name, size_t len) {
+    if (r->toc) {
+        const struct toc_entry *te = reader_toc_find(r, name, len, UINT64_MAX);
+        /* A table pointing to an owner record is broken too. */
+        return te ? (load_entry(r, le64toh(te->off)) > 0 ? 1 : -1) : 0;
+    }
+    uint64_t found = 0;
+    int ret;
+    r->off = VAAR_ARCHIVE_MAGIC_LEN;
+    while ((ret = reader_next(r)) > 0) {
+        int hdr_len;
+        const char *hdr_name = file_header_name(r->hdr, &hdr_len);
+        if ((size_t) hdr_len == len && memcmp(hdr_name, name, len) == 0)
+            found = r->hdr_off;
+    }
+    if (ret < 0)
+        return -1;
+    /* The owners before it have been read on the way. */
+    return found ? load_entry(r, found) : 0;
+}
+
+void reader_advise(const struct reader *r, uint64_t off, uint64_t len, int advice) {
+    if (off >= r->map_len)
+        return;
+    uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = off & ~(page - 1);
+    if (len > r->map_len - off)
+        len = r->map_len - off;
+    madvise((void *) (r->data + start), off + len - start, advice);
+}
+
+/*
+ * Compare the name of an entry in the table of contents with name.
+ */
+int toc_compare_name(const struct reader *r, const struct toc_entry *e, const char *name, size_t len) {
+    size_t e_len;
+    const char *e_name = toc_entry_name(r, e, &e_len);
+    int ret = memcmp(e_name, name, e_len < len ? e_len : len);
+    if (ret == 0)
+        ret = (e_len > len) - (e_len < len);
+    return ret;
+}
+
+uint64_t reader_toc_seek(const struct reader *r, const char *name, size_t len) {
+    uint64_t lo = 0, hi = r->toc_cnt;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (toc_compare_name(r, r->toc + mid, name, len) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+const struct toc_entry *reader_toc_find(const struct reader *r, const char *name, size_t len, uint64_t before) {
+    const struct toc_entry *found = NULL;
+    /* Entries of the same name are in the order they were written. */
+    for (uint64_t i = reader_toc_seek(r, name, len); i < r->toc_cnt; i++) {
+        if (toc_compare_name(r, r->toc + i, name, len) != 0 || le64toh(r->toc[i].off) >= before)
+            break;
+        found = r->toc + i;
+    }
+    return found;
+}
+
+void reader_close(struct reader *r) {
+    if (r->data)
+        munmap((void *) r->data, r->map_len);
+    free(r->hdr);
+    owner_map_free(&r->users);
+    owner_map_free(&r->groups);
+}
@@ -0,0 +1,137 @@
+#ifndef VAAR_READER_H
+#define VAAR_READER_H
+
+#include <stdint.h>
+
+#include "format.h"
+#include "owner.h"
+
+/*
+ * Reads an archive mapped in memory, one entry after another. Contents aren't copied, but pointed to where they
+ * are in the mapping. A compressed archive is decompressed as a whole into anonymous memory first, which is read
+ * instead, so it's refused if its plain size is more than the memory available.
+ * Headers of both formats are decoded to host endian, and checked to be within the archive along with
+ * their contents. In v2, the owner records are consumed on the way, and their names filled into headers.
+ * If the archive ends with a table of contents, entries can be looked up in it by name too.
+ */
+struct reader {
+    const char *data;
+    uint64_t len; /* where the entries end, before the table of contents if there is one */
+    uint64_t map_len;
+    int format;
+    int framed; /* whether it's been decompressed from frames */
+    uint64_t off; /* where the next header starts */
+
+    /* the current entry */
+    struct file_header *hdr; /* decoded */
+    int hdr_cap;
+    uint64_t hdr_off, content_off;
+    uint64_t size; /* bytes of content, not counting the checksum; of sparse files, the extent map and the data */
+
+    /* v2 only: the owner names written so far */
+    struct owner_map users, groups;
+
+    /* the table of contents, as it is in the archive; toc is NULL if there is none */
+    const struct toc_entry *toc;
+    uint64_t toc_cnt;
+    const char *toc_names;
+    uint64_t toc_names_len;
+    uint32_t toc_crc;
+};
+
+/*
+ * Map the archive at path for reading. The reader must be closed even if it fails.
+ */
+int reader_open(struct reader *r, const char *path);
+
+/*
+ * Move to the next entry. Returns 1 if there is one, 0 at the end, or -1 if the archive is broken.
+ */
+int reader_next(struct reader *r);
+
+/*
+ * Get the bytes of content after a decoded header at content_off, not counting the checksum, into size.
+ * Sparse files have their extent maps checked on the way. Returns 0, or 1 if the content is broken.
+ */
+int reader_content_size(const struct reader *r, const struct file_header *hdr, uint64_t content_off,
+                        uint64_t *size);
+
+/*
+ * Make the latest entry named name the current one, looked up in the table of contents if there is one,
+ * or by reading all the headers otherwise. Reading goes on after it.
+ * Returns 1 if it's found, 0 if not, or -1 if the archive is broken.
+ */
+int reader_find(struct reader *r, const char *name, size_t len);
+
+/*
+ * Give the kernel a hint about the use of len bytes at off in the archive, as with madvise,
+ * e.g. MADV_WILLNEED before serving a content.
+ */
+void reader_advise(const struct reader *r, uint64_t off, uint64_t len, int advice);
+
+/*
+ * Decode the header at off into hdr, without touching the state of the reader. Safe to call from any thread.
+ * Returns the length of the header in the archive, with the padding after it if any, or 0 if it's broken.
+ */
+int reader_decode(const struct reader *r, uint64_t off, struct file_header *hdr, int hdr_cap);
+
+/*
+ * Find where the entries named name, or under it if it's a directory, start in the table of contents.
+ * Returns the index of the first entry not sorted before name, or toc_cnt if there is none.
+ */
+uint64_t reader_toc_seek(const struct reader *r, const char *name, size_t len);
+
+/*
+ * Find the latest entry named name in the table of contents, whose header is before offset before.
+ * Returns NULL if there is none.
+ */
+const struct toc_entry *reader_toc_find(const struct reader *r, const char *name, size_t len, uint64_t before);
+
+void reader_close(struct reader *r);
+
+/*
+ * Get the current header as it is in the archive, without copying it, along with its padding.
+ * It's only the same as the decoded one in v1.
+ */
+static inline const void *reader_raw_header(const struct reader *r, uint64_t *len) {
+    *len = r->content_off - r->hdr_off;
+    return r->data + r->hdr_off;
+}
+
+/*
+ * Get the content of the current entry in place, which has size bytes. It stays valid until the reader is closed.
+ */
+static inline const void *reader_content(const struct reader *r) {
+    return r->data + r->content_off;
+}
+
+/*
+ * Get the name of an entry in the table of contents, which is not terminated.
+ * A name out of the table comes back empty.
+ */
+static inline const char *toc_entry_name(const struct reader *r, const struct toc_entry *e, size_t *len) {
+    uint64_t off = le64toh(e->name_off);
+    *len = le16toh(e->name_len);
+    if (off > r->toc_names_len || *len > r->toc_names_len - off) {
+        *len = 0;
+        return r->toc_names;
+    }
+    return r->toc_names + off;
+}
+
+/*
+ * Get the full name in a decoded header, which is not terminated if it's long.
+ */
+static inline const char *file_header_name(const struct file_header *hdr, int *len) {
+    if (hdr->flags & VAAR_FLAG_LONG_NAME) {
+        const char *ext = file_header_ext(hdr, hdr->link_len);
+        uint16_t l;
+        memcpy(&l, ext, sizeof(uint16_t));
+        *len = le16toh(l);
+        return ext + sizeof(uint16_t);
+    }
+    *len = (int) strnlen(hdr->name, sizeof(hdr->name));
+    return hdr->name;
+}
+
+#endif //VAAR_READER_H
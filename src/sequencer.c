@@ -0,0 +1,110 @@
+#include <stdio.h>
+
+#include "futex.h"
+#include "sequencer.h"
+
+void sequencer_enqueue(struct sequencer *s, struct record *r) {
+    __atomic_store_n(&r->next, NULL, __ATOMIC_RELAXED);
+    struct record *prev = __atomic_exchange_n(&s->head, r, __ATOMIC_SEQ_CST);
+    /* The queue is broken between the exchange and the store. The consumer just waits it out. */
+    __atomic_store_n(&prev->next, r, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pop the oldest record. Consumer only.
+ * Returns NULL when empty or when a producer is in the middle of pushing.
+ */
+struct record *sequencer_dequeue(struct sequencer *s) {
+    struct record *tail = s->tail;
+    struct record *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &s->stub) {
+        if (next == NULL)
+            return NULL;
+        s->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        s->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&s->head, __ATOMIC_ACQUIRE))
+        return NULL;
+    /* The tail is the last one. Put the stub behind it so it can be popped. */
+    sequencer_enqueue(s, &s->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        s->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+void sequencer_consume(struct sequencer *s, struct record *r) {
+    if (!s->failed) {
+        int ret;
+        if (r->path)
+            ret = writer_emit_dedup(s->w, r->hdr, r->buf, r->fd, r->path, r->root_len);
+        else if (r->buf)
+            ret = writer_emit_buffer(s->w, r->hdr, r->buf, r->len);
+        else
+            ret = writer_emit_fd(s->w, r->hdr, r->fd);
+        if (ret)
+            /* Keep draining so that producers get their records back. */
+            s->failed = 1;
+    }
+    if (r->done)
+        r->done(r);
+}
+
+void *sequencer_main(struct sequencer *s) {
+    while (1) {
+        struct record *r = sequencer_dequeue(s);
+        if (r) {
+            sequencer_consume(s, r);
+            continue;
+        }
+
+        __atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+        int seq = __atomic_load_n(&s->seq, __ATOMIC_SEQ_CST);
+        if ((r = sequencer_dequeue(s))) {
+            __atomic_store_n(&s->waiting, 0, __ATOMIC_RELAXED);
+            sequencer_consume(s, r);
+            continue;
+        }
+        if (__atomic_load_n(&s->finished, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) == s->tail)
+            break;
+        futex_wait(&s->seq, seq);
+        __atomic_store_n(&s->waiting, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int sequencer_start(struct sequencer *s, struct writer *w) {
+    s->w = w;
+    s->stub.next = NULL;
+    s->head = s->tail = &s->stub;
+    s->seq = s->waiting = 0;
+    s->finished = s->failed = 0;
+    if (pthread_create(&s->tid, NULL, (void *(*)(void *)) sequencer_main, s)) {
+        perror("pthread_create");
+        return 1;
+    }
+    return 0;
+}
+
+void sequencer_push(struct sequencer *s, struct record *r) {
+    sequencer_enqueue(s, r);
+    if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&s->seq, 1, __ATOMIC_SEQ_CST);
+        futex_wake(&s->seq, 1);
+    }
+}
+
+int sequencer_finish(struct sequencer *s) {
+    __atomic_store_n(&s->finished, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&s->seq, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&s->seq, 1);
+    pthread_join(s->tid, NULL);
+    return s->failed;
+}
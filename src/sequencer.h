@@ -0,0 +1,60 @@
+#ifndef VAAR_SEQUENCER_H
+#define VAAR_SEQUENCER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "format.h"
+#include "writer.h"
+
+/*
+ * A fully prepared file waiting to be written.
+ * The producer must keep the header and the content alive until done is called by the sequencer.
+ */
+struct record {
+    struct record *next;
+    const struct file_header *hdr; /* encoded header */
+    const void *buf; /* content to write, or NULL to send len bytes from fd */
+    int fd;
+    size_t len;
+    const char *path; /* for regular files to be matched against earlier contents by path, or NULL */
+    int root_len; /* of the path given to be archived in path */
+    void (*done)(struct record *r);
+};
+
+/*
+ * The output stage. Producers push records onto a lockless MPSC queue, and a single consumer thread
+ * owns the writer and writes the records in the order they were pushed.
+ */
+struct sequencer {
+    struct writer *w;
+
+    /* producers exchange the head, and the consumer follows the tail */
+    struct record *head, *tail;
+    struct record stub;
+
+    /* the futex word the consumer sleeps on, and whether it's sleeping */
+    int seq, waiting;
+
+    int finished, failed;
+    pthread_t tid;
+};
+
+/*
+ * Initialize a sequencer and start its consumer thread writing to w.
+ * The writer must not be used by anyone else until the sequencer finishes.
+ */
+int sequencer_start(struct sequencer *s, struct writer *w);
+
+/*
+ * Queue a record for writing. Thread-safe and lockless.
+ */
+void sequencer_push(struct sequencer *s, struct record *r);
+
+/*
+ * Wait for all the pushed records to be written and stop the consumer thread.
+ * Returns non-zero if any record failed to be written.
+ */
+int sequencer_finish(struct sequencer *s);
+
+#endif //VAAR_SEQUENCER_H
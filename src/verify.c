@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crc32c.h"
+#include "format.h"
+#include "verify.h"
+
+/* Jobs taken by a thread at once, so small files don't make the threads fight over the counter. */
+const size_t VERIFY_BATCH = 64;
+
+/*
+ * Print the name of the file whose header is at off.
+ */
+void print_name(struct verifier *v, uint64_t off, struct file_header *hdr, int hdr_cap) {
+    if (reader_decode(&v->r, off, hdr, hdr_cap) == 0)
+        return;
+    int len;
+    const char *name = file_header_name(hdr, &len);
+    fprintf(stderr, "%.*s", len, name);
+}
+
+int add_job(struct verifier *v, uint64_t hdr_off, uint64_t data_off, uint64_t size) {
+    if (v->job_cnt == v->job_cap) {
+        size_t cap = v->job_cap ? v->job_cap * 2 : 1024;
+        struct verify_job *jobs = realloc(v->jobs, cap * sizeof(struct verify_job));
+        if (jobs == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        v->jobs = jobs;
+        v->job_cap = cap;
+    }
+    struct verify_job *j = v->jobs + v->job_cnt++;
+    j->hdr_off = hdr_off;
+    j->data_off = data_off;
+    j->size = size;
+    return 0;
+}
+
+/*
+ * Walk the headers of the archive, and make a job for each file with a checksum.
+ */
+int scan_archive(struct verifier *v) {
+    struct reader *r = &v->r;
+    int ret;
+    while ((ret = reader_next(r)) > 0) {
+        v->entry_cnt++;
+        if (r->hdr->flags & VAAR_FLAG_CHECKSUM && add_job(v, r->hdr_off, r->content_off, r->size))
+            return 1;
+    }
+    return ret < 0;
+}
+
+void *verify_worker(struct verifier *v) {
+    int hdr_cap = file_header_length(UINT16_MAX, VAAR_LONG_NAME_MAX);
+    struct file_header *hdr = NULL;
+    while (1) {
+        size_t i = __atomic_fetch_add(&v->next, VERIFY_BATCH, __ATOMIC_RELAXED);
+        if (i >= v->job_cnt)
+            break;
+        size_t end = i + VERIFY_BATCH < v->job_cnt ? i + VERIFY_BATCH : v->job_cnt;
+        for (; i < end; i++) {
+            struct verify_job *j = v->jobs + i;
+            uint32_t want;
+            memcpy(&want, v->r.data + j->data_off + j->size, sizeof(uint32_t));
+            if (crc32c(0, v->r.data + j->data_off, j->size) == le32toh(want))
+                continue;
+            __atomic_add_fetch(&v->failed, 1, __ATOMIC_RELAXED);
+            /* Only allocated once something is broken. */
+            if (hdr == NULL && (hdr = malloc(hdr_cap)) == NULL)
+                continue;
+            flockfile(stderr);
+            fprintf(stderr, "checksum mismatch: ");
+            print_name(v, j->hdr_off, hdr, hdr_cap);
+            fprintf(stderr, "\n");
+            funlockfile(stderr);
+        }
+    }
+    free(hdr);
+    return NULL;
+}
+
+int verify_archive(const char *path, int thread_cnt) {
+    int ret = 0;
+    struct verifier v;
+    memset(&v, 0, sizeof(struct verifier));
+    pthread_t *threads = calloc(thread_cnt, sizeof(pthread_t));
+    if (threads == NULL) {
+        perror("calloc");
+        ret = 1;
+        goto exit;
+    }
+    if (reader_open(&v.r, path) || scan_archive(&v)) {
+        ret = 1;
+        goto exit;
+    }
+
+    int started = 0;
+    for (; started < thread_cnt; started++)
+        if (pthread_create(threads + started, NULL, (void *(*)(void *)) verify_worker, &v)) {
+            perror("pthread_create");
+            ret = 1;
+            break;
+        }
+    if (started == 0)
+        verify_worker(&v);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    if (v.r.toc) {
+        uint64_t toc_len = v.r.toc_cnt * sizeof(struct toc_entry);
+        uint32_t crc = crc32c(crc32c(0, v.r.toc, toc_len), v.r.toc_names, v.r.toc_names_len);
+        if (crc != v.r.toc_crc) {
+            fprintf(stderr, "checksum mismatch: table of contents\n");
+            v.failed++;
+        } else if (v.r.toc_cnt != v.entry_cnt) {
+            fprintf(stderr, "table of contents has %lu entries, not %zu\n", v.r.toc_cnt, v.entry_cnt);
+            v.failed++;
+        }
+    }
+    printf("%zu entries, %zu with checksums, %zu broken\n", v.entry_cnt, v.job_cnt, v.failed);
+    if (v.failed)
+        ret = 1;
+
+    exit:
+    reader_close(&v.r);
+    free(v.jobs);
+    free(threads);
+    return ret;
+}
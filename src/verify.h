@@ -0,0 +1,37 @@
+#ifndef VAAR_VERIFY_H
+#define VAAR_VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "reader.h"
+
+/*
+ * A file whose content has a checksum, found in the archive.
+ */
+struct verify_job {
+    uint64_t hdr_off; /* where its header starts, to name it */
+    uint64_t data_off; /* where its content starts, followed by the checksum */
+    uint64_t size;
+};
+
+/*
+ * Checks the checksums of an archive mapped in memory. The headers are scanned first, and then the
+ * contents are checked by a pool of threads, taking the files in batches.
+ */
+struct verifier {
+    struct reader r;
+    struct verify_job *jobs;
+    size_t job_cnt, job_cap;
+    size_t entry_cnt; /* files, directories and links in the archive */
+    size_t next; /* the next job to be taken */
+    size_t failed;
+};
+
+/*
+ * Check the archive at path with thread_cnt threads, and report what's broken.
+ * Returns 0 if every checksum in it matches.
+ */
+int verify_archive(const char *path, int thread_cnt);
+
+#endif //VAAR_VERIFY_H
@@ -0,0 +1,19 @@
+#include <malloc.h>
+
+#include "work_deque.h"
+
+int work_deque_init(struct work_deque *q, uint32_t cap) {
+    cap = 1 << (32 - __builtin_clz(cap - 1));
+    q->top = q->bottom = 0;
+    q->mask = cap - 1;
+    q->items = malloc(sizeof(void *) * cap);
+    if (q->items == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    return 0;
+}
+
+void work_deque_free(struct work_deque *q) {
+    free(q->items);
+}
@@ -0,0 +1,82 @@
+#ifndef VAAR_WORK_DEQUE_H
+#define VAAR_WORK_DEQUE_H
+
+#include <stdint.h>
+
+/*
+ * Lockless work-stealing deque of pointers (Chase-Lev).
+ * Only the owner thread may push and take, at the bottom. Any thread may steal from the top.
+ * The capacity is fixed; a failed push should be handled by the owner doing the work itself.
+ */
+struct work_deque {
+    int64_t top, bottom;
+    void **items;
+    int64_t mask;
+};
+
+/*
+ * Initialize a deque with the smallest power of 2 greater than or equal to cap slots.
+ */
+int work_deque_init(struct work_deque *q, uint32_t cap);
+
+/*
+ * Push an item at the bottom. Owner only.
+ * Returns 0 on success, or 1 if the deque is full.
+ */
+static inline int work_deque_push(struct work_deque *q, void *item) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    if (b - t > q->mask)
+        return 1;
+    __atomic_store_n(&q->items[b & q->mask], item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * Take the most recently pushed item. Owner only.
+ * Returns NULL when empty.
+ */
+static inline void *work_deque_take(struct work_deque *q) {
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if (t > b) {
+        /* Empty. */
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void *item = __atomic_load_n(&q->items[b & q->mask], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* The last item. Race against thieves for it. */
+        if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            item = NULL;
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+/*
+ * Steal the oldest item. Thread-safe.
+ * Returns NULL when empty or when losing a race against another taker.
+ */
+static inline void *work_deque_steal(struct work_deque *q) {
+    int64_t t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int64_t b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b)
+        return NULL;
+    void *item = __atomic_load_n(&q->items[t & q->mask], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return item;
+}
+
+/*
+ * Destroy a deque and free the space. Remaining items are not touched.
+ */
+void work_deque_free(struct work_deque *q);
+
+#endif //VAAR_WORK_DEQUE_H
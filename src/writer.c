@@ -1,27 +1,229 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <malloc.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <linux/fs.h>
 
+#include "chunk_reader.h"
+#include "compressor.h"
+#include "crc32c.h"
 #include "format.h"
+#include "out_ring.h"
 #include "path.h"
 #include "writer.h"
 
 const int INIT_LINK_LEN = 256;
+const int PIPE_OUT_SIZE = 1 << 20;
 
-int write_file_header(int fd, struct file_header *hdr) {
-    ssize_t header_size = file_header_length(le16toh(hdr->link_len));
-    ssize_t n = write(fd, hdr, header_size);
-    if (n != header_size) {
-        perror("write");
-        return 1;
+int write_all(int fd, const void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return 1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Hand the staged output over to be written, without waiting for io_uring writes.
+ */
+int submit_staged(struct writer *w) {
+    if (w->out_len == 0)
+        return 0;
+    if (w->zip) {
+        compressor_submit(w->zip, w->out_len);
+        if ((w->out_buf = compressor_buffer(w->zip)) == NULL)
+            return 1;
+    } else if (w->ring == NULL) {
+        if (write_all(w->fd, w->out_buf, w->out_len))
+            return 1;
+    } else {
+        if (out_ring_submit(w->ring, w->out_len, w->off))
+            return 1;
+        if ((w->out_buf = out_ring_buffer(w->ring)) == NULL)
+            return 1;
+    }
+    w->off += w->out_len;
+    w->out_len = 0;
+    return 0;
+}
+
+/*
+ * Write data to output, through the staging buffer if there is one.
+ */
+int write_out(struct writer *w, const void *buf, size_t len) {
+    if (w->out_buf == NULL) {
+        w->off += len;
+        return write_all(w->fd, buf, len);
+    }
+    if (w->out_len + len > w->out_buf_len && w->ring == NULL && w->zip == NULL) {
+        if (submit_staged(w))
+            return 1;
+        if (len >= w->out_buf_len) {
+            /* Too large to be staged. */
+            w->off += len;
+            return write_all(w->fd, buf, len);
+        }
+    }
+    while (w->out_len + len > w->out_buf_len) {
+        /* Async writes and compression must go through their own buffers. Fill them one by one. */
+        size_t n = w->out_buf_len - w->out_len;
+        memcpy(w->out_buf + w->out_len, buf, n);
+        w->out_len += n;
+        buf += n;
+        len -= n;
+        if (submit_staged(w))
+            return 1;
+    }
+    memcpy(w->out_buf + w->out_len, buf, len);
+    w->out_len += len;
+    return 0;
+}
+
+/*
+ * Write the v2 record naming an owner id, unless it has been written or there is no name.
+ */
+int write_owner(struct writer *w, struct owner_map *written, uint8_t type, uint32_t id, const char *name) {
+    if (name[0] == '\0')
+        return 0;
+    struct owner_entry *e;
+    int ret = owner_map_get(written, id, &e);
+    if (ret != 0)
+        return ret < 0;
+    char buf[32 + 24];
+    /* The name in a header may have no terminator. */
+    char owner[33] = {0};
+    memcpy(owner, name, 32);
+    return write_out(w, buf, owner_record_encode_v2(type, id, owner, buf));
+}
+
+/*
+ * Tell if the content of the file is followed by a checksum.
+ */
+static inline int has_checksum(struct writer *w, const struct file_header *hdr) {
+    return w->checksum && hdr->type == VAAR_REG;
+}
+
+int writer_add_toc(struct writer *w, const struct toc_entry *entry, const char *name) {
+    size_t name_len = entry->name_len;
+    if (w->toc_cnt == w->toc_cap) {
+        size_t cap = w->toc_cap ? w->toc_cap * 2 : 1024;
+        struct toc_entry *entries = realloc(w->toc_entries, cap * sizeof(struct toc_entry));
+        if (entries == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        w->toc_entries = entries;
+        w->toc_cap = cap;
+    }
+    if (w->toc_names_len + name_len > w->toc_names_cap) {
+        size_t cap = w->toc_names_cap ? w->toc_names_cap * 2 : 1 << 20;
+        while (cap < w->toc_names_len + name_len)
+            cap *= 2;
+        char *names = realloc(w->toc_names, cap);
+        if (names == NULL) {
+            perror("realloc");
+            return 1;
+        }
+        w->toc_names = names;
+        w->toc_names_cap = cap;
     }
+    struct toc_entry *e = w->toc_entries + w->toc_cnt++;
+    *e = *entry;
+    e->name_off = w->toc_names_len;
+    e->_reserved = 0;
+    memcpy(w->toc_names + w->toc_names_len, name, name_len);
+    w->toc_names_len += name_len;
     return 0;
 }
 
+/*
+ * Add an encoded header to the table of contents, as it's about to be written at the current offset.
+ */
+int record_toc(struct writer *w, const struct file_header *hdr) {
+    const char *name = hdr->name;
+    size_t name_len = strnlen(hdr->name, sizeof(hdr->name));
+    if (hdr->flags & VAAR_FLAG_LONG_NAME) {
+        const char *ext = file_header_ext(hdr, le16toh(hdr->link_len));
+        uint16_t len;
+        memcpy(&len, ext, sizeof(uint16_t));
+        name_len = le16toh(len);
+        name = ext + sizeof(uint16_t);
+    }
+    struct toc_entry e = {
+            .off = w->off + w->out_len,
+            .size = le64toh(hdr->size),
+            .link_anchor = le32toh(hdr->link_anchor),
+            .name_len = name_len,
+            .type = hdr->type,
+    };
+    return writer_add_toc(w, &e, name);
+}
+
+/*
+ * Write a header, with extra flags decided as it's written.
+ */
+int write_file_header(struct writer *w, const struct file_header *hdr, uint8_t extra) {
+    /* Headers may be prepared by other writers. The flags are added as they are written. */
+    uint8_t flags = hdr->flags | extra | (has_checksum(w, hdr) ? VAAR_FLAG_CHECKSUM : 0);
+    if (w->format == 1) {
+        if (w->toc && record_toc(w, hdr))
+            return 1;
+        if (flags == hdr->flags)
+            return write_out(w, hdr, file_header_size(hdr));
+        size_t off = offsetof(struct file_header, flags);
+        return write_out(w, hdr, off) || write_out(w, &flags, 1) ||
+               write_out(w, (const char *) hdr + off + 1, file_header_size(hdr) - off - 1);
+    }
+
+    if (write_owner(w, &w->users_out, VAAR_USER, le32toh(hdr->uid), hdr->uname) ||
+        write_owner(w, &w->groups_out, VAAR_GROUP, le32toh(hdr->gid), hdr->gname))
+        return 1;
+    int bound = file_header_v2_bound(hdr);
+    if (bound > w->v2_buf_len) {
+        char *buf = malloc(bound);
+        if (buf == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        free(w->v2_buf);
+        w->v2_buf = buf;
+        w->v2_buf_len = bound;
+    }
+    /* After the owner records, which aren't in the table of contents. */
+    if (w->toc && record_toc(w, hdr))
+        return 1;
+    int len = file_header_encode_v2(hdr, w->v2_buf);
+    /* The flags come right after the type. */
+    w->v2_buf[1] |= (char) (flags & (VAAR_FLAG_CHECKSUM | VAAR_FLAG_SPARSE | VAAR_FLAG_PADDED));
+    return write_out(w, w->v2_buf, len);
+}
+
+/*
+ * Write the checksum of the content just written, if the file has one.
+ */
+int write_checksum(struct writer *w, const struct file_header *hdr) {
+    if (!has_checksum(w, hdr))
+        return 0;
+    uint32_t crc = htole32(w->crc);
+    return write_out(w, &crc, sizeof(crc));
+}
+
 int writer_init(struct writer *w, int fd) {
     w->fd = fd;
+    w->format = 1;
     w->hdr_buf = malloc(sizeof(struct file_header));
     if (w->hdr_buf == NULL) {
         perror("malloc");
@@ -35,30 +237,273 @@ int writer_init(struct writer *w, int fd) {
     }
     w->link_buf_len = INIT_LINK_LEN;
     w->link_len = 0;
+    owner_map_init(&w->users);
+    owner_map_init(&w->groups);
+    w->v2_buf = NULL;
+    w->v2_buf_len = 0;
+    owner_map_init(&w->users_out);
+    owner_map_init(&w->groups_out);
+    w->out_buf = NULL;
+    w->out_buf_len = w->out_len = 0;
+    w->ring = NULL;
+    w->chunks = NULL;
+    w->zip = NULL;
+    w->checksum = 0;
+    w->crc = 0;
+    w->block = 0;
+    w->can_clone = w->can_copy = 0;
+    w->sparse = 0;
+    w->extents = NULL;
+    w->extent_cnt = w->extent_cap = 0;
+    w->dedup = NULL;
+    w->hashing = 0;
+    w->toc = 0;
+    w->toc_entries = NULL;
+    w->toc_cnt = w->toc_cap = 0;
+    w->toc_names = NULL;
+    w->toc_names_len = w->toc_names_cap = 0;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    w->off = off > 0 ? off : 0;
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        perror("fstat");
+        return 1;
+    }
+    w->output = S_ISFIFO(st.st_mode) ? OUT_PIPE : S_ISSOCK(st.st_mode) ? OUT_SOCKET : OUT_FILE;
+    /* It's fine to stay with the default size if the limit is lower. */
+    if (w->output == OUT_PIPE && fcntl(fd, F_GETPIPE_SZ) < PIPE_OUT_SIZE)
+        fcntl(fd, F_SETPIPE_SZ, PIPE_OUT_SIZE);
     return 0;
 }
 
-int writer_magic(struct writer *w) {
-    ssize_t n = write(w->fd, VAAR_ARCHIVE_MAGIC, VAAR_ARCHIVE_MAGIC_LEN);
-    if (n != VAAR_ARCHIVE_MAGIC_LEN) {
-        perror("write");
+/*
+ * Drop the output buffers, flushing everything in them.
+ */
+int release_buffers(struct writer *w) {
+    if (writer_flush(w))
         return 1;
+    if (w->ring) {
+        out_ring_free(w->ring);
+        free(w->ring);
+        w->ring = NULL;
+    } else if (w->zip) {
+        compressor_free(w->zip);
+        free(w->zip);
+        w->zip = NULL;
+    } else {
+        free(w->out_buf);
     }
+    w->out_buf = NULL;
+    w->out_buf_len = 0;
     return 0;
 }
 
-int writer_prepare_statx(struct writer *w, const char *path, struct statx *s) {
+int writer_set_format(struct writer *w, int format) {
+    if (format != 1 && format != 2) {
+        fprintf(stderr, "unknown archive format %d\n", format);
+        return 1;
+    }
+    w->format = format;
+    return 0;
+}
+
+int writer_set_buffer(struct writer *w, size_t size) {
+    if (release_buffers(w))
+        return 1;
+    w->out_buf_len = 0;
+    if (size == 0)
+        return 0;
+    w->out_buf = malloc(size);
+    if (w->out_buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    w->out_buf_len = size;
+    return 0;
+}
+
+int writer_set_uring(struct writer *w, int buf_cnt, size_t buf_size) {
+    if (release_buffers(w))
+        return 1;
+    if (lseek(w->fd, (off_t) w->off, SEEK_SET) < 0) {
+        fprintf(stderr, "io_uring output needs a seekable archive\n");
+        return 1;
+    }
+    w->ring = malloc(sizeof(struct out_ring));
+    if (w->ring == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (out_ring_init(w->ring, w->fd, buf_cnt, buf_size)) {
+        free(w->ring);
+        w->ring = NULL;
+        return 1;
+    }
+    w->out_buf = out_ring_buffer(w->ring);
+    w->out_buf_len = buf_size;
+    return 0;
+}
+
+int writer_set_compression(struct writer *w, size_t frame_size, int worker_cnt, int level) {
+    if (release_buffers(w))
+        return 1;
+    w->zip = malloc(sizeof(struct compressor));
+    if (w->zip == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (compressor_init(w->zip, w->fd, frame_size, worker_cnt, level)) {
+        free(w->zip);
+        w->zip = NULL;
+        return 1;
+    }
+    w->out_buf = compressor_buffer(w->zip);
+    w->out_buf_len = frame_size;
+    return 0;
+}
+
+void writer_set_checksum(struct writer *w, int checksum) {
+    w->checksum = checksum;
+}
+
+int writer_set_reflink(struct writer *w, int reflink) {
+    w->block = 0;
+    if (!reflink)
+        return 0;
+    struct stat st;
+    if (fstat(w->fd, &st)) {
+        perror("fstat");
+        return 1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "cloned contents need a regular file as the archive\n");
+        return 1;
+    }
+    w->block = st.st_blksize > 0 && st.st_blksize <= VAAR_PAD_MAX ? st.st_blksize : 4096;
+    w->can_clone = w->can_copy = 1;
+    return 0;
+}
+
+void writer_set_dedup(struct writer *w, struct dedup_table *t) {
+    w->dedup = t;
+}
+
+void writer_set_sparse(struct writer *w, int sparse) {
+    w->sparse = sparse;
+}
+
+void writer_set_toc(struct writer *w, int toc) {
+    w->toc = toc;
+}
+
+int writer_set_chunking(struct writer *w, size_t chunk_size, size_t budget) {
+    if (w->chunks) {
+        chunk_reader_free(w->chunks);
+        free(w->chunks);
+        w->chunks = NULL;
+    }
+    if (budget == 0)
+        return 0;
+    w->chunks = malloc(sizeof(struct chunk_reader));
+    if (w->chunks == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (chunk_reader_init(w->chunks, chunk_size, budget)) {
+        free(w->chunks);
+        w->chunks = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+int writer_flush(struct writer *w) {
+    if (submit_staged(w))
+        return 1;
+    if (w->zip && compressor_drain(w->zip))
+        return 1;
+    if (w->ring) {
+        if (out_ring_drain(w->ring))
+            return 1;
+        /* Async writes don't move the file offset. Catch up for whoever writes next. */
+        if (lseek(w->fd, (off_t) w->off, SEEK_SET) < 0) {
+            perror("lseek");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int writer_magic(struct writer *w) {
+    return write_out(w, w->format == 2 ? VAAR_ARCHIVE_MAGIC_V2 : VAAR_ARCHIVE_MAGIC, VAAR_ARCHIVE_MAGIC_LEN);
+}
+
+/*
+ * Order entries of the table of contents by name, and then by offset.
+ */
+int toc_compare(const void *a, const void *b, void *names) {
+    const struct toc_entry *x = a, *y = b;
+    size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int ret = memcmp((char *) names + x->name_off, (char *) names + y->name_off, len);
+    if (ret == 0)
+        ret = (x->name_len > y->name_len) - (x->name_len < y->name_len);
+    if (ret == 0)
+        ret = (x->off > y->off) - (x->off < y->off);
+    return ret;
+}
+
+int writer_toc(struct writer *w) {
+    if (!w->toc)
+        return 0;
+    struct toc_footer footer;
+    footer.toc_off = htole64(w->off + w->out_len);
+    footer.entry_cnt = htole64(w->toc_cnt);
+    footer.names_len = htole64(w->toc_names_len);
+    footer._reserved = 0;
+    memcpy(footer.magic, VAAR_TOC_MAGIC, VAAR_TOC_MAGIC_LEN);
+
+    qsort_r(w->toc_entries, w->toc_cnt, sizeof(struct toc_entry), toc_compare, w->toc_names);
+    for (size_t i = 0; i < w->toc_cnt; i++) {
+        struct toc_entry *e = w->toc_entries + i;
+        e->off = htole64(e->off);
+        e->size = htole64(e->size);
+        e->name_off = htole64(e->name_off);
+        e->link_anchor = htole32(e->link_anchor);
+        e->name_len = htole16(e->name_len);
+    }
+    size_t entries_len = w->toc_cnt * sizeof(struct toc_entry);
+    uint32_t crc = crc32c(0, w->toc_entries, entries_len);
+    footer.crc = htole32(crc32c(crc, w->toc_names, w->toc_names_len));
+    /* Nothing is recorded after this. */
+    w->toc = 0;
+    return write_out(w, w->toc_entries, entries_len) || write_out(w, w->toc_names, w->toc_names_len) ||
+           write_out(w, &footer, sizeof(footer));
+}
+
+/*
+ * Prepare the header of a file, with the content of an earlier one if dup is set. Its name is in link_buf.
+ */
+int prepare_header(struct writer *w, const char *path, struct statx *s, int dup) {
     if (!is_dir(s) && !is_regular(s) && !is_symlink(s)) {
         fprintf(stderr, "unsupported file type: %s\n", path);
         return 1;
     }
 
-    int hdr_len = file_header_length(is_symlink(s) ? w->link_len : 0);
-    char new_path[256];
-    if (clean_path(path, new_path) <= 0) {
+    int off = clean_path(path);
+    if (off < 0 || path[off] == '\0') {
         fprintf(stderr, "path %s failed validation\n", path);
         return 1;
     }
+    const char *name = path + off;
+    size_t name_len = strlen(name);
+    if (name_len > VAAR_LONG_NAME_MAX) {
+        fprintf(stderr, "path %s is too long\n", path);
+        return 1;
+    }
+    int link_len = is_symlink(s) || dup ? w->link_len : 0;
+    int long_name_len = name_len > VAAR_NAME_MAX ? (int) name_len : 0;
+    int hdr_len = file_header_length(link_len, long_name_len);
 
     if (hdr_len > w->hdr_buf_len) {
         struct file_header *new_hdr_buf = malloc(hdr_len);
@@ -75,14 +520,21 @@ int writer_prepare_statx(struct writer *w, const char *path, struct statx *s) {
     memset(w->hdr_buf->uname, 0, 32);
     memset(w->hdr_buf->gname, 0, 32);
 
-    strncpy(w->hdr_buf->name, new_path, 255);
+    memcpy(w->hdr_buf->name, name, long_name_len ? VAAR_NAME_MAX : name_len);
+    w->hdr_buf->flags = 0;
     w->hdr_buf->size = s->stx_size;
     w->hdr_buf->mode = s->stx_mode & 0777; /* strip the high bits */
     w->hdr_buf->mtime.sec = s->stx_mtime.tv_sec;
     w->hdr_buf->mtime.nsec = s->stx_mtime.tv_nsec;
     w->hdr_buf->uid = s->stx_uid;
     w->hdr_buf->gid = s->stx_gid;
-    if (is_regular(s)) {
+    if (is_regular(s) && dup) {
+        w->hdr_buf->type = VAAR_DUP;
+        w->hdr_buf->size = 0;
+        w->hdr_buf->link_len = w->link_len;
+        memcpy(w->hdr_buf->linkname, w->link_buf, w->link_len);
+        w->hdr_buf->linkname[w->link_len] = '\0';
+    } else if (is_regular(s)) {
         w->hdr_buf->type = VAAR_REG;
         w->hdr_buf->link_len = 0;
     } else if (is_dir(s)) {
@@ -96,10 +548,18 @@ int writer_prepare_statx(struct writer *w, const char *path, struct statx *s) {
         strncpy(w->hdr_buf->linkname, w->link_buf, w->link_len);
         w->hdr_buf->linkname[w->link_len] = '\0';
     }
+    if (long_name_len) {
+        w->hdr_buf->flags |= VAAR_FLAG_LONG_NAME;
+        char *ext = file_header_ext(w->hdr_buf, link_len);
+        uint16_t len = htole16(long_name_len);
+        memcpy(ext, &len, sizeof(uint16_t));
+        memcpy(ext + sizeof(uint16_t), name, long_name_len);
+    }
 
-    // TODO: uname & gname
+    strncpy(w->hdr_buf->uname, owner_user_name(&w->users, s->stx_uid), 32);
+    strncpy(w->hdr_buf->gname, owner_group_name(&w->groups, s->stx_gid), 32);
 
-    // TODO: hard link
+    /* Set by writer_prepare_hard_link if the file has other names. */
     w->hdr_buf->link_anchor = 0;
 
     file_header_encode(w->hdr_buf);
@@ -107,6 +567,48 @@ int writer_prepare_statx(struct writer *w, const char *path, struct statx *s) {
     return 0;
 }
 
+int writer_prepare_statx(struct writer *w, const char *path, struct statx *s) {
+    return prepare_header(w, path, s, 0);
+}
+
+int writer_prepare_dup(struct writer *w, const char *path, struct statx *s, const char *orig) {
+    size_t len = strlen(orig);
+    if ((int) len >= w->link_buf_len) {
+        char *new_link_buf = malloc(len + 1);
+        if (new_link_buf == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        free(w->link_buf);
+        w->link_buf = new_link_buf;
+        w->link_buf_len = (int) len + 1;
+    }
+    memcpy(w->link_buf, orig, len);
+    w->link_len = (int) len;
+    return prepare_header(w, path, s, 1);
+}
+
+int writer_prepare_deleted(struct writer *w, const char *name) {
+    struct statx s;
+    memset(&s, 0, sizeof(s));
+    s.stx_mode = S_IFREG;
+    if (prepare_header(w, name, &s, 0))
+        return 1;
+    /* Nobody owns it. */
+    memset(w->hdr_buf->uname, 0, 32);
+    memset(w->hdr_buf->gname, 0, 32);
+    w->hdr_buf->type = VAAR_DEL;
+    return 0;
+}
+
+void writer_prepare_hard_link(struct writer *w, uint32_t anchor, int first) {
+    w->hdr_buf->link_anchor = htole32(anchor);
+    if (!first) {
+        w->hdr_buf->type = VAAR_LNK;
+        w->hdr_buf->size = 0;
+    }
+}
+
 int writer_prepare_link(struct writer *w, int dir_fd, const char *path) {
     while (1) {
         ssize_t n = readlinkat(dir_fd, path, w->link_buf, w->link_buf_len);
@@ -131,44 +633,439 @@ int writer_prepare_link(struct writer *w, int dir_fd, const char *path) {
     }
 }
 
-int writer_execute_fd(struct writer *w, int fd, size_t len) {
-    int ret = 0;
-    off64_t sent = 0;
-    uint64_t size = le64toh(w->hdr_buf->size);
-    if (write_file_header(w->fd, w->hdr_buf)) {
-        ret = 1;
-        goto exit;
-    }
-    while (size > 0) {
-        ssize_t n = sendfile64(w->fd, fd, &sent, size);
+int writer_header_length(struct writer *w) {
+    return file_header_size(w->hdr_buf);
+}
+
+/*
+ * Copy len bytes at off of fd to output in chunks read ahead through io_uring.
+ */
+int emit_chunks(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    if (chunk_reader_start(w->chunks, fd, off, len))
+        return 1;
+    while (1) {
+        const void *buf;
+        size_t n;
+        if (chunk_reader_next(w->chunks, &buf, &n))
+            return 1;
+        if (n == 0)
+            return 0;
+        if (w->checksum)
+            w->crc = crc32c(w->crc, buf, n);
+        if (w->hashing)
+            content_hash_update(&w->hash, buf, n);
+        if (write_out(w, buf, n))
+            return 1;
+    }
+}
+
+/*
+ * Read len bytes at off of fd right into the staging buffers, for outputs that must see all the bytes.
+ */
+int emit_read(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    uint64_t end = off + len;
+    while (off < end) {
+        /* A header may have just filled the staging buffer, and so may the read before. */
+        if (w->out_len == w->out_buf_len && submit_staged(w))
+            return 1;
+        size_t want = w->out_buf_len - w->out_len;
+        if (want > end - off)
+            want = end - off;
+        ssize_t n = pread(fd, w->out_buf + w->out_len, want, (off_t) off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("pread");
+            return 1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file shrank while being archived\n");
+            return 1;
+        }
+        if (w->checksum)
+            w->crc = crc32c(w->crc, w->out_buf + w->out_len, n);
+        if (w->hashing)
+            content_hash_update(&w->hash, w->out_buf + w->out_len, n);
+        w->out_len += n;
+        off += n;
+    }
+    return 0;
+}
+
+/*
+ * Send len bytes at off of fd to output with sendfile64, after everything staged.
+ */
+int emit_sendfile(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    if (submit_staged(w))
+        return 1;
+    if (w->ring && lseek(w->fd, (off_t) w->off, SEEK_SET) < 0) {
+        perror("lseek");
+        return 1;
+    }
+    w->off += len;
+    off64_t sent = (off64_t) off;
+    while (len > 0) {
+        /* sendfile64 advances the offset by itself. */
+        ssize_t n = sendfile64(w->fd, fd, &sent, len);
         if (n < 0) {
             perror("sendfile64");
-            ret = 1;
-            goto exit;
+            return 1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file shrank while being archived\n");
+            return 1;
         }
-        size -= n;
-        sent += n;
+        len -= n;
     }
-    exit:
-    return ret;
+    return 0;
 }
 
-int writer_execute_buffer(struct writer *w, void *buf, size_t len) {
-    int ret = 0;
-    if (write_file_header(w->fd, w->hdr_buf)) {
-        ret = 1;
-        goto exit;
+/*
+ * Splice len bytes at off of fd into the output pipe, after everything staged. The pages are moved from
+ * the page cache without being copied. Files that can't be spliced are read instead.
+ */
+int emit_splice(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    if (submit_staged(w))
+        return 1;
+    loff_t in = (loff_t) off;
+    while (len > 0) {
+        ssize_t n = splice(fd, &in, w->fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && w->chunks)
+                return emit_chunks(w, fd, (uint64_t) in, len);
+            if (errno == EINVAL && w->out_buf)
+                return emit_read(w, fd, (uint64_t) in, len);
+            perror("splice");
+            return 1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file shrank while being archived\n");
+            return 1;
+        }
+        w->off += n;
+        len -= n;
     }
-    ssize_t n = write(w->fd, buf, len);
-    if (n != len) {
-        perror("write");
-        ret = 1;
+    return 0;
+}
+
+/*
+ * Copy len bytes at off of fd to output, in whatever way the output allows.
+ */
+int emit_content(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    if (len == 0)
+        return 0;
+    /* The bytes have to be seen to be compressed, summed or hashed. */
+    int seen = w->zip || w->checksum || w->hashing;
+    if (w->output == OUT_PIPE && !seen)
+        return emit_splice(w, fd, off, len);
+    if (w->output == OUT_SOCKET && !seen)
+        return emit_sendfile(w, fd, off, len);
+    if (w->chunks)
+        return emit_chunks(w, fd, off, len);
+    if (seen)
+        return emit_read(w, fd, off, len);
+    return emit_sendfile(w, fd, off, len);
+}
+
+/*
+ * Find the data extents of the first size bytes of fd.
+ * Returns 1 if there are holes, 0 if there are none or it can't be told, or -1 on errors.
+ */
+int find_extents(struct writer *w, int fd, uint64_t size) {
+    /* Most files have no holes, and only take this one call. */
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole < 0 || (uint64_t) hole >= size)
+        return 0;
+    w->extent_cnt = 0;
+    uint64_t off = 0;
+    while (off < size) {
+        off_t data = lseek(fd, (off_t) off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            /* A hole up to the end. */
+            break;
+        if (data < 0 || (hole = lseek(fd, data, SEEK_HOLE)) < 0) {
+            perror("lseek");
+            return -1;
+        }
+        if ((uint64_t) data >= size)
+            break;
+        if ((uint64_t) hole > size)
+            hole = (off_t) size;
+        if (w->extent_cnt == w->extent_cap) {
+            size_t cap = w->extent_cap ? w->extent_cap * 2 : 64;
+            struct sparse_extent *extents = realloc(w->extents, cap * sizeof(struct sparse_extent));
+            if (extents == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            w->extents = extents;
+            w->extent_cap = cap;
+        }
+        w->extents[w->extent_cnt].off = data;
+        w->extents[w->extent_cnt].len = hole - data;
+        w->extent_cnt++;
+        off = hole;
+    }
+    return 1;
+}
+
+/*
+ * Write the content of a sparse file: the extent map, and the data of the extents found.
+ */
+int emit_sparse(struct writer *w, int fd) {
+    uint64_t cnt = htole64(w->extent_cnt);
+    if (w->checksum)
+        w->crc = crc32c(w->crc, &cnt, sizeof(cnt));
+    if (w->hashing)
+        content_hash_update(&w->hash, &cnt, sizeof(cnt));
+    if (write_out(w, &cnt, sizeof(cnt)))
+        return 1;
+    for (size_t i = 0; i < w->extent_cnt; i++) {
+        struct sparse_extent e = {.off = htole64(w->extents[i].off), .len = htole64(w->extents[i].len)};
+        if (w->checksum)
+            w->crc = crc32c(w->crc, &e, sizeof(e));
+        if (w->hashing)
+            content_hash_update(&w->hash, &e, sizeof(e));
+        if (write_out(w, &e, sizeof(e)))
+            return 1;
     }
-    exit:
+    for (size_t i = 0; i < w->extent_cnt; i++)
+        if (emit_content(w, fd, w->extents[i].off, w->extents[i].len))
+            return 1;
+    return 0;
+}
+
+/*
+ * Write the padding and the content of fd, which is cloned into the output, or copied in the kernel.
+ */
+int emit_cloned(struct writer *w, int fd, uint64_t size) {
+    static const char zeros[4096];
+    uint64_t pos = w->off + w->out_len + sizeof(uint32_t);
+    uint32_t pad = (w->block - pos % w->block) % w->block;
+    uint32_t pad_le = htole32(pad);
+    if (write_out(w, &pad_le, sizeof(uint32_t)))
+        return 1;
+    for (uint32_t n; pad > 0; pad -= n) {
+        n = pad < sizeof(zeros) ? pad : sizeof(zeros);
+        if (write_out(w, zeros, n))
+            return 1;
+    }
+    /* Cloning goes around the output buffers. Everything before must be in place. */
+    if (submit_staged(w) || (w->ring && out_ring_drain(w->ring)))
+        return 1;
+
+    uint64_t done = 0;
+    if (w->can_clone) {
+        struct file_clone_range range = {.src_fd = fd, .src_offset = 0, .src_length = size, .dest_offset = w->off};
+        if (ioctl(w->fd, FICLONERANGE, &range) == 0) {
+            done = size;
+        } else if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENOTTY) {
+            /* Not on the same filesystem, or not one with reflinks. Don't try again. */
+            w->can_clone = 0;
+        } else if (errno != EINVAL) {
+            perror("ioctl");
+            return 1;
+        }
+    }
+    loff_t in = (loff_t) done, out = (loff_t) (w->off + done);
+    while (done < size && w->can_copy) {
+        ssize_t n = copy_file_range(fd, &in, w->fd, &out, size - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+            w->can_copy = 0;
+            break;
+        }
+        if (n < 0) {
+            perror("copy_file_range");
+            return 1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "file shrank while being archived\n");
+            return 1;
+        }
+        done += n;
+    }
+    /* Neither moves the file offset. Catch up for whoever writes next. */
+    w->off += done;
+    if (lseek(w->fd, (off_t) w->off, SEEK_SET) < 0) {
+        perror("lseek");
+        return 1;
+    }
+    return done < size ? emit_sendfile(w, fd, done, size - done) : 0;
+}
+
+/*
+ * Write the header and the content of fd, with the extents found in it if it's sparse.
+ */
+int emit_file(struct writer *w, const struct file_header *hdr, int fd, int sparse) {
+    int ret = 0;
+    uint64_t size = le64toh(hdr->size);
+    w->crc = 0;
+    /* Smaller files aren't worth the padding. */
+    int padded = !sparse && w->block && size >= w->block;
+    if (write_file_header(w, hdr, (sparse ? VAAR_FLAG_SPARSE : 0) | (padded ? VAAR_FLAG_PADDED : 0)))
+        return 1;
+    if (sparse)
+        ret = emit_sparse(w, fd);
+    else if (padded)
+        ret = emit_cloned(w, fd, size);
+    else
+        ret = emit_content(w, fd, 0, size);
+    if (ret == 0)
+        ret = write_checksum(w, hdr);
     return ret;
 }
 
+int writer_emit_fd(struct writer *w, const struct file_header *hdr, int fd) {
+    uint64_t size = le64toh(hdr->size);
+    int sparse = 0;
+    if (w->sparse && size > 0 && (sparse = find_extents(w, fd, size)) < 0)
+        return 1;
+    return emit_file(w, hdr, fd, sparse);
+}
+
+int writer_emit_buffer(struct writer *w, const struct file_header *hdr, const void *buf, size_t len) {
+    if (write_file_header(w, hdr, 0))
+        return 1;
+    w->crc = w->checksum ? crc32c(0, buf, len) : 0;
+    if (w->hashing)
+        content_hash_update(&w->hash, buf, len);
+    return write_out(w, buf, len) || write_checksum(w, hdr);
+}
+
+/*
+ * Feed len bytes at off of fd to the content hash without writing them, read ahead through io_uring if chunked.
+ */
+int hash_range(struct writer *w, int fd, uint64_t off, uint64_t len) {
+    if (w->chunks == NULL)
+        return content_hash_fd(w->dedup, &w->hash, fd, off, len);
+    if (chunk_reader_start(w->chunks, fd, off, len))
+        return 1;
+    while (1) {
+        const void *buf;
+        size_t n;
+        if (chunk_reader_next(w->chunks, &buf, &n))
+            return 1;
+        if (n == 0)
+            return 0;
+        content_hash_update(&w->hash, buf, n);
+    }
+}
+
+/*
+ * Hash the content of fd as it would be written, without writing it: the extent map and the data of the extents
+ * found if it's sparse, or all of it otherwise.
+ */
+int hash_file(struct writer *w, int fd, uint64_t size, int sparse) {
+    if (!sparse)
+        return hash_range(w, fd, 0, size);
+    uint64_t cnt = htole64(w->extent_cnt);
+    content_hash_update(&w->hash, &cnt, sizeof(cnt));
+    for (size_t i = 0; i < w->extent_cnt; i++) {
+        struct sparse_extent e = {.off = htole64(w->extents[i].off), .len = htole64(w->extents[i].len)};
+        content_hash_update(&w->hash, &e, sizeof(e));
+    }
+    for (size_t i = 0; i < w->extent_cnt; i++)
+        if (hash_range(w, fd, w->extents[i].off, w->extents[i].len))
+            return 1;
+    return 0;
+}
+
+/*
+ * Write the header of a regular file prepared elsewhere as VAAR_DUP, with the content of the earlier file orig.
+ */
+int write_dup_header(struct writer *w, const struct file_header *hdr, const char *orig) {
+    int orig_len = (int) strlen(orig);
+    uint16_t long_name_len = 0;
+    /* Regular files have no link target, so the long name extension is right after the header. */
+    if (hdr->flags & VAAR_FLAG_LONG_NAME) {
+        memcpy(&long_name_len, file_header_ext(hdr, 0), sizeof(uint16_t));
+        long_name_len = le16toh(long_name_len);
+    }
+    int hdr_len = file_header_length(orig_len, long_name_len);
+    if (hdr_len > w->hdr_buf_len) {
+        struct file_header *new_hdr_buf = malloc(hdr_len);
+        if (new_hdr_buf == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        free(w->hdr_buf);
+        w->hdr_buf = new_hdr_buf;
+        w->hdr_buf_len = hdr_len;
+    }
+    memcpy(w->hdr_buf, hdr, sizeof(struct file_header));
+    w->hdr_buf->type = VAAR_DUP;
+    w->hdr_buf->size = 0;
+    w->hdr_buf->link_len = htole16(orig_len);
+    memcpy(w->hdr_buf->linkname, orig, orig_len + 1);
+    if (long_name_len)
+        memcpy(file_header_ext(w->hdr_buf, orig_len), file_header_ext(hdr, 0), sizeof(uint16_t) + long_name_len);
+    return writer_emit_buffer(w, w->hdr_buf, NULL, 0);
+}
+
+int writer_emit_dedup(struct writer *w, const struct file_header *hdr, const void *buf, int fd, const char *path,
+                      int root_len) {
+    uint64_t size = le64toh(hdr->size);
+    struct dedup_entry *e = dedup_table_get(w->dedup, size);
+    if (e == NULL)
+        return 1;
+    int sparse = 0;
+    if (buf == NULL && w->sparse && size > 0 && (sparse = find_extents(w, fd, size)) < 0)
+        return 1;
+
+    uint64_t hash = 0;
+    int ahead = e->contents != NULL;
+    content_hash_init(&w->hash);
+    if (ahead) {
+        /* Another content of the size has been written. This one can only be matched with it once hashed. */
+        if (buf)
+            content_hash_update(&w->hash, buf, size);
+        else if (hash_file(w, fd, size, sparse))
+            return 1;
+        hash = content_hash_final(&w->hash);
+        w->dedup->hashed++;
+        const char *orig;
+        int ret = dedup_table_find(w->dedup, e, hash, buf, fd, sparse ? w->extents : NULL,
+                                   sparse ? w->extent_cnt : 0, &orig);
+        if (ret < 0)
+            return 1;
+        if (ret)
+            return write_dup_header(w, hdr, orig);
+    }
+
+    /* The first content of its size is hashed as it's written, for later files to be matched with it. */
+    w->hashing = !ahead;
+    int ret = buf ? writer_emit_buffer(w, hdr, buf, size) : emit_file(w, hdr, fd, sparse);
+    w->hashing = 0;
+    if (ret)
+        return 1;
+    if (!ahead)
+        hash = content_hash_final(&w->hash);
+    return dedup_table_add(w->dedup, e, path, root_len, clean_path(path), hash, sparse);
+}
+
+int writer_execute_fd(struct writer *w, int fd) {
+    return writer_emit_fd(w, w->hdr_buf, fd);
+}
+
+int writer_execute_buffer(struct writer *w, void *buf, size_t len) {
+    return writer_emit_buffer(w, w->hdr_buf, buf, len);
+}
+
 void writer_free(struct writer *w) {
     free(w->hdr_buf);
     free(w->link_buf);
+    owner_map_free(&w->users);
+    owner_map_free(&w->groups);
+    free(w->v2_buf);
+    owner_map_free(&w->users_out);
+    owner_map_free(&w->groups_out);
+    release_buffers(w);
+    writer_set_chunking(w, 0, 0);
+    free(w->extents);
+    free(w->toc_entries);
+    free(w->toc_names);
 }
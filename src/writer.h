@@ -2,14 +2,34 @@
 #define VAAR_WRITER_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
+#include "dedup.h"
+#include "format.h"
+#include "owner.h"
+
+struct chunk_reader;
+struct compressor;
+struct out_ring;
+
+/*
+ * What kind of file the output is, which decides how contents sent from fds get there.
+ */
+enum writer_output {
+    OUT_FILE,
+    OUT_PIPE, /* contents are spliced into it */
+    OUT_SOCKET, /* contents are sent with sendfile64 */
+};
+
 /*
  * A wrapper for preparing and writing files.
  * The writer itself is for serial writing only. The caller should guarantee the proper order.
  */
 struct writer {
     int fd;
+    enum writer_output output;
+    int format; /* the archive format version, 1 or 2 */
 
     /* buffered header for the next file */
     struct file_header *hdr_buf;
@@ -19,25 +39,177 @@ struct writer {
     char *link_buf;
     int link_buf_len;
     int link_len;
+
+    /* owner names looked up for headers */
+    struct owner_map users, groups;
+
+    /* v2 only: the converted header, and the owner ids whose names have been written */
+    char *v2_buf;
+    int v2_buf_len;
+    struct owner_map users_out, groups_out;
+
+    /* staged output, flushed with one write when full; NULL if unbuffered */
+    char *out_buf;
+    size_t out_buf_len, out_len;
+    uint64_t off; /* output offset of the staged output */
+
+    /* io_uring output, owning the staging buffers; NULL if writes are synchronous */
+    struct out_ring *ring;
+
+    /* reader of contents sent from fds; NULL to sendfile64 them */
+    struct chunk_reader *chunks;
+
+    /* compression stage, owning the staging buffers; NULL if the output is plain */
+    struct compressor *zip;
+
+    /* whether regular files are written with a checksum, and the one of the content being written */
+    int checksum;
+    uint32_t crc;
+
+    /* the block size contents sent from fds are aligned to, to be cloned; 0 if they aren't */
+    size_t block;
+    int can_clone, can_copy; /* whether FICLONERANGE and copy_file_range may work on the output */
+
+    /* whether holes are looked for in contents sent from fds, and the data extents of the last one */
+    int sparse;
+    struct sparse_extent *extents;
+    size_t extent_cnt, extent_cap;
+
+    /* contents written so far, to write later regular files with one of them as VAAR_DUP; NULL if it's off */
+    struct dedup_table *dedup;
+    int hashing; /* whether the content being written is fed to hash, to be added to dedup */
+    struct content_hash hash;
+
+    /* whether a table of contents is written at the end, and its entries so far, in host endian */
+    int toc;
+    struct toc_entry *toc_entries;
+    size_t toc_cnt, toc_cap;
+    char *toc_names;
+    size_t toc_names_len, toc_names_cap;
 };
 
 /*
- * Initialize a writer with an output fd.
+ * Write all the data to fd, retrying on short writes.
+ */
+int write_all(int fd, const void *buf, size_t len);
+
+/*
+ * Initialize a writer with an output fd, which may be a pipe or a socket too.
+ * Pipes are enlarged to PIPE_OUT_SIZE, so that more of a content is moved with each splice.
  */
 int writer_init(struct writer *w, int fd);
 
+/*
+ * Write the archive in a format version, 1 (the default) or 2 with compact headers.
+ * Must be called before anything is written.
+ */
+int writer_set_format(struct writer *w, int format);
+
+/*
+ * Stage headers and small contents in an output buffer of size bytes, so that they are written in large batches.
+ * A size of 0 makes the writer unbuffered, which is the default.
+ */
+int writer_set_buffer(struct writer *w, size_t size);
+
+/*
+ * Like writer_set_buffer, but with buf_cnt registered buffers written asynchronously through io_uring,
+ * so that several writes are in flight. The output must be seekable.
+ */
+int writer_set_uring(struct writer *w, int buf_cnt, size_t buf_size);
+
+/*
+ * Like writer_set_buffer, but the staged output is compressed in frames of frame_size bytes by worker_cnt
+ * threads, at a zlib level, before being written. Contents sent from fds are read through the frames too.
+ * Must be called before anything is written.
+ */
+int writer_set_compression(struct writer *w, size_t frame_size, int worker_cnt, int level);
+
+/*
+ * Write a CRC-32C after the content of each regular file from now on, marked with VAAR_FLAG_CHECKSUM.
+ * Contents sent from fds are read through the writer to be summed, instead of being sent with sendfile64.
+ */
+void writer_set_checksum(struct writer *w, int checksum);
+
+/*
+ * Pad contents sent from fds to blocks of the archive, marked with VAAR_FLAG_PADDED, and clone them into it
+ * with FICLONERANGE, so that they share the storage of the files on the same filesystem. Where it doesn't work,
+ * they are copied in the kernel with copy_file_range, and sent with sendfile64 as the last resort.
+ * The archive must be a regular file, and the contents must not be compressed or summed.
+ */
+int writer_set_reflink(struct writer *w, int reflink);
+
+/*
+ * Look for holes in the contents sent from fds from now on. Files with holes are written with VAAR_FLAG_SPARSE,
+ * and only their data is read and written.
+ */
+void writer_set_sparse(struct writer *w, int sparse);
+
+/*
+ * Match the contents of regular files written with writer_emit_dedup against the earlier ones in the table,
+ * and write the ones found as VAAR_DUP. Contents sent from fds are read through the writer to be hashed, like
+ * with checksums, so they can't be cloned.
+ */
+void writer_set_dedup(struct writer *w, struct dedup_table *t);
+
+/*
+ * Record the offset of each header written from now on, to be written as a table of contents by writer_toc.
+ */
+void writer_set_toc(struct writer *w, int toc);
+
+/*
+ * Add an entry written before to the table of contents, in host endian, e.g. of an archive being appended to.
+ * The name isn't terminated, and name_off of the entry is ignored.
+ */
+int writer_add_toc(struct writer *w, const struct toc_entry *entry, const char *name);
+
+/*
+ * Read contents sent from fds in chunk_size chunks through io_uring, with up to budget bytes read ahead,
+ * instead of sending them with sendfile64. A budget of 0 turns it off, which is the default.
+ */
+int writer_set_chunking(struct writer *w, size_t chunk_size, size_t budget);
+
+/*
+ * Write everything staged to output, and wait for it to complete.
+ * A buffered writer MUST be flushed before the output is closed.
+ */
+int writer_flush(struct writer *w);
+
 /*
  * Write the magic number to output.
  * Each archive MUST have the magic number at start.
  */
 int writer_magic(struct writer *w);
 
+/*
+ * Write the table of contents of everything written, sorted by name, if it's turned on.
+ * Must be called after all the files are written, and nothing else may be written after it.
+ */
+int writer_toc(struct writer *w);
+
 /*
  * Prepare the writer for writing a file with its statx info.
- * The path will be cleaned before it's used as the eventual written name. It must be less than 256 characters.
+ * The path will be cleaned before it's used as the eventual written name.
+ * Names longer than VAAR_NAME_MAX are written with the long name extension.
  */
 int writer_prepare_statx(struct writer *w, const char *path, struct statx *s);
 
+/*
+ * Prepare the writer for writing a regular file as VAAR_DUP, with no content, since it's the same as the file
+ * written earlier with the name orig.
+ */
+int writer_prepare_dup(struct writer *w, const char *path, struct statx *s, const char *orig);
+
+/*
+ * Prepare the writer for writing a deletion marker of an archived name, with no content.
+ */
+int writer_prepare_deleted(struct writer *w, const char *name);
+
+/*
+ * Mark the prepared regular file as one with hard links, after preparing it.
+ * The first name written carries the content and the anchor. Later ones become VAAR_LNK with no content.
+ */
+void writer_prepare_hard_link(struct writer *w, uint32_t anchor, int first);
+
 /*
  * If the file to be written is a symlink, you MUST call this method before preparing it.
  * This reads and stages the linkname of the file.
@@ -45,15 +217,39 @@ int writer_prepare_statx(struct writer *w, const char *path, struct statx *s);
 int writer_prepare_link(struct writer *w, int dir_fd, const char *path);
 
 /*
- * Write the header and file content, given its fd and length.
+ * Write the header and file content, given its fd. The length is the size in the header.
  */
-int writer_execute_fd(struct writer *w, int fd, size_t len);
+int writer_execute_fd(struct writer *w, int fd);
 
 /*
  * Write the header and file content, given the content buffer and length.
  */
 int writer_execute_buffer(struct writer *w, void *buf, size_t len);
 
+/*
+ * Get the length of the prepared header.
+ */
+int writer_header_length(struct writer *w);
+
+/*
+ * Write a header prepared elsewhere and the file content, given its fd. The length is the size in the header.
+ */
+int writer_emit_fd(struct writer *w, const struct file_header *hdr, int fd);
+
+/*
+ * Write a header prepared elsewhere and the file content, given the content buffer and length.
+ */
+int writer_emit_buffer(struct writer *w, const struct file_header *hdr, const void *buf, size_t len);
+
+/*
+ * Write a regular file prepared elsewhere like writer_emit_buffer if buf isn't NULL, or writer_emit_fd otherwise,
+ * unless a file written earlier has the same content. Then it's written as VAAR_DUP of that file instead.
+ * The content is added to the table of the writer otherwise, with the file to be opened at path if it's matched.
+ * The first root_len bytes of path are the path given to be archived, and the rest is beneath it.
+ */
+int writer_emit_dedup(struct writer *w, const struct file_header *hdr, const void *buf, int fd, const char *path,
+                      int root_len);
+
 /*
  * Destroy a writer and release its space.
  */
@@ -0,0 +1,27 @@
+#!/bin/sh
+# A tree deeper than PATH_MAX is archived, listed and verified: directories are opened relative to their parents.
+# The same goes for files opened again to be matched with others.
+set -eu
+vaar=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Built from the bottom up, so no path given to a command is too long.
+name=$(printf 'd%.0s' $(seq 200))
+mkdir "$tmp/src"
+for i in $(seq 30); do
+    mkdir "$tmp/up"
+    echo "level $i" > "$tmp/up/file"
+    head -c 4096 /dev/urandom > "$tmp/up/a"
+    cp "$tmp/up/a" "$tmp/up/b"
+    mv "$tmp/src" "$tmp/up/$name"
+    mv "$tmp/up" "$tmp/src"
+done
+
+"$vaar" -j 4 "$tmp/out.vaar" "$tmp/src" > /dev/null
+[ "$("$vaar" list "$tmp/out.vaar" | grep -c '/file$')" -eq 30 ]
+"$vaar" verify "$tmp/out.vaar" > /dev/null
+
+# Each pair of copies is found to be the same, deep as it is.
+"$vaar" -j 4 -D -v "$tmp/dup.vaar" "$tmp/src" 2>&1 > /dev/null | grep -q ' 30 duplicates'
+"$vaar" verify "$tmp/dup.vaar" > /dev/null
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Read-only files are extracted by a user who can't write to them after they're created, sparse ones included.
+set -eu
+vaar=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+mkdir src dst
+head -c $((128 << 10)) /dev/urandom > src/plain
+truncate -s $((4 << 20)) src/sparse
+head -c $((64 << 10)) /dev/urandom | dd of=src/sparse bs=64k seek=16 conv=notrunc status=none
+chmod 0444 src/plain src/sparse
+"$vaar" -S out.vaar src > /dev/null
+
+# Root could write them anyway.
+as_user=
+if [ "$(id -u)" -eq 0 ]; then
+    chmod 0755 "$tmp"
+    chmod 0644 out.vaar
+    chown nobody dst
+    as_user="setpriv --reuid=nobody --regid=nogroup --clear-groups"
+fi
+$as_user "$vaar" extract -C dst out.vaar > /dev/null 2> err
+[ ! -s err ]
+for f in plain sparse; do
+    cmp src/$f dst/src/$f
+    [ "$(stat -c %a dst/src/$f)" = 444 ]
+done
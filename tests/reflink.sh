@@ -0,0 +1,28 @@
+#!/bin/sh
+# With -A, contents are cloned into the archive where the filesystem can share extents, and read back as usual.
+# Runs in $VAAR_TEST_REFLINK_DIR, or the temporary directory, and is skipped if it can't clone files there.
+set -eu
+vaar=$1
+tmp=$(mktemp -d -p "${VAAR_TEST_REFLINK_DIR:-${TMPDIR:-/tmp}}")
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+head -c 4096 /dev/urandom > probe
+if ! cp --reflink=always probe clone 2> /dev/null; then
+    echo "no reflink support in $(dirname "$tmp"), skipped"
+    exit 77
+fi
+
+mkdir src dst
+for i in $(seq 16); do
+    head -c $((i * 40000)) /dev/urandom > src/f$i
+done
+head -c $((1 << 20)) /dev/urandom > src/aligned
+ln src/aligned src/link
+"$vaar" -A out.vaar src > /dev/null
+"$vaar" verify out.vaar > /dev/null
+if command -v filefrag > /dev/null; then
+    filefrag -v out.vaar | grep -q shared
+fi
+"$vaar" extract -C dst out.vaar > /dev/null
+diff -r src dst/src
@@ -0,0 +1,30 @@
+#!/bin/sh
+# A header exactly filling the staging buffer is submitted before the content after it is read into the buffer.
+set -eu
+vaar=$1
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+cd "$tmp"
+
+# Files given one by one are written in order. Measure the headers with empty files of the same name length:
+# the first one comes with the magic and more, and t1 ends with its checksum.
+: > a
+: > b
+"$vaar" -j 1 -C -c 0 t1 a > /dev/null
+"$vaar" -j 1 -C -c 0 t2 a b > /dev/null
+first=$(stat -c %s t1)
+hdr=$(($(stat -c %s t2) - first - 4))
+
+# a with all before it and its checksum, then the header of b, ending at the end of the buffer.
+check() {
+    buf=$1
+    shift
+    head -c $((buf - first - hdr)) /dev/urandom > a
+    head -c $((128 << 10)) /dev/urandom > b # not inlined
+    "$vaar" -j 1 -C -c 0 "$@" out.vaar a b > /dev/null
+    "$vaar" verify out.vaar > /dev/null
+    rm out.vaar
+}
+check $((8 << 20))
+check $((2 << 20)) -u
+check $((2 << 20)) -z 1